@@ -9,7 +9,10 @@
 //
 
 // Includes
+#include <time.h>
+#include <sys/mman.h>
 #include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
 
 // Project Includes
 #include <fs3_cache.h>
@@ -17,7 +20,7 @@
 //
 // Support Macros/Data
 
-CACHE myCache;
+#define CACHE_LINE_BYTES(line) (cache->arena + ((size_t)(line)*FS3_SECTOR_SIZE))
 
 //
 // Implementation
@@ -31,34 +34,89 @@ CACHE myCache;
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_init_cache(uint16_t cachelines) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
     int i;
+    size_t alignment;
+    char *metadata;
 
     //Checks if cache is already initialized
-    if(myCache.initialized != 1){
-        //Allocates cacheBlocks
-        if((myCache.cacheLines = malloc(cachelines*sizeof(CACHE_LINE))) != NULL){
+    if(cache->initialized != 1){
+        //Reserves one aligned arena for every sector, aligned to huge pages if large enough
+        cache->arenaSize = (size_t)cachelines*FS3_SECTOR_SIZE;
+        alignment = FS3_CACHE_ALIGNMENT;
+        if(FS3_CACHE_USE_HUGE_PAGES && cache->arenaSize >= FS3_CACHE_HUGE_PAGE_SIZE){
+            alignment = FS3_CACHE_HUGE_PAGE_SIZE;
+            cache->arenaSize = ((cache->arenaSize+FS3_CACHE_HUGE_PAGE_SIZE-1)/FS3_CACHE_HUGE_PAGE_SIZE)*FS3_CACHE_HUGE_PAGE_SIZE;
+        }
+        if((cachelines == 0) || (posix_memalign((void **)&cache->arena, alignment, cache->arenaSize) != 0)){
+            cache->arena = NULL;
+            logMessage(FS3DriverLLevel, "Failed to initialized cache with %d lines",cachelines);
+            return(-1);
+        }
+#ifdef MADV_HUGEPAGE
+        if(alignment == FS3_CACHE_HUGE_PAGE_SIZE){
+            //Only a hint, cache works the same if the kernel declines
+            madvise(cache->arena, cache->arenaSize, MADV_HUGEPAGE);
+        }
+#endif
+
+        //Allocates line metadata as one block laid out next to each other
+        if((metadata = malloc((size_t)cachelines*(sizeof(CACHE_PREFETCH_STATS *)+3*sizeof(int)+sizeof(FS3TrackIndex)+
+                sizeof(FS3SectorIndex)+3*sizeof(uint8_t)))) != NULL){
+            cache->lines.prefetchOwner = (CACHE_PREFETCH_STATS **)metadata;
+            cache->lines.prev = (int *)(cache->lines.prefetchOwner + cachelines);
+            cache->lines.next = cache->lines.prev + cachelines;
+            cache->lines.flushOrder = cache->lines.next + cachelines;
+            cache->lines.trackIndex = (FS3TrackIndex *)(cache->lines.flushOrder + cachelines);
+            cache->lines.sectorIndex = (FS3SectorIndex *)(cache->lines.trackIndex + cachelines);
+            cache->lines.dirty = (uint8_t *)(cache->lines.sectorIndex + cachelines);
+            cache->lines.prefetched = cache->lines.dirty + cachelines;
+            cache->lines.writing = cache->lines.prefetched + cachelines;
+
             //Sets cache variables
-            myCache.size = cachelines;
-            myCache.initialized = 1;
-            myCache.lastAccessedLine = 0;
+            cache->size = cachelines;
+            cache->initialized = 1;
+            cache->cacheLinesTaken = 0;
+            cache->mostRecentLine = -1;
+            cache->leastRecentLine = -1;
+            cache->writeBack = 0;
+            cache->flush = NULL;
+            cache->dirtyLines = 0;
+            cache->flushing = 0;
+            cache->flushBuffer = NULL;
+            cache->flusherRunning = 0;
+            pthread_mutex_init(&cache->lock, NULL);
+            pthread_cond_init(&cache->flusherWake, NULL);
+            pthread_cond_init(&cache->flushDone, NULL);
 
             //Sets all lines to defult values
-            for(i=0; i<myCache.size;i++){
-                myCache.cacheLines[i].sectorBytes = NULL;
-                myCache.cacheLines[i].sectorIndex = 0;
-                myCache.cacheLines[i].trackIndex = 0;
+            for(i=0; i<cache->size;i++){
+                cache->lines.sectorIndex[i] = 0;
+                cache->lines.trackIndex[i] = 0;
+                cache->lines.prev[i] = -1;
+                cache->lines.next[i] = -1;
+                cache->lines.dirty[i] = 0;
+                cache->lines.prefetched[i] = 0;
+                cache->lines.writing[i] = 0;
+                cache->lines.prefetchOwner[i] = NULL;
             }
 
             //Sets all cache stats to zero
-            myCache.stats.gets = 0;
-            myCache.stats.hits = 0;
-            myCache.stats.inserts = 0;
-            myCache.stats.misses = 0;
+            cache->stats.gets = 0;
+            cache->stats.hits = 0;
+            cache->stats.inserts = 0;
+            cache->stats.misses = 0;
+            cache->stats.writeBacks = 0;
+            cache->stats.prefetches = 0;
+            cache->stats.prefetchHits = 0;
+            cache->stats.prefetchWasted = 0;
 
             logMessage(LOG_OUTPUT_LEVEL, "Succesfully initialized cache with %d lines",cachelines);
             return(0);
         }
         else{
+            free(cache->arena);
+            cache->arena = NULL;
             logMessage(FS3DriverLLevel, "Failed to initialized cache with %d lines",cachelines);
             return(-1);
         }
@@ -78,22 +136,40 @@ int fs3_init_cache(uint16_t cachelines) {
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_close_cache(void)  {
-    int i;
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
 
     //Checks if cache is initialized
-    if(myCache.initialized == 1){
-
-        //Frees all sectors in cache
-        for(i=0;i<myCache.cacheLinesTaken;i++){
-            free(myCache.cacheLines[i].sectorBytes);
-            myCache.cacheLines[i].sectorBytes = NULL;
+    if(cache->initialized == 1){
+
+        //Stops flusher and writes back anything still dirty
+        if(cache->flusherRunning == 1){
+            pthread_mutex_lock(&cache->lock);
+            cache->flusherRunning = 0;
+            pthread_cond_signal(&cache->flusherWake);
+            pthread_mutex_unlock(&cache->lock);
+            pthread_join(cache->flusher, NULL);
         }
-
-        //Frees cacheBlocks
-        free(myCache.cacheLines);
-        myCache.cacheLines = NULL;
-
-        logMessage(FS3DriverLLevel, "Cache closed, deleted %d items", myCache.cacheLinesTaken);
+        if(fs3_flush_cache() == -1){
+            logMessage(FS3DriverLLevel, "Cache failed to write back dirty lines on close");
+            return(-1);
+        }
+        pthread_mutex_destroy(&cache->lock);
+        pthread_cond_destroy(&cache->flusherWake);
+        pthread_cond_destroy(&cache->flushDone);
+
+        //Frees sector arena, write-back copies and line metadata (prefetchOwner is the start of the metadata block)
+        free(cache->arena);
+        cache->arena = NULL;
+        free(cache->flushBuffer);
+        cache->flushBuffer = NULL;
+        free(cache->lines.prefetchOwner);
+        memset(&cache->lines, 0, sizeof(CACHE_LINES));
+
+        //Forgets the sectors held so the cache can be initialized again
+        memset(cache->containedSectors, 0, sizeof(cache->containedSectors));
+        cache->initialized = 0;
+
+        logMessage(FS3DriverLLevel, "Cache closed, deleted %d items", cache->cacheLinesTaken);
         return(0);
     }
     else{
@@ -112,56 +188,34 @@ int fs3_close_cache(void)  {
 // Outputs      : 0 if inserted, -1 if not inserted
 
 int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
-    CACHE_LINE newCacheLine;
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
 
     //Checks if cache is initalized
-    if(myCache.initialized == 1){
-
-        //Checks if sector already in cache
-        if(myCache.containedSectors[trk][sct].contains == 1){
-            //Updates if already in cache
-            memcpy(myCache.cacheLines[myCache.containedSectors[trk][sct].loc].sectorBytes, buf, FS3_SECTOR_SIZE);
-
-            //Sets to least recently used
-            myCache.lastAccessedLine = myCache.containedSectors[trk][sct].loc;
-
-            logMessage(LOG_INFO_LEVEL, "Updated cache item Trk %d Sct %d", myCache.cacheLines[myCache.containedSectors[trk][sct].loc].trackIndex, 
-            myCache.cacheLines[myCache.containedSectors[trk][sct].loc].sectorIndex);
-            return(0);
-        }
-
-        //Sets up new cache line to put in cache
-        newCacheLine.trackIndex = trk;
-        newCacheLine.sectorIndex = sct;
-        newCacheLine.sectorBytes = malloc(FS3_SECTOR_SIZE);
-        memcpy(newCacheLine.sectorBytes, buf, FS3_SECTOR_SIZE);
-
-        //Checks if cache is full
-        if(myCache.cacheLinesTaken == myCache.size){
-            
-        logMessage(LOG_INFO_LEVEL, "Ejecting cache item Trk %d Sct %d", myCache.cacheLines[myCache.lastAccessedLine].trackIndex, 
-            myCache.cacheLines[myCache.lastAccessedLine].sectorIndex);
-
-        //Ejects LRU cache line 
-        myCache.containedSectors[myCache.cacheLines[myCache.lastAccessedLine].trackIndex][myCache.cacheLines[myCache.lastAccessedLine].sectorIndex].contains = 0;
-        free(myCache.cacheLines[myCache.lastAccessedLine].sectorBytes);
-        myCache.cacheLines[myCache.lastAccessedLine].sectorBytes = NULL;
+    if(cache->initialized == 1){
+        pthread_mutex_lock(&cache->lock);
+        do{
+            //Checks if sector already in cache
+            if(cache->containedSectors[trk][sct].contains == 1){
+                //Updates if already in cache
+                line = cache->containedSectors[trk][sct].loc;
+                memcpy(CACHE_LINE_BYTES(line), buf, FS3_SECTOR_SIZE);
+
+                //Sets to most recently used
+                cache_unlink_line(line);
+                cache_push_front(line);
+
+                logMessage(LOG_INFO_LEVEL, "Updated cache item Trk %d Sct %d", cache->lines.trackIndex[line], 
+                cache->lines.sectorIndex[line]);
+                pthread_mutex_unlock(&cache->lock);
+                return(0);
+            }
 
-         //Adds new cache line
-        myCache.cacheLines[myCache.lastAccessedLine] = newCacheLine;
-        myCache.containedSectors[trk][sct].contains = 1;
-        myCache.containedSectors[trk][sct].loc = myCache.lastAccessedLine;
-        }
-        else{
-            //Adds new cache line
-            myCache.cacheLinesTaken++;
-            myCache.cacheLines[myCache.cacheLinesTaken-1] = newCacheLine;
-            myCache.containedSectors[trk][sct].contains = 1;
-            myCache.containedSectors[trk][sct].loc = myCache.cacheLinesTaken-1;
-        }
-        logMessage(LOG_INFO_LEVEL, "Added cache item Trk %d Sct %d", trk, sct);
-        myCache.stats.inserts++;
-        return(0);
+            //Adds new cache line, updating instead if another thread added it meanwhile
+            line = cache_insert_line(trk, sct, buf);
+        }while(line == FS3_CACHE_RACED);
+        pthread_mutex_unlock(&cache->lock);
+        return((line == -1) ? -1 : 0);
     }
     else{
         logMessage(FS3DriverLLevel, "Cache not initialized");
@@ -179,33 +233,106 @@ int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
 // Outputs      : returns NULL if not found or failed, pointer to buffer if found
 
 void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct)  {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
 
     //Checks if cache is initalized
-    if(myCache.initialized == 1){
+    if(cache->initialized == 1){
+        pthread_mutex_lock(&cache->lock);
+        line = cache_lookup_line(trk, sct);
+        pthread_mutex_unlock(&cache->lock);
+        return((line == -1) ? NULL : CACHE_LINE_BYTES(line));
+    }
+    else{
+        logMessage(FS3DriverLLevel, "Cache not initialized");
+        return(NULL);
+    }
+}
 
-        myCache.stats.gets++;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_read_cache
+// Description  : Copy bytes of a cached sector out while holding the cache
+//                lock, so another thread cannot eject the line mid-copy
+//
+// Inputs       : trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+//                buf - the buffer to copy into
+//                offset - first byte of the sector to copy
+//                length - number of bytes to copy
+// Outputs      : 0 if found, -1 if not found or failed
 
-        if(myCache.containedSectors[trk][sct].contains == 1){
+int fs3_read_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, uint32_t offset, uint32_t length) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
 
-            //Sector found
-            logMessage(LOG_INFO_LEVEL, "Getting cache item Trk %d Sct %d (found!)", trk, sct);
+    //Checks if cache is initalized
+    if(cache->initialized == 1){
+        pthread_mutex_lock(&cache->lock);
+        line = cache_lookup_line(trk, sct);
+        if(line != -1){
+            memcpy(buf, CACHE_LINE_BYTES(line)+offset, length);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return((line == -1) ? -1 : 0);
+    }
+    else{
+        logMessage(FS3DriverLLevel, "Cache not initialized");
+        return(-1);
+    }
+}
 
-            //Sets time accessed
-            myCache.lastAccessedLine = myCache.containedSectors[trk][sct].loc;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_update_cache
+// Description  : Patch bytes of a cached sector in place. A write-back cache
+//                keeps the line dirty, otherwise the patched sector is copied
+//                to image for the caller to write to the device.
+//
+// Inputs       : trk - the track number of the sector to patch
+//                sct - the sector number of the sector to patch
+//                buf - the bytes to patch in
+//                offset - first byte of the sector to patch
+//                length - number of bytes to patch
+//                image - buffer of FS3_SECTOR_SIZE bytes for the patched sector
+// Outputs      : 1 if held for write-back, 0 if image filled, -1 if not cached
+
+int fs3_update_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, uint32_t offset, uint32_t length, void *image) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
+    int result;
 
-            myCache.stats.hits++;
-            return(myCache.cacheLines[myCache.containedSectors[trk][sct].loc].sectorBytes);
-        }
+    //Checks if cache is initalized
+    if(cache->initialized != 1){
+        logMessage(FS3DriverLLevel, "Cache not initialized");
+        return(-1);
+    }
 
-        //Sector not in cache
-        logMessage(LOG_INFO_LEVEL, "Getting cache item Trk %d Sct %d (not found!)", trk, sct);
-        myCache.stats.misses++;
-        return(NULL);
+    pthread_mutex_lock(&cache->lock);
+    line = cache_lookup_line(trk, sct);
+    if(line == -1){
+        pthread_mutex_unlock(&cache->lock);
+        return(-1);
+    }
+    memcpy(CACHE_LINE_BYTES(line)+offset, buf, length);
+
+    if(cache->writeBack == 1){
+        //Marks line dirty, kicking flusher once enough lines are dirty
+        if(cache->lines.dirty[line] == 0){
+            cache->lines.dirty[line] = 1;
+            cache->dirtyLines++;
+            if(cache->dirtyLines >= cache->size/FS3_CACHE_DIRTY_WATERMARK){
+                pthread_cond_signal(&cache->flusherWake);
+            }
+        }
+        result = 1;
     }
     else{
-        logMessage(FS3DriverLLevel, "Cache not initialized");
-        return(NULL);
+        memcpy(image, CACHE_LINE_BYTES(line), FS3_SECTOR_SIZE);
+        result = 0;
     }
+    pthread_mutex_unlock(&cache->lock);
+    return(result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -217,22 +344,641 @@ void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct)  {
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_log_cache_metrics(void) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
     float hitRatio;
 
     //Logs all chache matrics
     logMessage(LOG_OUTPUT_LEVEL, "** FS3 cache Metrics **");
-    logMessage(LOG_OUTPUT_LEVEL, "Cache inserts    [%d]", myCache.stats.inserts);
-    logMessage(LOG_OUTPUT_LEVEL, "Cache gets       [%d]", myCache.stats.gets);
-    logMessage(LOG_OUTPUT_LEVEL, "Cache hits       [%d]", myCache.stats.hits);
-    logMessage(LOG_OUTPUT_LEVEL, "Cache misses     [%d]", myCache.stats.misses);
+    logMessage(LOG_OUTPUT_LEVEL, "Cache inserts    [%d]", cache->stats.inserts);
+    logMessage(LOG_OUTPUT_LEVEL, "Cache gets       [%d]", cache->stats.gets);
+    logMessage(LOG_OUTPUT_LEVEL, "Cache hits       [%d]", cache->stats.hits);
+    logMessage(LOG_OUTPUT_LEVEL, "Cache misses     [%d]", cache->stats.misses);
+    if(cache->writeBack == 1){
+        logMessage(LOG_OUTPUT_LEVEL, "Cache writebacks [%d]", cache->stats.writeBacks);
+    }
 
     //Calculates hit ratio
-    if(myCache.stats.gets != 0){
-        hitRatio = (float)((float)myCache.stats.hits/(float)myCache.stats.gets)*100.0;
+    if(cache->stats.gets != 0){
+        hitRatio = (float)((float)cache->stats.hits/(float)cache->stats.gets)*100.0;
     }
     else {
         hitRatio = 0;
     }
     logMessage(LOG_OUTPUT_LEVEL, "Cache hit ratio  [%%%.2f]", hitRatio);
+
+    //Logs readahead metrics, accuracy is the share of prefetched lines later used
+    if(cache->stats.prefetches != 0){
+        logMessage(LOG_OUTPUT_LEVEL, "Cache prefetches [%d]", cache->stats.prefetches);
+        logMessage(LOG_OUTPUT_LEVEL, "Prefetch hits    [%d]", cache->stats.prefetchHits);
+        logMessage(LOG_OUTPUT_LEVEL, "Prefetch wasted  [%d]", cache->stats.prefetchWasted);
+        logMessage(LOG_OUTPUT_LEVEL, "Prefetch accuracy [%%%.2f]", 
+            (float)cache->stats.prefetchHits/(float)cache->stats.prefetches*100.0);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_check_cache
+// Description  : Check if a sector is in the cache without counting a get or
+//                changing its recency
+//
+// Inputs       : trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+// Outputs      : 1 if in cache, 0 if not
+
+int fs3_check_cache(FS3TrackIndex trk, FS3SectorIndex sct) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    return((cache->initialized == 1) && (cache->containedSectors[trk][sct].contains == 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_prefetch_cache
+// Description  : Put a sector read ahead of use in the cache, counting it for
+//                prefetch accuracy overall and for the reader that asked
+//
+// Inputs       : trk - the track number of the prefetched sector
+//                sct - the sector number of the prefetched sector
+//                buf - the sector bytes
+//                owner - prefetch counters of the reader (NULL if none)
+// Outputs      : 0 if inserted (or already present), -1 if not inserted
+
+int fs3_prefetch_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, CACHE_PREFETCH_STATS *owner) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
+
+    //Checks if cache is initalized
+    if(cache->initialized == 1){
+        pthread_mutex_lock(&cache->lock);
+
+        //Cached copy may be newer than the device
+        if(cache->containedSectors[trk][sct].contains == 1){
+            pthread_mutex_unlock(&cache->lock);
+            return(0);
+        }
+
+        line = cache_insert_line(trk, sct, buf);
+        if(line >= 0){
+            cache->lines.prefetched[line] = 1;
+            cache->lines.prefetchOwner[line] = owner;
+            cache->stats.prefetches++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return((line == -1) ? -1 : 0);
+    }
+    else{
+        logMessage(FS3DriverLLevel, "Cache not initialized");
+        return(-1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_take_cache_prefetch_stats
+// Description  : Get and clear the prefetch counts of a reader, used to adapt
+//                its readahead window to its own prefetches only
+//
+// Inputs       : owner - prefetch counters of the reader
+//                hits - address to place its prefetched lines used since last taken (NULL if not wanted)
+//                wasted - address to place its prefetched lines ejected unused since last taken (NULL if not wanted)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_take_cache_prefetch_stats(CACHE_PREFETCH_STATS *owner, int *hits, int *wasted) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+
+    //Counters are only changed under the cache lock once the cache is up
+    if(cache->initialized == 1){
+        pthread_mutex_lock(&cache->lock);
+    }
+    if(hits != NULL){
+        *hits = owner->hits;
+    }
+    if(wasted != NULL){
+        *wasted = owner->wasted;
+    }
+    owner->hits = 0;
+    owner->wasted = 0;
+    if(cache->initialized == 1){
+        pthread_mutex_unlock(&cache->lock);
+    }
     return(0);
-}
\ No newline at end of file
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_get_cache_size
+// Description  : Get the number of lines in the cache
+//
+// Inputs       : none
+// Outputs      : number of cache lines (0 if cache not initialized)
+
+uint16_t fs3_get_cache_size(void) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    return((cache->initialized == 1) ? cache->size : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_enable_cache_write_back
+// Description  : Switch the cache to write-back mode and start the flusher
+//                thread
+//
+// Inputs       : flush - function writing a sector back to the device
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_enable_cache_write_back(CACHE_FLUSH_FUNC flush) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+
+    //Checks if cache is initalized
+    if(cache->initialized == 1){
+        if(cache->writeBack == 1){
+            logMessage(FS3DriverLLevel, "Cache already write-back");
+            return(-1);
+        }
+
+        //Batches are copied out of their lines so the lock is not held while writing them
+        cache->flushBuffer = malloc((size_t)FS3_CACHE_FLUSH_BATCH*FS3_SECTOR_SIZE);
+        if(cache->flushBuffer == NULL){
+            logMessage(FS3DriverLLevel, "Failed to allocate cache write-back buffer");
+            return(-1);
+        }
+        cache->flush = flush;
+        cache->writeBack = 1;
+
+        //Starts background flusher
+        cache->flusherRunning = 1;
+        if(pthread_create(&cache->flusher, NULL, cache_flusher, fs3_ctx_current()) != 0){
+            cache->flusherRunning = 0;
+            logMessage(FS3DriverLLevel, "Failed to start cache flusher, dirty lines only written on eviction/flush");
+        }
+
+        logMessage(LOG_OUTPUT_LEVEL, "Cache set to write-back mode");
+        return(0);
+    }
+    else{
+        logMessage(FS3DriverLLevel, "Cache not initialized");
+        return(-1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mark_cache_dirty
+// Description  : Mark a cached sector as modified so it is written back later
+//
+// Inputs       : trk - the track number of the modified sector
+//                sct - the sector number of the modified sector
+// Outputs      : 0 if marked, -1 if not write-back or sector not in cache
+
+int fs3_mark_cache_dirty(FS3TrackIndex trk, FS3SectorIndex sct) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
+
+    //Checks if cache is initalized and write-back
+    if((cache->initialized != 1) || (cache->writeBack != 1)){
+        return(-1);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if(cache->containedSectors[trk][sct].contains != 1){
+        pthread_mutex_unlock(&cache->lock);
+        return(-1);
+    }
+
+    //Marks line dirty, kicking flusher once enough lines are dirty
+    line = cache->containedSectors[trk][sct].loc;
+    if(cache->lines.dirty[line] == 0){
+        cache->lines.dirty[line] = 1;
+        cache->dirtyLines++;
+        if(cache->dirtyLines >= cache->size/FS3_CACHE_DIRTY_WATERMARK){
+            pthread_cond_signal(&cache->flusherWake);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush_cache
+// Description  : Write all dirty lines back to the device in track order
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_flush_cache(void) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int result;
+
+    //Nothing can be dirty unless cache is initalized and write-back
+    if((cache->initialized != 1) || (cache->writeBack != 1)){
+        return(0);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    result = cache_flush_dirty_lines();
+    pthread_mutex_unlock(&cache->lock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_insert_line
+// Description  : Places a sector not yet in the cache in a free or ejected
+//                line as most recently used (cache lock held). If every line
+//                near the end of the recency list is dirty, the least
+//                recently used is written back first with the lock dropped.
+//
+// Inputs       : trk - the track number of the sector
+//                sct - the sector number of the sector
+//                buf - the sector bytes
+// Outputs      : line used if successful, -1 if failure, FS3_CACHE_RACED if
+//                another thread cached the sector while the lock was dropped
+
+int cache_insert_line(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
+    int result;
+
+    //Checks if cache is full
+    if(cache->cacheLinesTaken == cache->size){
+        line = cache_eject_line();
+        if(line == -1){
+            //Dirty lines must reach the device before their slot is reused
+            cache_begin_flush();
+            line = cache->leastRecentLine;
+            result = 0;
+            if(cache->lines.dirty[line] == 1){
+                result = cache_write_back_lines(&line, 1);
+            }
+            cache_end_flush();
+            if(result == -1){
+                return(-1);
+            }
+            if(cache->containedSectors[trk][sct].contains == 1){
+                return(FS3_CACHE_RACED);
+            }
+            line = cache_eject_line();
+            if(line == -1){
+                //Dirtied again or taken by another write-back meanwhile
+                return(cache_insert_line(trk, sct, buf));
+            }
+        }
+
+        logMessage(LOG_INFO_LEVEL, "Ejecting cache item Trk %d Sct %d", cache->lines.trackIndex[line], 
+            cache->lines.sectorIndex[line]);
+        if(cache->lines.prefetched[line] == 1){
+            cache->lines.prefetched[line] = 0;
+            cache->stats.prefetchWasted++;
+            if(cache->lines.prefetchOwner[line] != NULL){
+                cache->lines.prefetchOwner[line]->wasted++;
+                cache->lines.prefetchOwner[line] = NULL;
+            }
+        }
+
+        //Ejects LRU cache line, its arena slot is reused
+        cache_unlink_line(line);
+        cache->containedSectors[cache->lines.trackIndex[line]][cache->lines.sectorIndex[line]].contains = 0;
+    }
+    else{
+        //Takes next unused line
+        line = cache->cacheLinesTaken;
+        cache->cacheLinesTaken++;
+    }
+
+    //Adds new cache line as most recently used
+    cache->lines.trackIndex[line] = trk;
+    cache->lines.sectorIndex[line] = sct;
+    memcpy(CACHE_LINE_BYTES(line), buf, FS3_SECTOR_SIZE);
+    cache->containedSectors[trk][sct].contains = 1;
+    cache->containedSectors[trk][sct].loc = line;
+    cache_push_front(line);
+
+    logMessage(LOG_INFO_LEVEL, "Added cache item Trk %d Sct %d", trk, sct);
+    cache->stats.inserts++;
+    return(line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_eject_line
+// Description  : Finds the least recently used line that is neither dirty
+//                nor being written back, searching a few lines from the end
+//                of the recency list. The flusher is kicked past any dirty
+//                ones so they are clean by the time they are reached again.
+//
+// Inputs       : none
+// Outputs      : line to eject, -1 if none found
+
+int cache_eject_line(void) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line = cache->leastRecentLine;
+    int scanned;
+
+    for(scanned=0; (line != -1) && (scanned < FS3_CACHE_EJECT_SCAN); scanned++){
+        if((cache->lines.dirty[line] == 0) && (cache->lines.writing[line] == 0)){
+            if(scanned > 0){
+                pthread_cond_signal(&cache->flusherWake);
+            }
+            return(line);
+        }
+        line = cache->lines.prev[line];
+    }
+    pthread_cond_signal(&cache->flusherWake);
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_lookup_line
+// Description  : Finds the line of a sector, counting the get and making the
+//                line most recently used
+//
+// Inputs       : trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+// Outputs      : line of sector, -1 if not found
+
+int cache_lookup_line(FS3TrackIndex trk, FS3SectorIndex sct) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int line;
+
+    cache->stats.gets++;
+
+    if(cache->containedSectors[trk][sct].contains == 1){
+
+        //Sector found
+        logMessage(LOG_INFO_LEVEL, "Getting cache item Trk %d Sct %d (found!)", trk, sct);
+
+        //Sets to most recently used
+        line = cache->containedSectors[trk][sct].loc;
+        cache_unlink_line(line);
+        cache_push_front(line);
+
+        cache->stats.hits++;
+        if(cache->lines.prefetched[line] == 1){
+            //First use of a prefetched line
+            cache->lines.prefetched[line] = 0;
+            cache->stats.prefetchHits++;
+            if(cache->lines.prefetchOwner[line] != NULL){
+                cache->lines.prefetchOwner[line]->hits++;
+                cache->lines.prefetchOwner[line] = NULL;
+            }
+        }
+        return(line);
+    }
+
+    //Sector not in cache
+    logMessage(LOG_INFO_LEVEL, "Getting cache item Trk %d Sct %d (not found!)", trk, sct);
+    cache->stats.misses++;
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unlink_line
+// Description  : Removes a cache line from the recency list
+//
+// Inputs       : line - index of the cache line to remove
+// Outputs      : none
+
+void cache_unlink_line(int line) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int prev = cache->lines.prev[line];
+    int next = cache->lines.next[line];
+
+    //Points neighbours (or list ends) past the line
+    if(prev != -1){
+        cache->lines.next[prev] = next;
+    }
+    else{
+        cache->mostRecentLine = next;
+    }
+    if(next != -1){
+        cache->lines.prev[next] = prev;
+    }
+    else{
+        cache->leastRecentLine = prev;
+    }
+
+    cache->lines.prev[line] = -1;
+    cache->lines.next[line] = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_push_front
+// Description  : Places a cache line at the most recently used end of the
+//                recency list
+//
+// Inputs       : line - index of the (unlinked) cache line to place
+// Outputs      : none
+
+void cache_push_front(int line) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+
+    //Links line in ahead of the current head
+    cache->lines.prev[line] = -1;
+    cache->lines.next[line] = cache->mostRecentLine;
+    if(cache->mostRecentLine != -1){
+        cache->lines.prev[cache->mostRecentLine] = line;
+    }
+    else{
+        cache->leastRecentLine = line;
+    }
+    cache->mostRecentLine = line;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_write_back_lines
+// Description  : Writes dirty cache lines back to the device in one batch,
+//                in the order given. The lines are copied out and the cache
+//                lock is dropped while the device writes them, so lookups of
+//                other threads go on. A line being written back is not
+//                ejected, as the device may not hold it yet. (cache lock
+//                held, caller has the write-back turn)
+//
+// Inputs       : lines - indexes of the dirty cache lines
+//                count - number of lines, at most FS3_CACHE_FLUSH_BATCH
+// Outputs      : 0 if successful, -1 if failure
+
+int cache_write_back_lines(int *lines, int count) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    FS3TrackIndex trks[FS3_CACHE_FLUSH_BATCH];
+    FS3SectorIndex scts[FS3_CACHE_FLUSH_BATCH];
+    void *bufs[FS3_CACHE_FLUSH_BATCH];
+    int result;
+    int i;
+
+    //Cleared before writing so a concurrent modification re-marks it
+    for(i=0; i<count; i++){
+        cache->lines.dirty[lines[i]] = 0;
+        cache->lines.writing[lines[i]] = 1;
+        cache->dirtyLines--;
+        trks[i] = cache->lines.trackIndex[lines[i]];
+        scts[i] = cache->lines.sectorIndex[lines[i]];
+        bufs[i] = cache->flushBuffer+(size_t)i*FS3_SECTOR_SIZE;
+        memcpy(bufs[i], CACHE_LINE_BYTES(lines[i]), FS3_SECTOR_SIZE);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    result = cache->flush(trks, scts, bufs, count);
+    pthread_mutex_lock(&cache->lock);
+
+    for(i=0; i<count; i++){
+        cache->lines.writing[lines[i]] = 0;
+    }
+    if(result == -1){
+        logMessage(FS3DriverLLevel, "Failed write back of %d cache items from Trk %d Sct %d", count, trks[0], scts[0]);
+        for(i=0; i<count; i++){
+            if(cache->lines.dirty[lines[i]] == 0){
+                cache->lines.dirty[lines[i]] = 1;
+                cache->dirtyLines++;
+            }
+        }
+        return(-1);
+    }
+
+    for(i=0; i<count; i++){
+        logMessage(LOG_INFO_LEVEL, "Wrote back cache item Trk %d Sct %d", trks[i], scts[i]);
+    }
+    cache->stats.writeBacks += count;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_begin_flush
+// Description  : Waits for the turn to write lines back, one thread writes
+//                back at a time so lines it has not reached yet stay dirty
+//                (cache lock held)
+//
+// Inputs       : none
+// Outputs      : none
+
+void cache_begin_flush(void) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+
+    while(cache->flushing == 1){
+        pthread_cond_wait(&cache->flushDone, &cache->lock);
+    }
+    cache->flushing = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_end_flush
+// Description  : Gives up the turn to write lines back (cache lock held)
+//
+// Inputs       : none
+// Outputs      : none
+
+void cache_end_flush(void) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+
+    cache->flushing = 0;
+    pthread_cond_broadcast(&cache->flushDone);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_compare_lines
+// Description  : Orders cache lines by track then sector for qsort
+//
+// Inputs       : a - pointer to first line index
+//                b - pointer to second line index
+// Outputs      : <0, 0, >0 as line a sorts before, with, after line b
+
+int cache_compare_lines(const void *a, const void *b) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int lineA = *(const int *)a;
+    int lineB = *(const int *)b;
+
+    if(cache->lines.trackIndex[lineA] != cache->lines.trackIndex[lineB]){
+        return(cache->lines.trackIndex[lineA] - cache->lines.trackIndex[lineB]);
+    }
+    return(cache->lines.sectorIndex[lineA] - cache->lines.sectorIndex[lineB]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flush_dirty_lines
+// Description  : Writes all dirty lines back in track order so the device
+//                seeks each track once. Waits for any write-back already
+//                going, so every line dirty at the call is on the device at
+//                return. (cache lock held, dropped while writing)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cache_flush_dirty_lines(void) {
+    CACHE *cache = fs3_ctx_cache(fs3_ctx_current());
+    int result = 0;
+    int i;
+    int count;
+    int batch;
+
+    cache_begin_flush();
+    if(cache->dirtyLines == 0){
+        cache_end_flush();
+        return(0);
+    }
+
+    //Collects dirty lines and sorts them by track and sector
+    count = 0;
+    for(i=0; i<cache->cacheLinesTaken; i++){
+        if(cache->lines.dirty[i] == 1){
+            cache->lines.flushOrder[count] = i;
+            count++;
+        }
+    }
+    qsort(cache->lines.flushOrder, count, sizeof(int), cache_compare_lines);
+
+    //Writes lines back in batches, runs of a track go to the device together (dirty lines are never ejected)
+    for(i=0; i<count; i+=batch){
+        batch = CMPSC311_MINVAL(count-i, FS3_CACHE_FLUSH_BATCH);
+        if(cache_write_back_lines(cache->lines.flushOrder+i, batch) == -1){
+            result = -1;
+            break;
+        }
+    }
+    cache_end_flush();
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flusher
+// Description  : Background thread draining dirty lines every flush interval
+//                or when kicked past the dirty watermark
+//
+// Inputs       : arg - context of the cache
+// Outputs      : NULL
+
+void * cache_flusher(void *arg) {
+    CACHE *cache;
+    struct timespec wake;
+
+    //Writes back through the device of the context that started it
+    fs3_ctx_select((FS3_CONTEXT *)arg);
+    cache = fs3_ctx_cache(fs3_ctx_current());
+
+    pthread_mutex_lock(&cache->lock);
+    while(cache->flusherRunning == 1){
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += (long)FS3_CACHE_FLUSH_INTERVAL_MS*1000000;
+        if(wake.tv_nsec >= 1000000000){
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&cache->flusherWake, &cache->lock, &wake);
+
+        //Failed lines stay dirty and are retried next pass
+        if(cache->flusherRunning == 1){
+            cache_flush_dirty_lines();
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return(NULL);
+}
@@ -15,13 +15,26 @@
 #include <fs3_controller.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <fs3_common.h>
+#include <fs3_context.h>
 
 // Defines
 #define FS3_DEFAULT_CACHE_SIZE 2048; // 2048 cache entries, by default
+#define FS3_CACHE_ALIGNMENT 64 // Alignment of the sector arena (one CPU cache line)
+#define FS3_CACHE_HUGE_PAGE_SIZE (2*1024*1024) // Size of a transparent huge page
+#define FS3_CACHE_USE_HUGE_PAGES 1 // Hint huge pages for arenas of at least one huge page
+#define FS3_CACHE_FLUSH_INTERVAL_MS 50 // Write-back flusher wakes up at least this often
+#define FS3_CACHE_DIRTY_WATERMARK 2 // Flusher is kicked once 1/N of the lines are dirty
+#define FS3_CACHE_FLUSH_BATCH 1024 // Dirty lines written back to the device in one batch
+#define FS3_CACHE_EJECT_SCAN 32 // Least recently used lines searched for a clean one to eject
+#define FS3_CACHE_RACED -2 // Sector was cached by another thread while the cache lock was dropped
 
 //Structures
 
+//Writes a batch of sectors back to the device for a write-back cache, in order (0 if successful, -1 if failure)
+typedef int32_t (*CACHE_FLUSH_FUNC)(FS3TrackIndex *trks, FS3SectorIndex *scts, void **bufs, int count);
+
 typedef struct
 {
     int contains;   //If sector is in cache
@@ -29,12 +42,27 @@ typedef struct
 } CACHE_SECTOR;
 
 typedef CACHE_SECTOR CacheTrack[FS3_TRACK_SIZE]; // A track
+
+//Prefetch outcomes of one reader, counted by the cache as the lines it prefetched are used or ejected
 typedef struct
 {
-    FS3TrackIndex trackIndex;           //Track index of sector in cache block
-    FS3SectorIndex sectorIndex;         //Sector index of sector in cache block
-    char *sectorBytes;                  //Bytes of sector in cache block
-} CACHE_LINE;
+    int hits;       //Prefetched lines later used
+    int wasted;     //Prefetched lines ejected before use
+} CACHE_PREFETCH_STATS;
+
+//Cache line metadata, one array entry per line (line i's bytes are arena[i])
+typedef struct
+{
+    FS3TrackIndex *trackIndex;          //Track index of sector in each line
+    FS3SectorIndex *sectorIndex;        //Sector index of sector in each line
+    int *prev;                          //Next more recently used line (-1 if most recent)
+    int *next;                          //Next less recently used line (-1 if least recent)
+    uint8_t *dirty;                     //If line holds data not yet written to the device (1:true)
+    uint8_t *prefetched;                //If line was read ahead and not yet used (1:true)
+    CACHE_PREFETCH_STATS **prefetchOwner; //Counters of the reader that read the line ahead (NULL if none)
+    uint8_t *writing;                   //If line is being written back with the cache lock dropped (1:true)
+    int *flushOrder;                    //Scratch list of dirty lines sorted into track order
+} CACHE_LINES;
 
 typedef struct
 {
@@ -42,21 +70,41 @@ typedef struct
     int gets;          //Tracks gets of cache
     int hits;          //Tracks hits in cache
     int misses;        //Tracks misses in cache
+    int writeBacks;    //Tracks dirty lines written back to the device
+    int prefetches;    //Tracks lines inserted by readahead
+    int prefetchHits;  //Tracks prefetched lines later used
+    int prefetchWasted;//Tracks prefetched lines ejected before use
 } CACHE_STATS;
 typedef struct
 {
-    CACHE_LINE *cacheLines;                        //Array of cache lines
+    char *arena;                                   //Contiguous sector storage for all lines
+    size_t arenaSize;                              //Bytes reserved for the arena
+    CACHE_LINES lines;                             //Metadata of cache lines
     uint16_t size;                                 //Size of cache
     int initialized;                               //Keeps track if cache is initialized (1:true)
     CACHE_STATS stats;                             //Stats of cache
     uint16_t cacheLinesTaken;                      //Number of chache lines taken
-    int lastAccessedLine;                          //Last line accessed
-    CacheTrack containedSectors[FS3_MAX_TRACKS];     //Keeps of sectors in cache for fast search
+    int mostRecentLine;                            //Head of recency list (-1 if empty)
+    int leastRecentLine;                           //Tail of recency list, next to eject (-1 if empty)
+    CacheTrack containedSectors[FS3_VOLUME_TRACKS];  //Keeps of sectors in cache for fast search
+    int writeBack;                                 //If writes stay in cache until flushed (1:true)
+    CACHE_FLUSH_FUNC flush;                        //Writes dirty lines back to the device
+    int dirtyLines;                                //Number of dirty lines
+    int flushing;                                  //If a thread is writing lines back (1:true), one at a time
+    pthread_cond_t flushDone;                      //Signals the end of a write-back
+    char *flushBuffer;                             //Copies of a batch of lines, sent with the cache lock dropped
+    pthread_mutex_t lock;                          //Guards cache against the flusher and driver threads
+    pthread_cond_t flusherWake;                    //Signals flusher to drain or stop
+    pthread_t flusher;                             //Background flusher thread
+    int flusherRunning;                            //If flusher thread is running (1:true)
 } CACHE;
 
 //
 // Cache Functions
 
+CACHE * fs3_ctx_cache(FS3_CONTEXT *ctx);
+    // Get the cache of a context
+
 int fs3_init_cache(uint16_t cachelines);
     // Initialize the cache with a fixed number of cache lines
 
@@ -67,9 +115,69 @@ int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
     // Put an element in the cache
 
 void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct);
-    // Get an element from the cache (returns NULL if not found)
+    // Get an element from the cache (returns NULL if not found, single threaded use only)
+
+int fs3_read_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, uint32_t offset, uint32_t length);
+    // Copy bytes of a cached sector out under the cache lock (returns -1 if not found)
+
+int fs3_update_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, uint32_t offset, uint32_t length, void *image);
+    // Patch bytes of a cached sector in place (1 held for write-back, 0 image to write, -1 not found)
 
 int fs3_log_cache_metrics(void);
     // Log the metrics for the cache 
 
+int fs3_check_cache(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Check if a sector is in the cache (no stats or recency change)
+
+int fs3_prefetch_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, CACHE_PREFETCH_STATS *owner);
+    // Put a sector read ahead of use in the cache, its use or ejection counted for owner
+
+int fs3_take_cache_prefetch_stats(CACHE_PREFETCH_STATS *owner, int *hits, int *wasted);
+    // Get and clear the prefetch counts of a reader, used to adapt its readahead window
+
+uint16_t fs3_get_cache_size(void);
+    // Get the number of lines in the cache
+
+int fs3_enable_cache_write_back(CACHE_FLUSH_FUNC flush);
+    // Switch the cache to write-back mode and start the flusher thread
+
+int fs3_mark_cache_dirty(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Mark a cached sector as modified (returns -1 if cache is not write-back)
+
+int fs3_flush_cache(void);
+    // Write all dirty lines back to the device in track order
+
+int cache_lookup_line(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Finds the line of a sector and makes it most recently used (cache lock held)
+
+int cache_insert_line(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+    // Places a sector not yet in the cache as most recently used (cache lock held, may be dropped)
+
+int cache_eject_line(void);
+    // Finds the least recently used line that can be ejected without writing it back
+
+void cache_unlink_line(int line);
+    // Removes a cache line from the recency list
+
+void cache_push_front(int line);
+    // Places a cache line at the most recently used end of the recency list
+
+int cache_write_back_lines(int *lines, int count);
+    // Writes dirty cache lines back to the device in one batch, the cache lock dropped meanwhile
+
+void cache_begin_flush(void);
+    // Waits for the turn to write lines back (cache lock held)
+
+void cache_end_flush(void);
+    // Gives up the turn to write lines back (cache lock held)
+
+int cache_compare_lines(const void *a, const void *b);
+    // Orders cache lines by track then sector for qsort
+
+int cache_flush_dirty_lines(void);
+    // Writes all dirty lines back in track order (cache lock held, dropped while writing)
+
+void * cache_flusher(void *arg);
+    // Background thread draining dirty lines
+
 #endif
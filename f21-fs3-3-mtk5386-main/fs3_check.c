@@ -0,0 +1,669 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_check.c
+//  Description    : This is the check program of the FS3 client, it drives
+//                   the client directly through behaviour that a workload
+//                   file cannot express or measure exactly (e.g., a crash)
+//                   and validates the outcome. It is run by fs3_check.sh.
+//
+//   Author        : Matthew Kelleher
+//   Last Modified : 12/1/21
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Project Includes
+#include <fs3_driver.h>
+#include <fs3_common.h>
+#include <fs3_cache.h>
+#include <fs3_network.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define FS3_CHECK_LRU_LINES 3
+#define FS3_CHECK_LRU_HITS 6
+#define FS3_CHECK_LRU_MISSES 3
+#define FS3_CHECK_CACHE_LINES 64
+#define FS3_CHECK_JOURNAL_FILES 24
+#define FS3_CHECK_JOURNAL_APPEND 1000
+#define FS3_CHECK_LARGE_BYTES (4*1024*1024)
+#define FS3_CHECK_LARGE_OFFSET 1000
+#define USAGE \
+	"USAGE: fs3_check <check> [<port>[,<port>...]]\n" \
+	"\n" \
+	"where <check> is one of:\n" \
+	"    lru            - put and get a fixed sequence of sectors on a small cache\n" \
+	"                     (no server needed)\n" \
+	"    journal-crash  - write and fsync files, then exit without unmounting\n" \
+	"    journal-replay - validate the files of journal-crash across two mounts\n" \
+	"    undo-crash     - fail to create a file on a full disk, fsync another,\n" \
+	"                     then exit without unmounting\n" \
+	"    undo-replay    - validate the slot of the failed create is free after replay\n" \
+	"    read-eof       - read with pread and readv past the end of a file\n" \
+	"    large-io       - write and read a file in calls of many more sectors than\n" \
+	"                     a connection has in flight, at aligned and unaligned offsets\n" \
+	"    large-verify   - validate the file of large-io at a later mount\n" \
+	"    stripe-remount - fail to mount over one server less, then validate the\n" \
+	"                     file of large-io over every server\n" \
+	"\n" \
+
+// Functional Prototypes
+int check_pattern(char *buf, int32_t length, int file, uint32_t offset, int fill);
+int check_lru(void);
+int journal_file_length(int file);
+int check_journal_crash(void);
+int check_journal_replay(void);
+int validate_journal_files(void);
+int check_undo_crash(void);
+int check_undo_replay(void);
+int validate_file(char *name, int file, int32_t length);
+int check_read_eof(void);
+int check_large_io(void);
+int check_large_verify(void);
+int validate_large_file(int16_t fd, char *buf);
+int check_stripe_remount(void);
+
+// The checks
+typedef struct {
+	char *name;          // Name of the check on the command line
+	int (*check)(void);  // Function running the check
+} FS3Check;
+
+static FS3Check fs3_checks[] = {
+	{ "lru", check_lru },
+	{ "journal-crash", check_journal_crash },
+	{ "journal-replay", check_journal_replay },
+	{ "undo-crash", check_undo_crash },
+	{ "undo-replay", check_undo_replay },
+	{ "read-eof", check_read_eof },
+	{ "large-io", check_large_io },
+	{ "large-verify", check_large_verify },
+	{ "stripe-remount", check_stripe_remount },
+	{ NULL, NULL }
+};
+
+// The steps of the lru check, on a cache of FS3_CHECK_LRU_LINES lines
+typedef struct {
+	int put;             // 1 to put the sector, 0 to get it
+	int sector;          // Sector of track 0
+	int hit;             // If a get finds the sector (1:true)
+} FS3LruStep;
+
+static FS3LruStep fs3_lru_steps[] = {
+	{ 1, 0, 0 }, { 1, 1, 0 }, { 1, 2, 0 },  // Recency 2 1 0
+	{ 0, 0, 1 },                            // Recency 0 2 1
+	{ 1, 3, 0 },                            // Ejects 1, recency 3 0 2
+	{ 0, 1, 0 }, { 0, 2, 1 },               // Recency 2 3 0
+	{ 1, 4, 0 },                            // Ejects 0, recency 4 2 3
+	{ 0, 0, 0 }, { 0, 3, 1 },               // Recency 3 4 2
+	{ 1, 2, 0 },                            // Already cached, recency 2 3 4
+	{ 1, 5, 0 },                            // Ejects 4, recency 5 2 3
+	{ 0, 4, 0 }, { 0, 3, 1 }, { 0, 2, 1 }, { 0, 5, 1 },
+	{ -1, 0, 0 }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 check program
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if the check passed, -1 if failure
+
+int main(int argc, char *argv[]) {
+
+	// Local variables
+	FS3Check *check;
+
+	// Find the check, set the servers
+	if ( (argc != 2) && (argc != 3) ) {
+		fprintf( stderr, USAGE );
+		return( -1 );
+	}
+	for ( check=fs3_checks; (check->name != NULL) && (strcmp(check->name, argv[1]) != 0); check++ );
+	if ( check->name == NULL ) {
+		fprintf( stderr, "Unknown check [%s], aborting.\n", argv[1] );
+		return( -1 );
+	}
+	if ( (argc == 3) && (network_add_servers(argv[2], 1) == -1) ) {
+		fprintf( stderr, "Bad port number list [%s], aborting.\n", argv[2] );
+		return( -1 );
+	}
+
+	// Setup the log
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	FS3ControllerLLevel = registerLogLevel("FS3_CONTROLLER", 0); // Controller log level
+	FS3DriverLLevel= registerLogLevel("FS3_DRIVER", 0);          // Driver log level
+	FS3SimulatorLLevel= registerLogLevel("FS3_SIMULATOR", 0);    // Driver log level
+
+	// Run the check
+	if ( check->check() == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "FS3 check [%s] failed.", check->name );
+		return( -1 );
+	}
+	logMessage( LOG_INFO_LEVEL, "FS3 check [%s] passed.", check->name );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_pattern
+// Description  : Fills or checks a buffer against the contents a check gives
+//                bytes of a file
+//
+// Inputs       : buf - the buffer
+//                length - the bytes in the buffer
+//                file - the number of the file
+//                offset - the offset in the file of the buffer
+//                fill - 1 to fill the buffer, 0 to check it
+// Outputs      : 0 if the buffer matches (or was filled), -1 otherwise
+
+int check_pattern(char *buf, int32_t length, int file, uint32_t offset, int fill) {
+
+	// Local variables
+	int32_t i;
+	char expected;
+
+	for ( i=0; i<length; i++ ) {
+		expected = (char)(((offset+i)*31) + (file*7) + ((offset+i)>>10));
+		if ( fill ) {
+			buf[i] = expected;
+		} else if ( buf[i] != expected ) {
+			logMessage( LOG_ERROR_LEVEL, "File %d differs at offset %u.", file, offset+i );
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_lru
+// Description  : Puts and gets a fixed sequence of sectors on a cache of a
+//                few lines, checking each get hits or misses as least
+//                recently used ejection has it and holds the sector put
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int check_lru(void) {
+
+	// Local variables
+	FS3Sector sector;
+	FS3LruStep *step;
+	char *cached;
+	int hits = 0, misses = 0;
+
+	if ( fs3_init_cache(FS3_CHECK_LRU_LINES) == -1 ) {
+		return( -1 );
+	}
+	for ( step=fs3_lru_steps; step->put != -1; step++ ) {
+		if ( step->put ) {
+			memset( sector, 'a'+step->sector, FS3_SECTOR_SIZE );
+			if ( fs3_put_cache(0, step->sector, sector) == -1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Put of sector %d failed.", step->sector );
+				return( -1 );
+			}
+			continue;
+		}
+		cached = fs3_get_cache( 0, step->sector );
+		if ( (cached != NULL) != step->hit ) {
+			logMessage( LOG_ERROR_LEVEL, "Get of sector %d %s, expected a %s.", step->sector,
+				(cached != NULL) ? "hit" : "missed", step->hit ? "hit" : "miss" );
+			return( -1 );
+		}
+		if ( (cached != NULL) && ((cached[0] != 'a'+step->sector) || (cached[FS3_SECTOR_SIZE-1] != 'a'+step->sector)) ) {
+			logMessage( LOG_ERROR_LEVEL, "Get of sector %d found another sector.", step->sector );
+			return( -1 );
+		}
+		if ( cached != NULL ) {
+			hits++;
+		} else {
+			misses++;
+		}
+	}
+	if ( (hits != FS3_CHECK_LRU_HITS) || (misses != FS3_CHECK_LRU_MISSES) ) {
+		logMessage( LOG_ERROR_LEVEL, "Cache hit %d/missed %d, expected %d/%d.", hits, misses,
+			FS3_CHECK_LRU_HITS, FS3_CHECK_LRU_MISSES );
+		return( -1 );
+	}
+	return( fs3_close_cache() );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_file_length
+// Description  : Gets the length journal-crash writes and syncs a file to
+//
+// Inputs       : file - the number of the file
+// Outputs      : the length of the file
+
+int journal_file_length(int file) {
+	return( (FS3_CHECK_JOURNAL_APPEND*(file+1)) + (file*37) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_journal_crash
+// Description  : Creates files in interleaved appends (so their extents are
+//                fragmented), fsyncs them and exits without unmounting, so
+//                their metadata is on the disk only as journal records
+//
+// Inputs       : none
+// Outputs      : -1 if failure, does not return otherwise
+
+int check_journal_crash(void) {
+
+	// Local variables
+	char name[32], buf[FS3_CHECK_JOURNAL_APPEND];
+	int16_t fds[FS3_CHECK_JOURNAL_FILES];
+	int32_t length, done;
+	int file;
+
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) ) {
+		return( -1 );
+	}
+	for ( file=0; file<FS3_CHECK_JOURNAL_FILES; file++ ) {
+		snprintf( name, sizeof(name), "journal-%d", file );
+		if ( (fds[file]=fs3_open(name)) == -1 ) {
+			return( -1 );
+		}
+	}
+
+	// Append to every file in turn until each has its length
+	for ( done=0; done<journal_file_length(FS3_CHECK_JOURNAL_FILES-1); done+=FS3_CHECK_JOURNAL_APPEND ) {
+		for ( file=0; file<FS3_CHECK_JOURNAL_FILES; file++ ) {
+			length = CMPSC311_MINVAL(journal_file_length(file)-done, FS3_CHECK_JOURNAL_APPEND);
+			if ( length <= 0 ) {
+				continue;
+			}
+			check_pattern( buf, length, file, done, 1 );
+			if ( fs3_write(fds[file], buf, length) != length ) {
+				return( -1 );
+			}
+		}
+	}
+	for ( file=0; file<FS3_CHECK_JOURNAL_FILES; file++ ) {
+		if ( fs3_fsync(fds[file]) == -1 ) {
+			return( -1 );
+		}
+	}
+
+	// Append to the first file without a sync, then crash
+	check_pattern( buf, FS3_CHECK_JOURNAL_APPEND, 0, journal_file_length(0), 1 );
+	if ( fs3_write(fds[0], buf, FS3_CHECK_JOURNAL_APPEND) != FS3_CHECK_JOURNAL_APPEND ) {
+		return( -1 );
+	}
+	logMessage( LOG_INFO_LEVEL, "FS3 check [journal-crash] exiting without unmount." );
+	_exit( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_journal_replay
+// Description  : Validates the files of journal-crash after the mount has
+//                replayed the journal, and again after a clean unmount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int check_journal_replay(void) {
+
+	// Local variables
+	int mount;
+
+	for ( mount=0; mount<2; mount++ ) {
+		if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) ||
+				(validate_journal_files() == -1) ||
+				(fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) ) {
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_journal_files
+// Description  : Validates the contents of the files journal-crash synced
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int validate_journal_files(void) {
+
+	// Local variables
+	char name[32], *buf;
+	int32_t length, unsynced;
+	int16_t fd;
+	int file;
+
+	if ( (buf=malloc(journal_file_length(FS3_CHECK_JOURNAL_FILES-1))) == NULL ) {
+		return( -1 );
+	}
+	for ( file=0; file<FS3_CHECK_JOURNAL_FILES; file++ ) {
+		snprintf( name, sizeof(name), "journal-%d", file );
+		length = journal_file_length(file);
+
+		//The unsynced append to the first file may or may not have survived
+		unsynced = (file == 0) ? FS3_CHECK_JOURNAL_APPEND : 0;
+		if ( ((fd=fs3_open(name)) == -1) || (fs3_seek(fd, length) == -1) ||
+				(fs3_seek(fd, length+unsynced+1) != -1) || (fs3_seek(fd, 0) == -1) ||
+				(fs3_read(fd, buf, length) != length) || (check_pattern(buf, length, file, 0, 0) == -1) ||
+				(fs3_close(fd) == -1) ) {
+			logMessage( LOG_ERROR_LEVEL, "File %d of synced length %d failed validation.", file, length );
+			free( buf );
+			return( -1 );
+		}
+	}
+	free( buf );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_undo_crash
+// Description  : Fails to create a file on a disk made full, so the journal
+//                holds its create undone, fsyncs another file and exits
+//                without unmounting
+//
+// Inputs       : none
+// Outputs      : -1 if failure, does not return otherwise
+
+int check_undo_crash(void) {
+
+	// Local variables
+	char buf[FS3_CHECK_JOURNAL_APPEND];
+	TRACK_SECTOR_PAIR pair;
+	int16_t fd;
+	int track;
+
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) || ((fd=fs3_open("undo-kept")) == -1) ) {
+		return( -1 );
+	}
+	check_pattern( buf, FS3_CHECK_JOURNAL_APPEND, 0, 0, 1 );
+	if ( fs3_write(fd, buf, FS3_CHECK_JOURNAL_APPEND) != FS3_CHECK_JOURNAL_APPEND ) {
+		return( -1 );
+	}
+
+	// Every sector is taken (in memory only, the crash drops it), so the create fails
+	for ( track=0; track<FS3_VOLUME_TRACKS; track++ ) {
+		pair.trackIndex = track;
+		pair.sectorIndex = 0;
+		mark_track_sectors( pair, FS3_TRACK_SIZE, 1 );
+	}
+	if ( fs3_open("undo-failed") != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "File created on a full disk." );
+		return( -1 );
+	}
+	if ( fs3_fsync(fd) == -1 ) {
+		return( -1 );
+	}
+	logMessage( LOG_INFO_LEVEL, "FS3 check [undo-crash] exiting without unmount." );
+	_exit( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_undo_replay
+// Description  : Validates that replaying the create undone by undo-crash
+//                leaves its slot free, and that the name it had can then
+//                be created and kept across a remount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int check_undo_replay(void) {
+
+	// Local variables
+	char buf[FS3_CHECK_JOURNAL_APPEND];
+	DISK *disk;
+	int16_t fd;
+	int slot;
+
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) ) {
+		return( -1 );
+	}
+
+	// No slot may be left loaded without a name
+	disk = &fs3_ctx_current()->disk;
+	for ( slot=0; slot<FS3_MAX_TOTAL_FILES; slot++ ) {
+		if ( disk->files[slot].loaded && (disk->nameHashes[slot] == 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "Slot %d of the failed create is still loaded.", slot );
+			return( -1 );
+		}
+	}
+	if ( (validate_file("undo-kept", 0, FS3_CHECK_JOURNAL_APPEND) == -1) ||
+			(validate_file("undo-failed", 1, 0) == -1) ) {
+		return( -1 );
+	}
+
+	// The name of the failed create makes a file like any other
+	check_pattern( buf, FS3_CHECK_JOURNAL_APPEND, 1, 0, 1 );
+	if ( ((fd=fs3_open("undo-failed")) == -1) || (fs3_write(fd, buf, FS3_CHECK_JOURNAL_APPEND) != FS3_CHECK_JOURNAL_APPEND) ||
+			(fs3_close(fd) == -1) || (fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) ) {
+		return( -1 );
+	}
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) ||
+			(validate_file("undo-kept", 0, FS3_CHECK_JOURNAL_APPEND) == -1) ||
+			(validate_file("undo-failed", 1, FS3_CHECK_JOURNAL_APPEND) == -1) ||
+			(fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) ) {
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_file
+// Description  : Validates a file holds exactly a length of the bytes the
+//                check gives it
+//
+// Inputs       : name - the name of the file
+//                file - the number of the file
+//                length - the length it must have
+// Outputs      : 0 if successful, -1 if failure
+
+int validate_file(char *name, int file, int32_t length) {
+
+	// Local variables
+	char buf[FS3_CHECK_JOURNAL_APPEND];
+	int16_t fd;
+
+	if ( ((fd=fs3_open(name)) == -1) || (fs3_seek(fd, length) == -1) || (fs3_seek(fd, length+1) != -1) ||
+			(fs3_seek(fd, 0) == -1) || (fs3_read(fd, buf, length) != length) ||
+			(check_pattern(buf, length, file, 0, 0) == -1) || (fs3_close(fd) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "File [%s] of length %d failed validation.", name, length );
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_read_eof
+// Description  : Reads with pread and readv spans running past the end of a
+//                file, checking they count only the bytes in the file and
+//                readv moves the position by that much
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int check_read_eof(void) {
+
+	// Local variables
+	char buf[3*FS3_CHECK_JOURNAL_APPEND];
+	struct iovec iov[2];
+	int16_t fd;
+	int result = -1;
+
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) || ((fd=fs3_open("eof")) == -1) ) {
+		return( -1 );
+	}
+	check_pattern( buf, FS3_CHECK_JOURNAL_APPEND, 0, 0, 1 );
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 300;
+	iov[1].iov_base = buf+300;
+	iov[1].iov_len = 300;
+	if ( fs3_write(fd, buf, FS3_CHECK_JOURNAL_APPEND) != FS3_CHECK_JOURNAL_APPEND ) {
+		logMessage( LOG_ERROR_LEVEL, "Write of %d bytes failed.", FS3_CHECK_JOURNAL_APPEND );
+	} else if ( (fs3_pread(fd, buf, sizeof(buf), 500) != FS3_CHECK_JOURNAL_APPEND-500) ||
+			(check_pattern(buf, FS3_CHECK_JOURNAL_APPEND-500, 0, 500, 0) == -1) ||
+			(fs3_pread(fd, buf, 100, FS3_CHECK_JOURNAL_APPEND) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "Pread past the end of the file miscounted." );
+	} else if ( (fs3_seek(fd, 600) == -1) || (fs3_readv(fd, iov, 2) != FS3_CHECK_JOURNAL_APPEND-600) ||
+			(check_pattern(buf, FS3_CHECK_JOURNAL_APPEND-600, 0, 600, 0) == -1) ||
+			(fs3_read(fd, buf, 100) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "Readv past the end of the file miscounted." );
+	} else {
+		result = 0;
+	}
+	if ( (fs3_close(fd) == -1) || (fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) ) {
+		return( -1 );
+	}
+	return( result );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_large_io
+// Description  : Writes and reads a file in single calls of thousands of
+//                sectors, overwriting and reading spans whose ends fall
+//                within sectors, and logs the driver metrics so the script
+//                can see which sector ops were used
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int check_large_io(void) {
+
+	// Local variables
+	char *buf;
+	int32_t inner;
+	int16_t fd;
+	int result = -1;
+
+	if ( (buf=malloc(FS3_CHECK_LARGE_BYTES)) == NULL ) {
+		return( -1 );
+	}
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) || ((fd=fs3_open("large")) == -1) ) {
+		free( buf );
+		return( -1 );
+	}
+
+	// Write the file whole, then overwrite all but its first and last bytes
+	inner = FS3_CHECK_LARGE_BYTES - 2*FS3_CHECK_LARGE_OFFSET;
+	check_pattern( buf, FS3_CHECK_LARGE_BYTES, 0, 0, 1 );
+	if ( fs3_write(fd, buf, FS3_CHECK_LARGE_BYTES) != FS3_CHECK_LARGE_BYTES ) {
+		logMessage( LOG_ERROR_LEVEL, "Write of %d bytes failed.", FS3_CHECK_LARGE_BYTES );
+	} else if ( (check_pattern(buf, inner, 1, FS3_CHECK_LARGE_OFFSET, 1) == -1) ||
+			(fs3_pwrite(fd, buf, inner, FS3_CHECK_LARGE_OFFSET) != inner) ) {
+		logMessage( LOG_ERROR_LEVEL, "Write of %d bytes at offset %d failed.", inner, FS3_CHECK_LARGE_OFFSET );
+	} else {
+		result = validate_large_file(fd, buf);
+	}
+	free( buf );
+
+	fs3_log_driver_metrics();
+	if ( (fs3_close(fd) == -1) || (fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) ) {
+		return( -1 );
+	}
+	return( result );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_large_verify
+// Description  : Validates the file large-io left on the disk at a later
+//                mount (e.g., to see a volume keeps its servers)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int check_large_verify(void) {
+
+	// Local variables
+	char *buf;
+	int16_t fd;
+	int result;
+
+	if ( (buf=malloc(FS3_CHECK_LARGE_BYTES)) == NULL ) {
+		return( -1 );
+	}
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(FS3_CHECK_CACHE_LINES) == -1) || ((fd=fs3_open("large")) == -1) ) {
+		free( buf );
+		return( -1 );
+	}
+	result = validate_large_file(fd, buf);
+	free( buf );
+	if ( (fs3_close(fd) == -1) || (fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) ) {
+		return( -1 );
+	}
+	return( result );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_large_file
+// Description  : Reads the file of large-io back whole, then a span
+//                starting and ending within sectors, and validates both
+//
+// Inputs       : fd - handle of the file
+//                buf - buffer of FS3_CHECK_LARGE_BYTES bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int validate_large_file(int16_t fd, char *buf) {
+
+	// Local variables
+	int32_t inner, offset;
+
+	inner = FS3_CHECK_LARGE_BYTES - 2*FS3_CHECK_LARGE_OFFSET;
+	if ( (fs3_pread(fd, buf, FS3_CHECK_LARGE_BYTES, 0) != FS3_CHECK_LARGE_BYTES) ||
+			(check_pattern(buf, FS3_CHECK_LARGE_OFFSET, 0, 0, 0) == -1) ||
+			(check_pattern(buf+FS3_CHECK_LARGE_OFFSET, inner, 1, FS3_CHECK_LARGE_OFFSET, 0) == -1) ||
+			(check_pattern(buf+FS3_CHECK_LARGE_OFFSET+inner, FS3_CHECK_LARGE_OFFSET, 0,
+				FS3_CHECK_LARGE_OFFSET+inner, 0) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "Read of %d bytes failed validation.", FS3_CHECK_LARGE_BYTES );
+		return( -1 );
+	}
+	offset = FS3_CHECK_LARGE_OFFSET + FS3_CHECK_LARGE_OFFSET/2;
+	if ( (fs3_pread(fd, buf, inner-FS3_CHECK_LARGE_OFFSET, offset) != inner-FS3_CHECK_LARGE_OFFSET) ||
+			(check_pattern(buf, inner-FS3_CHECK_LARGE_OFFSET, 1, offset, 0) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "Read of %d bytes at offset %d failed validation.",
+			inner-FS3_CHECK_LARGE_OFFSET, offset );
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_stripe_remount
+// Description  : Fails to mount the volume of large-io over one server less
+//                than it is striped over, then mounts it over all of them
+//                in the same process and validates the file
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int check_stripe_remount(void) {
+
+	// Local variables
+	int servers = fs3_network_servers;
+
+	fs3_network_servers = servers-1;
+	if ( fs3_mount_disk() != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Volume of %d servers mounted over %d.", servers, servers-1 );
+		fs3_unmount_disk();
+		return( -1 );
+	}
+	fs3_network_servers = servers;
+	return( check_large_verify() );
+}
@@ -0,0 +1,186 @@
+#!/bin/bash
+#
+# CMPSC311 - F21 Assignment #3
+# fs3_check.sh - behaviour checks of the FS3 client against local servers
+#
+# Usage: fs3_check.sh [<check> ...] (every check if none is named)
+#
+# Run from the build directory by "make check". Each check starts its own
+# fs3_image_server instances on a scratch disk image, or the stock fs3_server
+# on its default port, so no server needs to be running beforehand.
+#
+
+CHECKS="lru journal undo eof sectors ranges stripe"
+SCRATCH=$(mktemp -d /tmp/fs3_check.XXXXXX)
+BASE_PORT=$((23000 + $$ % 5000))
+SERVER_PIDS=""
+FAILED=0
+
+#
+# Helpers
+
+# start_server <image> <port> [<options>] - serves a scratch image on a port
+start_server() {
+	local image=$1 port=$2
+	shift 2
+	./fs3_image_server -f "$SCRATCH/$image" -p "$port" "$@" > "$SCRATCH/$image.log" 2>&1 &
+	SERVER_PIDS="$SERVER_PIDS $!"
+	sleep 0.3
+}
+
+# start_stock_server <log> - runs the stock server (no extensions) on its default port
+start_stock_server() {
+	./fs3_server > "$SCRATCH/$1" 2>&1 &
+	SERVER_PIDS="$SERVER_PIDS $!"
+	sleep 0.3
+}
+
+# stop_servers - stops every server started by the check
+stop_servers() {
+	if [ -n "$SERVER_PIDS" ]; then
+		kill $SERVER_PIDS 2>/dev/null
+		wait $SERVER_PIDS 2>/dev/null
+	fi
+	SERVER_PIDS=""
+}
+
+# metric <log> <name> - gets a bracketed count logged by the client
+metric() {
+	grep -a "$2 *\[" "$1" | tail -1 | sed 's/.*\[ *\([0-9]*\)\].*/\1/'
+}
+
+# fail <message> - records a failed check
+fail() {
+	echo "FAIL: $1"
+	FAILED=1
+}
+
+#
+# Checks
+
+# check_lru - gets on a small cache hit and miss exactly as LRU ejection has it
+check_lru() {
+	if ! ./fs3_check lru > "$SCRATCH/lru.log" 2>&1; then
+		fail "lru: cache ejected other than the least recently used line (see $SCRATCH/lru.log)"
+	else
+		echo "lru: gets hit and miss as least recently used ejection has it"
+	fi
+}
+
+# check_journal - files synced before a crash survive the journal replay
+check_journal() {
+	local port=$((BASE_PORT+10))
+
+	start_server journal.img $port
+	if ! ./fs3_check journal-crash $port > "$SCRATCH/journal.log" 2>&1; then
+		fail "journal: writing before the crash failed (see $SCRATCH/journal.log)"
+	elif ! ./fs3_check journal-replay $port >> "$SCRATCH/journal.log" 2>&1; then
+		fail "journal: synced files lost after the crash (see $SCRATCH/journal.log)"
+	else
+		echo "journal: synced files survive a crash and a remount"
+	fi
+	stop_servers
+}
+
+# check_undo - a create undone before a crash leaves its slot free after the replay
+check_undo() {
+	local port=$((BASE_PORT+11))
+
+	start_server undo.img $port
+	if ! ./fs3_check undo-crash $port > "$SCRATCH/undo.log" 2>&1; then
+		fail "undo: failing a create before the crash failed (see $SCRATCH/undo.log)"
+	elif ! ./fs3_check undo-replay $port >> "$SCRATCH/undo.log" 2>&1; then
+		fail "undo: replay of the failed create went wrong (see $SCRATCH/undo.log)"
+	else
+		echo "undo: a failed create replays as a free slot"
+	fi
+	stop_servers
+}
+
+# check_eof - reads past the end of a file count only the bytes in it
+check_eof() {
+	local port=$((BASE_PORT+12))
+
+	start_server eof.img $port
+	if ! ./fs3_check read-eof $port > "$SCRATCH/eof.log" 2>&1; then
+		fail "eof: reads past the end of a file miscounted (see $SCRATCH/eof.log)"
+	else
+		echo "eof: pread and readv past the end count the bytes read"
+	fi
+	stop_servers
+}
+
+# check_sectors - calls of far more sectors than a connection has in flight
+# complete on the stock server, which grants no extensions (one command per sector)
+check_sectors() {
+	local ranges status
+
+	start_stock_server sectors-server.log
+	./fs3_check large-io > "$SCRATCH/sectors.log" 2>&1
+	status=$?
+	stop_servers
+	ranges=$(metric "$SCRATCH/sectors.log" "Range reads")
+	if [ $status -ne 0 ]; then
+		fail "sectors: large reads and writes failed (see $SCRATCH/sectors.log)"
+	elif [ "$ranges" != "0" ]; then
+		fail "sectors: $ranges range reads sent to a server without range ops"
+	else
+		echo "sectors: large reads and writes sector by sector validate"
+	fi
+}
+
+# check_ranges - large and unaligned calls validate on a server granting range ops
+check_ranges() {
+	local port=$((BASE_PORT+21)) ranges status
+
+	start_server ranges.img $port
+	./fs3_check large-io $port > "$SCRATCH/ranges.log" 2>&1
+	status=$?
+	stop_servers
+	ranges=$(metric "$SCRATCH/ranges.log" "Range reads")
+	if [ $status -ne 0 ]; then
+		fail "ranges: large reads and writes failed (see $SCRATCH/ranges.log)"
+	elif [ -z "$ranges" ] || [ "$ranges" -eq 0 ]; then
+		fail "ranges: no range reads sent to a server with range ops"
+	else
+		echo "ranges: large reads and writes in $ranges range reads validate"
+	fi
+}
+
+# check_stripe - a volume striped over three servers keeps its files across
+# mounts, and will not mount over a different number of servers (a mount
+# over the right number then succeeding in the same process)
+check_stripe() {
+	local ports="$((BASE_PORT+30)),$((BASE_PORT+31)),$((BASE_PORT+32))" port
+
+	for port in ${ports//,/ }; do
+		start_server stripe-$port.img $port
+	done
+	if ! ./fs3_check large-io $ports > "$SCRATCH/stripe.log" 2>&1; then
+		fail "stripe: large reads and writes over $ports failed (see $SCRATCH/stripe.log)"
+	elif ! ./fs3_check large-verify $ports >> "$SCRATCH/stripe.log" 2>&1; then
+		fail "stripe: file lost at a remount over $ports (see $SCRATCH/stripe.log)"
+	elif ! ./fs3_check stripe-remount $ports >> "$SCRATCH/stripe.log" 2>&1; then
+		fail "stripe: volume mounted over two of three servers, or not over three after (see $SCRATCH/stripe.log)"
+	else
+		echo "stripe: volume over three servers validates and keeps its servers"
+	fi
+	stop_servers
+}
+
+#
+# Main
+
+trap 'stop_servers; [ $FAILED -eq 0 ] && rm -rf "$SCRATCH"' EXIT
+for check in ${@:-$CHECKS}; do
+	if ! declare -F check_$check > /dev/null; then
+		fail "unknown check $check"
+		continue
+	fi
+	check_$check
+done
+if [ $FAILED -ne 0 ]; then
+	echo "FS3 checks failed"
+	exit 1
+fi
+echo "FS3 checks passed"
@@ -0,0 +1,28 @@
+#ifndef FS3_CONTEXT_INCLUDED
+#define FS3_CONTEXT_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_context.h
+//  Description    : This is the interface for selecting the FS3 context (the
+//                   disk, cache and server connection) a thread's calls use.
+//
+//  Author         : Matthew Kelleher
+//  Last Modified  : 12/1/21
+//
+
+//Structures
+
+typedef struct FS3_CONTEXT FS3_CONTEXT;	// Disk metadata, cache and connection of one FS3 server
+typedef FS3_CONTEXT fs3_ctx;			// Handle of the fs3_ctx_* interface
+
+//
+// Context Functions
+
+FS3_CONTEXT * fs3_ctx_current(void);
+	// Get the context of the calling thread (the default context unless one is selected)
+
+FS3_CONTEXT * fs3_ctx_select(FS3_CONTEXT *ctx);
+	// Make ctx the context of the calling thread (NULL for the default), returning the previous one
+
+#endif
@@ -18,7 +18,9 @@
 #define FS3_MAX_TRACKS 64
 #define FS3_TRACK_SIZE 1024
 #define FS3_SECTOR_SIZE 1024
-#define FS3_NO_TRACK (FS3_MAX_TRACKS+0xff)
+#define FS3_MAX_SERVERS 8                                   // Most servers a volume is striped over
+#define FS3_VOLUME_TRACKS (FS3_MAX_TRACKS*FS3_MAX_SERVERS)  // Tracks of a volume striped over the most servers
+#define FS3_NO_TRACK (FS3_VOLUME_TRACKS+0xff)
 
 // Type definitions
 typedef uint64_t FS3CmdBlk;                 // The command block base data type
@@ -36,10 +38,28 @@ typedef enum {
 	FS3_OP_RDSECT = 2,  // Read a sector from the disk
 	FS3_OP_WRSECT = 3,  // Write a sector to the disk
 	FS3_OP_UMOUNT = 4,  // Unmount the ffilesystem
-	FS3_OP_MAXVAL = 5   // Maximum opcode value
+	FS3_OP_TRDSECT = 5, // Read a sector of the track in the command (extension)
+	FS3_OP_TWRSECT = 6, // Write a sector of the track in the command (extension)
+	FS3_OP_RDRANGE = 7, // Read a run of sectors of the track in the command (extension)
+	FS3_OP_WRRANGE = 8, // Write a run of sectors of the track in the command (extension)
+	FS3_OP_MAXVAL = 9   // Maximum opcode value
 
 } FS3OpCodes;
 
+// Protocol extensions, offered in the low bits of a MOUNT and granted in the
+// bits above them in its reply, so a server that clears or echoes the unused
+// bits of the command block grants none
+#define FS3_EXT_BITS 5                        // Extensions that can be negotiated
+#define FS3_EXT_MASK ((1<<FS3_EXT_BITS)-1)    // Bits of the extensions offered
+#define FS3_EXT_GRANT_SHIFT FS3_EXT_BITS      // Position of the extensions granted
+#define FS3_EXT_TRACK_OPS 0x1                 // TRDSECT/TWRSECT, no track seeks needed
+#define FS3_EXT_RANGE_OPS 0x2                 // RDRANGE/WRRANGE, many sectors of a track per command
+
+// A RDRANGE/WRRANGE carries the number of sectors of its run in the low bits
+// of the command block, the run's sectors follow a WRRANGE and its reply
+#define FS3_RANGE_COUNT_MASK 0x7ff            // Bits of the sector count of a range
+#define FS3_RANGE_MAX_SECTORS FS3_TRACK_SIZE  // Longest run, a whole track
+
 //
 // Functional Prototypes
 
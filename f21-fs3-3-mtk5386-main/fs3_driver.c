@@ -10,19 +10,26 @@
 
 // Includes
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
 
 // Project Includes
 #include "fs3_driver.h"
 
 //
 // Defines
-#define SECTOR_INDEX_NUMBER(x) ((int)(x/FS3_SECTOR_SIZE))
+#define SECTOR_INDEX_NUMBER(x) ((int)((x)/FS3_SECTOR_SIZE))
 
 //
 // Static Global Variables
-DISK my_disk;
-int16_t fileHandleCounter;
+static FS3_CONTEXT defaultContext;								//Context of the fs3_* interface
+static pthread_once_t defaultContextOnce = PTHREAD_ONCE_INIT;	//Initializes defaultContext on first use
+static __thread FS3_CONTEXT *currentContext = NULL;				//Context selected by the calling thread (NULL for default)
+
+//Lock order (of a context): metadataLock, namespaceLock, file access, file state, allocLock,
+//journalLock, then the cache, connection and device locks
 
 //
 // Implementation
@@ -36,16 +43,21 @@ int16_t fileHandleCounter;
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t fs3_mount_disk(void) {
+	DISK *disk = &fs3_ctx_current()->disk;
 	FS3CmdBlk mount;
 	FS3CmdBlk cmd;
 	uint8_t returnVal;
+	int32_t result;
+
+	pthread_rwlock_wrlock(&disk->metadataLock);
 
 	//Checks if disk is already mounted
-	if(my_disk.mounted != 1){
-		//Mounts disk
-		cmd = construct_fs3cmdblock(FS3_OP_MOUNT,0,0,0);
+	if(disk->mounted != 1){
+		//Mounts disk, offering protocol extensions (the stock server grants none)
+		cmd = construct_fs3cmdblock(FS3_OP_MOUNT,0,0,0)|FS3_DRIVER_EXTENSIONS;
 		if(network_fs3_syscall(cmd,&mount,NULL)==-1){
 			//Failed syscall
+			pthread_rwlock_unlock(&disk->metadataLock);
 			return(-1);
 		}
 
@@ -53,22 +65,49 @@ int32_t fs3_mount_disk(void) {
 		deconstruct_fs3cmdblock(mount,NULL,NULL,NULL,&returnVal);
 		if (returnVal == 0){
 			//Mount successful
-			logMessage(FS3DriverLLevel, "FS3 DRVR: Mounted");
-			my_disk.mounted = 1;
-			tseek(0);
-			my_disk.currentTrackIndex = 0;
-			return(0);
+			disk->mounted = 1;
+			disk->extensions = (mount>>FS3_EXT_GRANT_SHIFT)&FS3_EXT_MASK&FS3_DRIVER_EXTENSIONS;
+			disk->servers = network_fs3_servers();
+			logMessage(FS3DriverLLevel, "FS3 DRVR: Mounted over %d servers (extensions 0x%x)",disk->servers,disk->extensions);
+			reset_connection_tracks();
+			disk->currentTrackIndex = 0;
+
+			//Sector commands carry their track if the server takes them, else the device starts at track 0
+			if(!(disk->extensions & FS3_EXT_TRACK_OPS)){
+				tseek(0);
+			}
+
+			//Only the superblock is read now, the rest of the metadata on first use
+			result = load_superblock();
+			if(result == -1){
+				//Servers are unmounted again and the volume state dropped, so a later mount starts afresh
+				logMessage(FS3DriverLLevel, "FS3 DRVR:  Failed to load superblock");
+				cmd = construct_fs3cmdblock(FS3_OP_UMOUNT,0,0,0);
+				if(network_fs3_syscall(cmd,&mount,NULL)==-1){
+					logMessage(FS3DriverLLevel, "FS3 DRVR:  Failed to unmount after a failed mount");
+				}
+				disk->mounted = 0;
+				disk->extensions = 0;
+				disk->servers = 0;
+				disk->currentTrackIndex = 0;
+				reset_connection_tracks();
+				release_file_table();
+			}
+			pthread_rwlock_unlock(&disk->metadataLock);
+			return(result);
 		}
 		else {
 			//Mount failed
 			logMessage(FS3DriverLLevel, "FS3 DRVR:  Mounting Failed");
-			my_disk.mounted = 0;
+			disk->mounted = 0;
+			pthread_rwlock_unlock(&disk->metadataLock);
 			return(-1);
 		}
 	}
 	else{
 		//Disk already mounted
 		logMessage(FS3DriverLLevel, "FS3 DRVR:  Disk already mounted");
+		pthread_rwlock_unlock(&disk->metadataLock);
 		return(-1);
 	}
 }
@@ -82,16 +121,40 @@ int32_t fs3_mount_disk(void) {
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t fs3_unmount_disk(void) {
+	DISK *disk = &fs3_ctx_current()->disk;
 	FS3CmdBlk unmount;
 	FS3CmdBlk cmd;
 	uint8_t returnVal;
 	int i;
 
-	if(my_disk.mounted != 0){
+	//Waits for calls in progress, none start until unmounted
+	pthread_rwlock_wrlock(&disk->metadataLock);
+
+	if(disk->mounted != 0){
+		//Writes back coalesced appends and cached writes before disconnecting
+		for(i = 0; i<FS3_MAX_TOTAL_FILES; i++){
+			if((disk->files[i].open == 1) && (flush_file_tail(&disk->files[i]) == -1)){
+				logMessage(FS3DriverLLevel, "FS3 DRVR:  Failed to flush file tail before unmount");
+				pthread_rwlock_unlock(&disk->metadataLock);
+				return(-1);
+			}
+		}
+		if(fs3_flush_cache() == -1){
+			logMessage(FS3DriverLLevel, "FS3 DRVR:  Failed to flush cache before unmount");
+			pthread_rwlock_unlock(&disk->metadataLock);
+			return(-1);
+		}
+		if(sync_metadata() == -1){
+			logMessage(FS3DriverLLevel, "FS3 DRVR:  Failed to write metadata before unmount");
+			pthread_rwlock_unlock(&disk->metadataLock);
+			return(-1);
+		}
+
 		//Unmounts disk
 		cmd = construct_fs3cmdblock(FS3_OP_UMOUNT,0,0,0);
 		if(network_fs3_syscall(cmd,&unmount,NULL)==-1){
 			//Failed syscall
+			pthread_rwlock_unlock(&disk->metadataLock);
 			return(-1);
 		}
 
@@ -100,25 +163,27 @@ int32_t fs3_unmount_disk(void) {
 		if (returnVal == 0){
 			//Unmount successful
 			logMessage(FS3DriverLLevel, "FS3 DRVR: Unmounted");
-			my_disk.mounted = 0;
-			my_disk.currentTrackIndex = 0;
-
-			//Closes all files
-			for(i = 0; i<FS3_MAX_TOTAL_FILES; i++){
-				my_disk.files[i].open = 0;
-				my_disk.files[i].pos = 0;
-			}
+			disk->mounted = 0;
+			disk->extensions = 0;
+			disk->currentTrackIndex = 0;
+			reset_connection_tracks();
+
+			//Closes all files, the next mount reads them back from disk
+			release_file_table();
+			pthread_rwlock_unlock(&disk->metadataLock);
 			return(0);
 		}
 		else {
 			//Unmount failed
 			logMessage(FS3DriverLLevel, "FS3 DRVR:  Unmounting Failed");
+			pthread_rwlock_unlock(&disk->metadataLock);
 			return(-1);
 		}
 	}
 	else{
 		//Disk already unmounted
 		logMessage(FS3DriverLLevel, "FS3 DRVR:  Disk already unmounted");
+		pthread_rwlock_unlock(&disk->metadataLock);
 		return(-1);
 	}
 }
@@ -132,65 +197,17 @@ int32_t fs3_unmount_disk(void) {
 // Outputs      : file handle if successful, -1 if failure
 
 int16_t fs3_open(char *path) {
-	int i;
-	int16_t fileHandle;
-	TRACK_SECTOR_PAIR tempPair;
-
-	//Set file descriptor
-	fileHandle = fileHandleCounter;
-
-	//Checks if file already exists
-	for (i=0;i<FS3_MAX_TOTAL_FILES;i++){
-		if(strcmp(my_disk.files[i].name,path) == 0){
-
-			//Checks if file is already open
-			if(my_disk.files[i].open == 1){
-				logMessage(FS3DriverLLevel, "File already open");
-				return(my_disk.files[i].fileHandle);
-			}
-
-			//Opens file if it exists and not yet open
-			else{
-				logMessage(FS3DriverLLevel, "Driver opening existing file [%s]",path);
-
-				//Updates file information
-				my_disk.files[i].open = 1;
-				my_disk.files[i].pos = 0;
-
-				return (my_disk.files[i].fileHandle); 
-			}
-		}
-	}
-	//Creates new file if didn't already exist
-	logMessage(FS3DriverLLevel, "Driver creating new file [%s]",path);
-	i=0;
-	while(my_disk.files[i].name[0] != '\0'){
-		i++;
-	}
-
-	//Saves file information 
-	strcpy(my_disk.files[i].name, path);
-	my_disk.files[i].fileHandle = fileHandle;
-	my_disk.files[i].open = 1;
-	my_disk.files[i].pos = 0;
-	my_disk.files[i].length = 0;
-	my_disk.files[i].numOfSectors = 0;
-
-	//Sets starting track and sector of file
-	if(get_free_track_sector_pair(&tempPair) == 0){
-		my_disk.files[i].loc[0] = tempPair;
-		my_disk.files[i].numOfSectors++;
-	}
-	else{
-		logMessage(FS3DriverLLevel, "FS3 driver: failed to allocat fs3 track and sector");
-		return(-1);
-	}
-
-	logMessage(FS3DriverLLevel, "File [%s] opened in driver, fh, %d.",my_disk.files[i].name,my_disk.files[i].fileHandle);
-	logMessage(FS3DriverLLevel, "FS3 driver: allocated fs3 track %d, sector %d for fh/index %d/%d"
-		,my_disk.files[i].loc[0].trackIndex,my_disk.files[i].loc[0].sectorIndex,my_disk.files[i].fileHandle,my_disk.files[i].pos);
-	fileHandleCounter++;
-	return (fileHandle); 
+	DISK *disk = &fs3_ctx_current()->disk;
+	int16_t fd;
+
+	//Opens and creates are serialized, other calls on open files carry on
+	pthread_rwlock_rdlock(&disk->metadataLock);
+	pthread_mutex_lock(&disk->namespaceLock);
+	fd = open_file(path);
+	pthread_mutex_unlock(&disk->namespaceLock);
+	pthread_rwlock_unlock(&disk->metadataLock);
+	checkpoint_if_wanted();
+	return(fd);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -202,28 +219,43 @@ int16_t fs3_open(char *path) {
 // Outputs      : 0 if successful, -1 if failure
 
 int16_t fs3_close(int16_t fd) {
+	DISK *disk = &fs3_ctx_current()->disk;
 	FILE_INFO *file;
+	int16_t result = 0;
 
 	//Gets reference to file from file handle (returns NULL file handle not associated with file or file not open)
-	file = get_file(fd);
+	pthread_rwlock_rdlock(&disk->metadataLock);
+	pthread_mutex_lock(&disk->namespaceLock);
+	file = lock_file(fd, 1);
 
 	//Checks if file exsits and is open
 	if(file != NULL){
-		//Closes file
-		file->open = 0;
-		file->pos = 0;
-		return(0);
+		//Writes back coalesced appends, cached writes and then commits metadata changes
+		if((flush_file_tail(file) == -1) || (fs3_flush_cache() == -1) || (commit_journal() == -1)){
+			logMessage(FS3DriverLLevel, "FS3 DRVR: failed to flush cache on close of fh %d",fd);
+			result = -1;
+		}
+		else{
+			//Closes file
+			file->open = 0;
+			file->pos = 0;
+		}
+		unlock_file(file);
 	}
 	else{
 		//File handle not associated with file or file not open
-		return(-1);
+		result = -1;
 	}
+	pthread_mutex_unlock(&disk->namespaceLock);
+	pthread_rwlock_unlock(&disk->metadataLock);
+	checkpoint_if_wanted();
+	return(result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_read
-// Description  : Reads "count" bytes from the file handle "fh" into the 
+// Description  : Reads "count" bytes from the file handle "fh" into the
 //                buffer "buf"
 //
 // Inputs       : fd - filename of the file to read from
@@ -232,117 +264,15 @@ int16_t fs3_close(int16_t fd) {
 // Outputs      : bytes read if successful, -1 if failure
 
 int32_t fs3_read(int16_t fd, void *buf, int32_t count) {
-	FILE_INFO *file;
-	FS3CmdBlk read;
-	FS3CmdBlk cmd;
-	uint8_t returnVal;
-	char *temp_buf;;
-	char *file_buf;
-	int i;
-	int totalBytesToRead;
-	int bytesRead;
-	void *cacheReturn;
-	int endSector;
-
-	//Gets reference to file from file handle (returns NULL file handle not associated with file or file not open)
-	file = get_file(fd);
-	
-	//Checks if file exsits and is open
-	if(file != NULL){
-		
-		//Tracks bytes needed to still read and bytes read on current sector
-		totalBytesToRead = (1+(SECTOR_INDEX_NUMBER((file->pos + count))-SECTOR_INDEX_NUMBER(file->pos)))*FS3_SECTOR_SIZE;
-		bytesRead =0;
-
-		//Buf of all file bytes needed
-		file_buf = malloc(totalBytesToRead);
-		temp_buf = malloc(FS3_SECTOR_SIZE);
-
-		//Find ending sector of read
-		if(count % FS3_SECTOR_SIZE == 0){
-			endSector = (SECTOR_INDEX_NUMBER((file->pos + count))-1);
-		}
-		else{
-			endSector = SECTOR_INDEX_NUMBER((file->pos + count));
-		}
+	struct iovec segment = {buf, (count > 0) ? (size_t)count : 0};
 
-		//Seeks to all tracks and sectors of given file and reads
-		for(i = SECTOR_INDEX_NUMBER(file->pos); i <= endSector; i++){
-
-			//Gets cache
-			cacheReturn = fs3_get_cache(file->loc[i].trackIndex,file->loc[i].sectorIndex);
-			//Checks if sector is in cache
-			if(cacheReturn==NULL){
-				//Reads sector of given file
-				if (file->loc[i].trackIndex != my_disk.currentTrackIndex){
-					tseek(file->loc[i].trackIndex);
-				}
-				cmd = construct_fs3cmdblock(FS3_OP_RDSECT,file->loc[i].sectorIndex,0,0);
-				if(network_fs3_syscall(cmd,&read,temp_buf)==-1){
-					//Failed syscall
-					return(-1);
-				}
-
-				//Checks if file read was succesful 
-				deconstruct_fs3cmdblock(read,NULL,NULL,NULL,&returnVal);
-
-				if(returnVal == 0){
-					fs3_put_cache(file->loc[i].trackIndex,file->loc[i].sectorIndex,temp_buf);
-				}
-				else{
-					//Failed read
-					free(file_buf);
-					free(temp_buf);
-					file_buf = NULL;
-					temp_buf = NULL;
-					logMessage(FS3DriverLLevel, "FS3 DRVR: failed read on fh %d (%d bytes)",fd,count);
-					return(-1);
-					}
-			}
-			else{
-				memcpy(temp_buf,cacheReturn,FS3_SECTOR_SIZE);
-			}
-				
-			//Combines read of sector in filebuf
-			if(totalBytesToRead > FS3_SECTOR_SIZE){
-				memcpy(&file_buf[bytesRead], temp_buf, FS3_SECTOR_SIZE);
-				totalBytesToRead -= FS3_SECTOR_SIZE;
-				bytesRead += FS3_SECTOR_SIZE;
-			}
-			else{
-				memcpy(&file_buf[bytesRead], temp_buf, totalBytesToRead);
-			}
-		}
-
-		//Read needed section of filebuf into buf
-		if((file->pos)+count>file->length){
-			memcpy(buf, file_buf + (file->pos-(SECTOR_INDEX_NUMBER(file->pos)*FS3_SECTOR_SIZE)), (file->length-file->pos));
-			file->pos = file->length;
-		}
-		else{
-			memcpy(buf, file_buf + (file->pos-(SECTOR_INDEX_NUMBER(file->pos)*FS3_SECTOR_SIZE)), count);
-			file->pos += count;
-		}
-
-		//Frees file buf
-		free(file_buf);
-		free(temp_buf);
-		file_buf = NULL;
-		temp_buf = NULL;
-
-		logMessage(FS3DriverLLevel, "FS3 DRVR: read successful on fh %d (%d bytes)",fd,count);
-		return(count);
-	}
-	else{
-		//File handle not associated with file or file not open
-		return (-1);
-	}
+	return(read_file_handle(fd, &segment, 1, 0, 0));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_write
-// Description  : Writes "count" bytes to the file handle "fh" from the 
+// Description  : Writes "count" bytes to the file handle "fh" from the
 //                buffer  "buf"
 //
 // Inputs       : fd - filename of the file to write to
@@ -351,128 +281,76 @@ int32_t fs3_read(int16_t fd, void *buf, int32_t count) {
 // Outputs      : bytes written if successful, -1 if failure
 
 int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
-	FILE_INFO *file;
-	FS3CmdBlk write;
-	FS3CmdBlk cmd;
-	uint8_t returnVal;
-	char *temp_buf;
-	char *write_buf;
-	TRACK_SECTOR_PAIR tempPair;
-	int32_t totalBytesWritten;
-	int32_t bytesWritten;
-	uint32_t originalPos;
-
-	//Gets reference to file from file handle (returns NULL file handle not associated with file or file not open)
-	file = get_file(fd);
-
-	//Checks if file exsits and is open
-	if(file != NULL){
+	struct iovec segment = {buf, (count > 0) ? (size_t)count : 0};
 
-		//Tracks bytes writtten in total and during current sector write
-		totalBytesWritten = 0;
-		bytesWritten = 0;
-		
-		//Reads all needed sectors of file for write
-		while(totalBytesWritten<count){
+	return(write_file_handle(fd, &segment, 1, 0, 0));
+}
 
-			//Saves original pos of file before read of sector
-			originalPos = file->pos;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_pread
+// Description  : Reads "count" bytes at "offset" of the file handle "fh"
+//                into the buffer "buf" without moving the file position, so
+//                readers sharing a file need not seek
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                offset - offset of the first byte read (at most the file length)
+// Outputs      : bytes read if successful, -1 if failure
 
-			//Reads current sector to wite
-			if(fs3_seek(fd,SECTOR_INDEX_NUMBER(file->pos)*FS3_SECTOR_SIZE)!=-1){
+int32_t fs3_pread(int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	struct iovec segment = {buf, (count > 0) ? (size_t)count : 0};
 
-				temp_buf = malloc(FS3_SECTOR_SIZE);
+	return(read_file_handle(fd, &segment, 1, 1, offset));
+}
 
-				//If the sector is full reads the whole sector
-				if(SECTOR_INDEX_NUMBER(originalPos) < (file->numOfSectors)-1){
-					fs3_read(fd,temp_buf,FS3_SECTOR_SIZE);
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_pwrite
+// Description  : Writes "count" bytes at "offset" of the file handle "fh"
+//                from the buffer "buf" without moving the file position
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                offset - offset of the first byte written (at most the file length)
+// Outputs      : bytes written if successful, -1 if failure
 
-				//If the sector is partially full read part of the sector
-				else if (SECTOR_INDEX_NUMBER(originalPos) == (file->numOfSectors)-1){
-					fs3_read(fd,temp_buf,(file->length-((SECTOR_INDEX_NUMBER(originalPos))*FS3_SECTOR_SIZE)));
-				}
+int32_t fs3_pwrite(int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	struct iovec segment = {buf, (count > 0) ? (size_t)count : 0};
 
-				//If still need to write more bytes and out of sectors allocate new sector to write
-				else{
-					//Allocates new sector to file
-					if(get_free_track_sector_pair(&tempPair) == 0){
-						file->loc[file->numOfSectors] = tempPair;
-						logMessage(FS3DriverLLevel, "FS3 driver: allocated fs3 track %d, sector %d for fh/index %d/%d"
-							,file->loc[file->numOfSectors].trackIndex,file->loc[file->numOfSectors].sectorIndex,file->fileHandle, file->pos);
-						file->numOfSectors++;
-					}
-				}
+	return(write_file_handle(fd, &segment, 1, 1, offset));
+}
 
-				//Seeks back to original pos to write
-				fs3_seek(fd,originalPos);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readv
+// Description  : Reads from the position of the file handle "fh" into each
+//                buffer segment in turn, every sector read in one batch
+//
+// Inputs       : fd - filename of the file to read from
+//                iov - buffer segments to read into
+//                iovcnt - number of segments
+// Outputs      : bytes read if successful, -1 if failure
 
-				//Bytes to write
-				write_buf = malloc(count-totalBytesWritten);
-				memcpy(write_buf, buf + totalBytesWritten, count-totalBytesWritten);
+int32_t fs3_readv(int16_t fd, const struct iovec *iov, int iovcnt) {
+	return(read_file_handle(fd, iov, iovcnt, 0, 0));
+}
 
-				//Creates buf to write the amount of bytes that fits into sector
-				if((count-totalBytesWritten)>(FS3_SECTOR_SIZE-(file->pos%FS3_SECTOR_SIZE))){
-					memcpy(&temp_buf[(file->pos)%FS3_SECTOR_SIZE],write_buf,(FS3_SECTOR_SIZE-(file->pos%FS3_SECTOR_SIZE)));
-					bytesWritten = FS3_SECTOR_SIZE-(file->pos%FS3_SECTOR_SIZE);
-					totalBytesWritten += bytesWritten;
-				}
-				//If bytes fit in sector creates buf that write the rest of buf
-				else{
-					memcpy(&temp_buf[(file->pos)%FS3_SECTOR_SIZE],write_buf,(count-totalBytesWritten));
-					bytesWritten = count-totalBytesWritten;
-					totalBytesWritten += bytesWritten;
-				}					
-
-				//Free the write buf
-				free(write_buf);
-				write_buf = NULL;
-
-				//Writes to sector of given file
-				if(file->loc[SECTOR_INDEX_NUMBER(file->pos)].trackIndex != my_disk.currentTrackIndex){
-					tseek(file->loc[SECTOR_INDEX_NUMBER(file->pos)].trackIndex);
-				}
-				cmd = construct_fs3cmdblock(FS3_OP_WRSECT,file->loc[SECTOR_INDEX_NUMBER(file->pos)].sectorIndex,0,0);
-				if(network_fs3_syscall(cmd,&write,temp_buf)==-1){
-					//Failed syscall
-					return(-1);
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_writev
+// Description  : Writes each buffer segment in turn at the position of the
+//                file handle "fh", every sector written in one batch
+//
+// Inputs       : fd - filename of the file to write to
+//                iov - buffer segments to write from
+//                iovcnt - number of segments
+// Outputs      : bytes written if successful, -1 if failure
 
-				//Puts new write into cache
-				fs3_put_cache(file->loc[SECTOR_INDEX_NUMBER(file->pos)].trackIndex,file->loc[SECTOR_INDEX_NUMBER(file->pos)].sectorIndex, temp_buf);
-
-				//Free the sector buf after write 
-				free(temp_buf);
-				temp_buf = NULL;
-
-				//Checks if file write was succesful 
-				deconstruct_fs3cmdblock(write,NULL,NULL,NULL,&returnVal);
-				if (returnVal == 0){
-					//Updates file info after write
-					file->pos = (file->pos)+bytesWritten;
-					if(file->pos > file->length)
-						file->length = file->pos;
-					
-				}
-				else{
-					//Failed write
-					logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",fd,count);
-					return(-1);
-				}
-			}
-			else{
-				//Failed seek
-				return(-1);
-			}
-		}
-		//Returns bytes written
-		logMessage(FS3DriverLLevel, "FS3 DRVR: write on fh %d (%d bytes) [pos=%d, len=%d]",fd,count,file->pos,file->length);
-		return(totalBytesWritten);
-	}
-	else{
-		//File handle not associated with file or file not open
-		return (-1);
-	}
+int32_t fs3_writev(int16_t fd, const struct iovec *iov, int iovcnt) {
+	return(write_file_handle(fd, iov, iovcnt, 0, 0));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -485,162 +363,3682 @@ int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t fs3_seek(int16_t fd, uint32_t loc) {
+	DISK *disk = &fs3_ctx_current()->disk;
 	FILE_INFO *file;
+	int32_t result = 0;
 
 	//Gets reference to file from file handle (returns NULL file handle not associated with file or file not open)
-	file = get_file(fd);
+	pthread_rwlock_rdlock(&disk->metadataLock);
+	file = lock_file(fd, 1);
 
 	//Checks if file exsits and is open
 	if(file != NULL){
 		//Checks if loc is valid in file
 		if(file->length>=loc){
-			//Set file pos to loc 
-			file->pos = loc;
-			logMessage(FS3DriverLLevel, "File seek fh %d to %d/%d.",fd,file->pos,file->length);
-			return(0);
+			//Seeking away from the end stores coalesced appends
+			if((loc != file->length) && (flush_file_tail(file) == -1)){
+				result = -1;
+			}
+			else{
+				//Set file pos to loc
+				file->pos = loc;
+				logMessage(FS3DriverLLevel, "File seek fh %d to %d/%d.",fd,file->pos,file->length);
+			}
 		}
 		else{
 			//Loc out of range
 			logMessage(FS3DriverLLevel, "Failed file seek fh %d to %d/%d.",fd,loc,file->length);
-			return(-1);
+			result = -1;
 		}
+		unlock_file(file);
 	}
-	else{
-		//File handle not associated with file or file not open
-		return (0);
-	}
+	//File handle not associated with file or file not open returns 0
+	pthread_rwlock_unlock(&disk->metadataLock);
+	return(result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : construct_fs3cmdblock
-// Description  : Create an FS3 cmdblock from the variable feilds
+// Function     : fs3_fsync
+// Description  : Durability barrier, returns once all writes made so far
+//                (including those held by a write-back cache) are on the device
 //
-// Inputs       : op - opcode
-//                sec - sector number
-//				  trk - track number
-//				  ret - return value
-// Outputs      : contructed fs3 cmdblock
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
 
-FS3CmdBlk construct_fs3cmdblock(uint8_t op, uint16_t sec, uint_fast32_t trk, uint8_t ret){
-	FS3CmdBlk cmdblock;
-	//Places register to corisponding bits in cmdblock
-	cmdblock = 0;
-	cmdblock = ((uint64_t)op<<60); 
-	cmdblock = cmdblock | ((uint64_t)sec<<44);
-	cmdblock = cmdblock | ((uint64_t)trk<<12);
-	cmdblock = cmdblock | ((uint64_t)ret<<11);
-	return cmdblock;
+int32_t fs3_fsync(int16_t fd) {
+	DISK *disk = &fs3_ctx_current()->disk;
+	FILE_INFO *file;
+	int32_t result = 0;
+
+	//Gets reference to file from file handle (returns NULL file handle not associated with file or file not open)
+	pthread_rwlock_rdlock(&disk->metadataLock);
+	file = lock_file(fd, 1);
+
+	//Checks if file exsits and is open
+	if(file != NULL){
+		if((flush_file_tail(file) == -1) || (fs3_flush_cache() == -1) || (commit_journal() == -1)){
+			logMessage(FS3DriverLLevel, "FS3 DRVR: failed fsync on fh %d",fd);
+			result = -1;
+		}
+		else{
+			logMessage(FS3DriverLLevel, "FS3 DRVR: fsync on fh %d",fd);
+		}
+		unlock_file(file);
+	}
+	else{
+		//File handle not associated with file or file not open
+		result = -1;
+	}
+	pthread_rwlock_unlock(&disk->metadataLock);
+	return(result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : deconstruct_fs3cmdblock
-// Description  : Extracts register state from cmdblock
+// Function     : fs3_log_driver_metrics
+// Description  : Log the device command metrics for the driver
 //
-// Inputs       : cmdblock - cmdblock to extract registers from
-//				  op - opcode address
-//                sec - sector number address
-//				  trk - track number address
-//				  ret - return value address
+// Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int deconstruct_fs3cmdblock(FS3CmdBlk cmdblock, uint8_t *op, uint16_t *sec, uint_fast32_t *trk, uint8_t *ret){
-	//Isolates needed values at front of cmdblock and gets n bits dependent on register if pointer is not NULL
-	if(op != NULL)
-		*op = ((((uint64_t)1 << 4)-1)&(cmdblock>>60));
-	if(sec != NULL)
-		*sec = ((((uint64_t)1 << 16)-1)&(cmdblock>>44));
-	if(trk != NULL)
-		*trk = ((((uint64_t)1 << 32)-1)&(cmdblock>>12));
-	if(ret != NULL)
-		*ret = ((((uint64_t)1 << 1)-1)&(cmdblock>>11));
-	return 0;
+int32_t fs3_log_driver_metrics(void) {
+	DISK *disk = &fs3_ctx_current()->disk;
+
+	//Logs all device command metrics
+	logMessage(LOG_OUTPUT_LEVEL, "** FS3 driver Metrics **");
+	logMessage(LOG_OUTPUT_LEVEL, "Track seeks      [%d]", disk->stats.tseeks);
+	logMessage(LOG_OUTPUT_LEVEL, "Sector reads     [%d]", disk->stats.sectorReads);
+	logMessage(LOG_OUTPUT_LEVEL, "Sector writes    [%d]", disk->stats.sectorWrites);
+	logMessage(LOG_OUTPUT_LEVEL, "Range reads      [%d]", disk->stats.rangeReads);
+	logMessage(LOG_OUTPUT_LEVEL, "Range writes     [%d]", disk->stats.rangeWrites);
+	return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : get_file
-// Description  : Gets file associated with file handle if vailid file handle
+// Function     : fs3_ctx_current
+// Description  : Get the context the calling thread's calls use
 //
-// Inputs       : fd - file handle
-// Outputs      : File if valid fd, NULL if not valid or file not open
-
-FILE_INFO * get_file(int16_t fd){
+// Inputs       : none
+// Outputs      : selected context, the default context if none is selected
 
-	//Checks if file handle is associated with open file
-	if(my_disk.files[fd].fileHandle == fd){
-		if(my_disk.files[fd].open){
-			//Return pointer to file
-			return(&(my_disk.files[fd]));
-		}
-		else{
-			//File not open
-			logMessage(FS3DriverLLevel, "File not open: file handle(%d)",fd);
-			return(NULL);
-		}
+FS3_CONTEXT * fs3_ctx_current(void) {
+	if(currentContext != NULL){
+		return(currentContext);
 	}
-
-	//File handle isnt accociated with a file
-	logMessage(FS3DriverLLevel, "Invalid file handle: %d",fd);
-	return(NULL);
+	pthread_once(&defaultContextOnce, init_default_context);
+	return(&defaultContext);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : tseek
-// Description  : Seeks track to given track
+// Function     : fs3_ctx_select
+// Description  : Make a context the one the calling thread's calls use
 //
-// Inputs       : trackToSeek - track index to seek to 
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : ctx - context to select (NULL for the default context)
+// Outputs      : previously selected context (NULL if it was the default)
 
-int32_t tseek(FS3TrackIndex trackToSeek){
-	FS3CmdBlk tseek;
-	FS3CmdBlk cmd;
-	uint8_t returnVal;
+FS3_CONTEXT * fs3_ctx_select(FS3_CONTEXT *ctx) {
+	FS3_CONTEXT *prev = currentContext;
 
-	//Seeks track to given trackToSeek
-	cmd = construct_fs3cmdblock(FS3_OP_TSEEK,0,trackToSeek,0);
-	if(network_fs3_syscall(cmd,&tseek,NULL)==-1){
-		//Failed syscall
-		return(-1);
-	}
-	
-	deconstruct_fs3cmdblock(tseek,NULL,NULL,NULL,&returnVal);
-	if(returnVal == 0){
-		//Successful track seek
-		logMessage(FS3DriverLLevel, "Track seeked to %d",trackToSeek);
-		my_disk.currentTrackIndex = trackToSeek;
-		return(0);
-	}
-	else {
-		//Failed track seek
-		logMessage(FS3DriverLLevel, "Failed track seek to %d",trackToSeek);
-		return(-1);
-	}
+	currentContext = ctx;
+	return(prev);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : get_free_track_sector_pair
-// Description  : Finds a free track and sector pair for a file
+// Function     : fs3_ctx_cache
+// Description  : Get the sector cache of a context
 //
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : ctx - the context
+// Outputs      : cache of the context
 
-int32_t get_free_track_sector_pair(TRACK_SECTOR_PAIR *pair){
+CACHE * fs3_ctx_cache(FS3_CONTEXT *ctx) {
+	return(&ctx->cache);
+}
 
-	//Sets next open sector on disk
-	pair->trackIndex = my_disk.nextTrack;
-	pair->sectorIndex = my_disk.nextSector;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_pool
+// Description  : Get the server connection pool of a context
+//
+// Inputs       : ctx - the context
+// Outputs      : connection pool of the context
 
-	//Increments next open sector on disk 
-	my_disk.nextSector++;
+NETWORK_POOL * fs3_ctx_pool(FS3_CONTEXT *ctx) {
+	return(&ctx->pool);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_create
+// Description  : Create an unmounted context with its own disk metadata,
+//                cache and connection pool
+//
+// Inputs       : address - address of the server (NULL for fs3_network_address)
+//                port - port of the server (0 for fs3_network_port)
+// Outputs      : the context if successful, NULL if failure
+
+fs3_ctx * fs3_ctx_create(const char *address, unsigned short port) {
+	FS3_CONTEXT *ctx;
+
+	ctx = malloc(sizeof(FS3_CONTEXT));
+	if(ctx == NULL){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to allocate context");
+		return(NULL);
+	}
+	init_context(ctx);
+	if(network_init_pool(&ctx->pool, address, port) == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to create context connection pool");
+		free(ctx);
+		return(NULL);
+	}
+	return(ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_destroy
+// Description  : Unmount the disk of a context (if mounted), close its cache
+//                (if initialized) and free it
+//
+// Inputs       : ctx - the context, no calls may be in progress on it
+// Outputs      : none
+
+void fs3_ctx_destroy(fs3_ctx *ctx) {
+	if(ctx == NULL){
+		return;
+	}
+	if(ctx->disk.mounted == 1){
+		fs3_ctx_unmount_disk(ctx);
+	}
+	if(ctx->cache.initialized == 1){
+		fs3_ctx_close_cache(ctx);
+	}
+	network_release_pool(&ctx->pool);
+	free(ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_mount_disk
+// Description  : FS3 interface, mount/initialize filesystem of a context
+//
+// Inputs       : ctx - the context
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_ctx_mount_disk(fs3_ctx *ctx) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_mount_disk();
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_unmount_disk
+// Description  : FS3 interface, unmount the disk of a context, close all files
+//
+// Inputs       : ctx - the context
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_ctx_unmount_disk(fs3_ctx *ctx) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_unmount_disk();
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_open
+// Description  : Opens a file on the disk of a context
+//
+// Inputs       : ctx - the context
+//                path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t fs3_ctx_open(fs3_ctx *ctx, char *path) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int16_t result = fs3_open(path);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_close
+// Description  : Closes a file on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t fs3_ctx_close(fs3_ctx *ctx, int16_t fd) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int16_t result = fs3_close(fd);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_read
+// Description  : Reads "count" bytes from a file on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_ctx_read(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_read(fd, buf, count);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_write
+// Description  : Writes "count" bytes to a file on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_ctx_write(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_write(fd, buf, count);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_pread
+// Description  : Reads a file at an offset on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                offset - offset in the file to read from
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_ctx_pread(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_pread(fd, buf, count, offset);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_pwrite
+// Description  : Writes a file at an offset on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                offset - offset in the file to write at
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_ctx_pwrite(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_pwrite(fd, buf, count, offset);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_readv
+// Description  : Reads a file into buffer segments on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - filename of the file to read from
+//                iov - buffer segments to read into
+//                iovcnt - number of segments
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_ctx_readv(fs3_ctx *ctx, int16_t fd, const struct iovec *iov, int iovcnt) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_readv(fd, iov, iovcnt);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_writev
+// Description  : Writes buffer segments to a file on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - filename of the file to write to
+//                iov - buffer segments to write from
+//                iovcnt - number of segments
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_ctx_writev(fs3_ctx *ctx, int16_t fd, const struct iovec *iov, int iovcnt) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_writev(fd, iov, iovcnt);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_seek
+// Description  : Seek to specific point in a file on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_ctx_seek(fs3_ctx *ctx, int16_t fd, uint32_t loc) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_seek(fd, loc);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_fsync
+// Description  : Durability barrier for a file on the disk of a context
+//
+// Inputs       : ctx - the context
+//                fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_ctx_fsync(fs3_ctx *ctx, int16_t fd) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_fsync(fd);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_log_driver_metrics
+// Description  : Log the device command metrics of a context
+//
+// Inputs       : ctx - the context
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_ctx_log_driver_metrics(fs3_ctx *ctx) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int32_t result = fs3_log_driver_metrics();
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_init_cache
+// Description  : Initialize the cache of a context
+//
+// Inputs       : ctx - the context
+//                cachelines - number of cache lines
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_ctx_init_cache(fs3_ctx *ctx, uint16_t cachelines) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int result = fs3_init_cache(cachelines);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_close_cache
+// Description  : Close the cache of a context
+//
+// Inputs       : ctx - the context
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_ctx_close_cache(fs3_ctx *ctx) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int result = fs3_close_cache();
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_enable_cache_write_back
+// Description  : Switch the cache of a context to write-back mode, its
+//                flusher writing through the same context
+//
+// Inputs       : ctx - the context
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_ctx_enable_cache_write_back(fs3_ctx *ctx) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int result = fs3_enable_cache_write_back(flush_sectors);
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_ctx_log_cache_metrics
+// Description  : Log the metrics for the cache of a context
+//
+// Inputs       : ctx - the context
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_ctx_log_cache_metrics(fs3_ctx *ctx) {
+	FS3_CONTEXT *prev = fs3_ctx_select(ctx);
+	int result = fs3_log_cache_metrics();
+
+	fs3_ctx_select(prev);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_context
+// Description  : Initializes an unmounted context and the locks of its disk
+//                (its connection pool is initialized by the caller)
+//
+// Inputs       : ctx - context to initialize
+// Outputs      : none
+
+void init_context(FS3_CONTEXT *ctx) {
+	DISK *disk = &ctx->disk;
+	int i;
+
+	memset(ctx, 0, sizeof(FS3_CONTEXT));
+	pthread_mutex_init(&disk->deviceLock, NULL);
+	for(i=0; i<FS3_MAX_CONNECTIONS; i++){
+		pthread_mutex_init(&disk->connectionLocks[i], NULL);
+	}
+	pthread_rwlock_init(&disk->metadataLock, NULL);
+	pthread_mutex_init(&disk->namespaceLock, NULL);
+	pthread_mutex_init(&disk->allocLock, NULL);
+	pthread_mutex_init(&disk->journalLock, NULL);
+	for(i=0; i<FS3_MAX_TOTAL_FILES; i++){
+		pthread_rwlock_init(&disk->fileLocks[i].access, NULL);
+		pthread_mutex_init(&disk->fileLocks[i].state, NULL);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_default_context
+// Description  : Initializes the default context, which connects to
+//                fs3_network_address and fs3_network_port at mount
+//
+// Inputs       : none
+// Outputs      : none
+
+void init_default_context(void) {
+	init_context(&defaultContext);
+	network_init_pool(&defaultContext.pool, NULL, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : construct_fs3cmdblock
+// Description  : Create an FS3 cmdblock from the variable feilds
+//
+// Inputs       : op - opcode
+//                sec - sector number
+//				  trk - track number
+//				  ret - return value
+// Outputs      : contructed fs3 cmdblock
+
+FS3CmdBlk construct_fs3cmdblock(uint8_t op, uint16_t sec, uint_fast32_t trk, uint8_t ret){
+	FS3CmdBlk cmdblock;
+	//Places register to corisponding bits in cmdblock
+	cmdblock = 0;
+	cmdblock = ((uint64_t)op<<60); 
+	cmdblock = cmdblock | ((uint64_t)sec<<44);
+	cmdblock = cmdblock | ((uint64_t)trk<<12);
+	cmdblock = cmdblock | ((uint64_t)ret<<11);
+	return cmdblock;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : deconstruct_fs3cmdblock
+// Description  : Extracts register state from cmdblock
+//
+// Inputs       : cmdblock - cmdblock to extract registers from
+//				  op - opcode address
+//                sec - sector number address
+//				  trk - track number address
+//				  ret - return value address
+// Outputs      : 0 if successful, -1 if failure
+
+int deconstruct_fs3cmdblock(FS3CmdBlk cmdblock, uint8_t *op, uint16_t *sec, uint_fast32_t *trk, uint8_t *ret){
+	//Isolates needed values at front of cmdblock and gets n bits dependent on register if pointer is not NULL
+	if(op != NULL)
+		*op = ((((uint64_t)1 << 4)-1)&(cmdblock>>60));
+	if(sec != NULL)
+		*sec = ((((uint64_t)1 << 16)-1)&(cmdblock>>44));
+	if(trk != NULL)
+		*trk = ((((uint64_t)1 << 32)-1)&(cmdblock>>12));
+	if(ret != NULL)
+		*ret = ((((uint64_t)1 << 1)-1)&(cmdblock>>11));
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_file
+// Description  : Gets file associated with file handle if vailid file handle
+//
+// Inputs       : fd - file handle
+// Outputs      : File if valid fd, NULL if not valid or file not open
+
+FILE_INFO * get_file(int16_t fd){
+	DISK *disk = &fs3_ctx_current()->disk;
+
+	//Checks if file handle is associated with open file
+	if((fd >= 0) && (fd < FS3_MAX_TOTAL_FILES) && (disk->files[fd].fileHandle == fd)){
+		if(disk->files[fd].open){
+			//Return pointer to file
+			return(&(disk->files[fd]));
+		}
+		else{
+			//File not open
+			logMessage(FS3DriverLLevel, "File not open: file handle(%d)",fd);
+			return(NULL);
+		}
+	}
+
+	//File handle isnt accociated with a file
+	logMessage(FS3DriverLLevel, "Invalid file handle: %d",fd);
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_file_lock
+// Description  : Gets the locks of a file slot
+//
+// Inputs       : slot - file slot (its file handle)
+// Outputs      : locks of the slot
+
+FILE_LOCK * get_file_lock(int slot){
+	DISK *disk = &fs3_ctx_current()->disk;
+	return(&disk->fileLocks[slot]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_file
+// Description  : Locks an open file, checking it is still open once the lock
+//                is held so a racing close is seen
+//
+// Inputs       : fd - file handle
+//                exclusive - if the caller changes the file (1:true)
+// Outputs      : File if valid fd and open (locked), NULL if not
+
+FILE_INFO * lock_file(int16_t fd, int exclusive){
+	FILE_LOCK *lock;
+	FILE_INFO *file;
+
+	if((fd < 0) || (fd >= FS3_MAX_TOTAL_FILES)){
+		logMessage(FS3DriverLLevel, "Invalid file handle: %d",fd);
+		return(NULL);
+	}
+
+	lock = get_file_lock(fd);
+	if(exclusive){
+		pthread_rwlock_wrlock(&lock->access);
+	}
+	else{
+		pthread_rwlock_rdlock(&lock->access);
+	}
+	file = get_file(fd);
+	if(file == NULL){
+		pthread_rwlock_unlock(&lock->access);
+	}
+	return(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlock_file
+// Description  : Releases the lock taken by lock_file
+//
+// Inputs       : file - file locked
+// Outputs      : none
+
+void unlock_file(FILE_INFO *file){
+	pthread_rwlock_unlock(&get_file_lock(file->fileHandle)->access);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkpoint_if_wanted
+// Description  : Checkpoints metadata once the journal is nearly full. A
+//                checkpoint reads every file's block map, so it waits for all
+//                calls in progress; it must be called with no locks held.
+//
+// Inputs       : none
+// Outputs      : none
+
+void checkpoint_if_wanted(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	int wanted;
+
+	pthread_mutex_lock(&disk->journalLock);
+	wanted = disk->checkpointWanted;
+	pthread_mutex_unlock(&disk->journalLock);
+	if(!wanted){
+		return;
+	}
+
+	pthread_rwlock_wrlock(&disk->metadataLock);
+	if(disk->checkpointWanted && (sync_metadata() == -1)){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to checkpoint metadata");
+	}
+	pthread_rwlock_unlock(&disk->metadataLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_file
+// Description  : Opens a file by name, creating it if it does not exist
+//
+// Inputs       : path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t open_file(char *path) {
+	DISK *disk = &fs3_ctx_current()->disk;
+	FILE_LOCK *lock;
+	int i;
+	uint32_t hash;
+
+	//Files live on the disk, so it must be mounted
+	if(disk->mounted != 1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: open of [%s] without a mounted disk",path);
+		return(-1);
+	}
+
+	//Directory and name index are loaded on first open after mounting
+	if(!disk->indexed){
+		if(load_directory() == -1){
+			return(-1);
+		}
+		build_file_index();
+	}
+
+	//Checks if file already exists
+	i = find_file_slot(path);
+	if(i == -2){
+		//Failed to read an inode
+		return(-1);
+	}
+	if(i != -1){
+		//Checks if file is already open
+		if(disk->files[i].open == 1){
+			logMessage(FS3DriverLLevel, "File already open");
+			return(disk->files[i].fileHandle);
+		}
+
+		//Opens file if it exists and not yet open
+		else{
+			logMessage(FS3DriverLLevel, "Driver opening existing file [%s]",path);
+
+			//Updates file information
+			lock = get_file_lock(i);
+			pthread_rwlock_wrlock(&lock->access);
+			disk->files[i].open = 1;
+			disk->files[i].pos = 0;
+			reset_readahead(&disk->files[i]);
+			pthread_rwlock_unlock(&lock->access);
+
+			return (disk->files[i].fileHandle); 
+		}
+	}
+	//Creates new file if didn't already exist
+	logMessage(FS3DriverLLevel, "Driver creating new file [%s]",path);
+	if(disk->freeSlotCount == 0){
+		logMessage(FS3DriverLLevel, "FS3 driver: no free file slots for [%s]",path);
+		return(-1);
+	}
+	i = disk->freeSlots[--disk->freeSlotCount];
+	lock = get_file_lock(i);
+	pthread_rwlock_wrlock(&lock->access);
+
+	//Saves file information, the file handle is its slot (and inode) number
+	strcpy(disk->files[i].name, path);
+	hash = hash_file_name(path);
+	disk->nameHashes[i] = hash;
+	disk->directoryDirty[(i*sizeof(uint32_t))/FS3_SECTOR_SIZE] = 1;
+	insert_file_index(hash, i);
+	disk->files[i].fileHandle = i;
+	disk->files[i].open = 1;
+	disk->files[i].pos = 0;
+	disk->files[i].length = 0;
+	disk->files[i].numOfSectors = 0;
+	disk->files[i].extents = NULL;
+	disk->files[i].numOfExtents = 0;
+	disk->files[i].extentCapacity = 0;
+	disk->files[i].tailSector = -1;
+	disk->files[i].loaded = 1;
+	disk->files[i].inodeDirty = 1;
+	disk->files[i].numOfOverflow = 0;
+	reset_readahead(&disk->files[i]);
+	if(journal_create(&disk->files[i], hash) == -1){
+		release_new_file(&disk->files[i]);
+		pthread_rwlock_unlock(&lock->access);
+		return(-1);
+	}
+
+	//Sets starting track and sector of file
+	if(allocate_file_sectors(&disk->files[i], 1) == -1){
+		logMessage(FS3DriverLLevel, "FS3 driver: failed to allocat fs3 track and sector");
+		release_new_file(&disk->files[i]);
+		pthread_rwlock_unlock(&lock->access);
+		return(-1);
+	}
+	pthread_rwlock_unlock(&lock->access);
+
+	logMessage(FS3DriverLLevel, "File [%s] opened in driver, fh, %d.",disk->files[i].name,disk->files[i].fileHandle);
+	return (disk->files[i].fileHandle); 
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_file_handle
+// Description  : Reads a file into buffer segments from its position (which
+//                moves past the bytes read) or from an offset. Reads of a
+//                file share its lock unless they cover bytes still coalescing
+//                in its tail buffer.
+//
+// Inputs       : fd - file handle
+//                iov - buffer segments to read into
+//                iovcnt - number of segments
+//                positional - if reading at offset, leaving the position (1:true)
+//                offset - offset of the first byte read, if positional
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t read_file_handle(int16_t fd, const struct iovec *iov, int iovcnt, int positional, uint32_t offset) {
+	DISK *disk = &fs3_ctx_current()->disk;
+	FILE_INFO *file;
+	FILE_LOCK *lock;
+	uint32_t pos;
+	int32_t count;
+	int32_t bytesToRead;
+	int32_t result;
+
+	count = iovec_length(iov, iovcnt);
+	if(count == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: bad buffer segments for read on fh %d",fd);
+		return(-1);
+	}
+
+	//Gets reference to file from file handle (returns NULL file handle not associated with file or file not open)
+	pthread_rwlock_rdlock(&disk->metadataLock);
+	file = lock_file(fd, 0);
+
+	//Checks if file exsits and is open
+	if(file == NULL){
+		//File handle not associated with file or file not open
+		pthread_rwlock_unlock(&disk->metadataLock);
+		return(-1);
+	}
+
+	//Only bytes inside the file can be read, the span is reserved so readers sharing the file each get their own
+	lock = get_file_lock(fd);
+	pthread_mutex_lock(&lock->state);
+	pos = positional ? offset : file->pos;
+	if(pos > file->length){
+		//Offset out of range
+		logMessage(FS3DriverLLevel, "FS3 DRVR: read on fh %d at %u past length %u",fd,pos,file->length);
+		pthread_mutex_unlock(&lock->state);
+		unlock_file(file);
+		pthread_rwlock_unlock(&disk->metadataLock);
+		return(-1);
+	}
+	bytesToRead = count;
+	if(pos+count > file->length){
+		bytesToRead = file->length-pos;
+	}
+	if(!positional){
+		file->pos = pos+bytesToRead;
+	}
+	pthread_mutex_unlock(&lock->state);
+
+	//Coalesced appends in the span are stored first, which needs the file to itself
+	if((bytesToRead > 0) && (file->tailSector >= SECTOR_INDEX_NUMBER(pos)) && (file->tailSector <= SECTOR_INDEX_NUMBER(pos+bytesToRead-1))){
+		unlock_file(file);
+		file = lock_file(fd, 1);
+		if(file == NULL){
+			pthread_rwlock_unlock(&disk->metadataLock);
+			return(-1);
+		}
+	}
+
+	result = read_file(file, pos, bytesToRead, iov, iovcnt, count);
+
+	//A failed read gives back its span, unless other readers have since moved past it
+	if((result == -1) && !positional){
+		pthread_mutex_lock(&lock->state);
+		if(file->pos == pos+bytesToRead){
+			file->pos = pos;
+		}
+		pthread_mutex_unlock(&lock->state);
+	}
+	unlock_file(file);
+	pthread_rwlock_unlock(&disk->metadataLock);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_file_handle
+// Description  : Writes buffer segments to a file at its position (which
+//                moves past the bytes written) or at an offset
+//
+// Inputs       : fd - file handle
+//                iov - buffer segments to write from
+//                iovcnt - number of segments
+//                positional - if writing at offset, leaving the position (1:true)
+//                offset - offset of the first byte written, if positional
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t write_file_handle(int16_t fd, const struct iovec *iov, int iovcnt, int positional, uint32_t offset) {
+	DISK *disk = &fs3_ctx_current()->disk;
+	FILE_INFO *file;
+	uint32_t pos;
+	int32_t count;
+	int32_t result;
+
+	count = iovec_length(iov, iovcnt);
+	if(count == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: bad buffer segments for write on fh %d",fd);
+		return(-1);
+	}
+
+	//Leaves the journal room for this write's metadata changes
+	checkpoint_if_wanted();
+
+	//Gets reference to file from file handle (returns NULL file handle not associated with file or file not open)
+	pthread_rwlock_rdlock(&disk->metadataLock);
+	file = lock_file(fd, 1);
+
+	//Checks if file exsits and is open
+	if(file == NULL){
+		//File handle not associated with file or file not open
+		pthread_rwlock_unlock(&disk->metadataLock);
+		return(-1);
+	}
+
+	//Files have no holes, writes start inside the file or at its end
+	pos = positional ? offset : file->pos;
+	if(pos > file->length){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: write on fh %d at %u past length %u",fd,pos,file->length);
+		result = -1;
+	}
+	else{
+		result = write_file(file, pos, iov, iovcnt, count);
+		if((result != -1) && !positional){
+			file->pos = pos+result;
+		}
+	}
+	unlock_file(file);
+	pthread_rwlock_unlock(&disk->metadataLock);
+	checkpoint_if_wanted();
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_file
+// Description  : Reads a span of a file already reserved into buffer
+//                segments, planning its sectors on the stack or, for a
+//                larger span, on the heap
+//
+// Inputs       : file - file to read from (locked by caller)
+//                pos - first byte of the span
+//                bytesToRead - length of the span, within the file
+//                iov - buffer segments to read into
+//                iovcnt - number of segments
+//                count - number of bytes asked for
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t read_file(FILE_INFO *file, uint32_t pos, int32_t bytesToRead, const struct iovec *iov, int iovcnt, int32_t count) {
+	IO_PLAN_ENTRY stackPlan[FS3_IO_PLAN_STACK_SIZE];
+	IO_PLAN_ENTRY *plan;
+	int32_t result;
+	int capacity;
+
+	plan = reserve_io_plan((bytesToRead > 0) ? SECTOR_INDEX_NUMBER(pos+bytesToRead-1)-SECTOR_INDEX_NUMBER(pos)+1 : 0,
+		stackPlan, &capacity);
+	result = read_file_span(file, pos, bytesToRead, iov, iovcnt, count, plan, capacity);
+	release_io_plan(plan, stackPlan);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_file_span
+// Description  : Reads a span of a file already reserved into buffer
+//                segments, copying cached sectors and reading the rest in
+//                batches of the plan's capacity
+//
+// Inputs       : file - file to read from (locked by caller)
+//                pos - first byte of the span
+//                bytesToRead - length of the span, within the file
+//                iov - buffer segments to read into
+//                iovcnt - number of segments
+//                count - number of bytes asked for
+//                plan - sector operations planned, at least FS3_IO_PLAN_STACK_SIZE
+//                capacity - number of entries of plan
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t read_file_span(FILE_INFO *file, uint32_t pos, int32_t bytesToRead, const struct iovec *iov, int iovcnt, int32_t count,
+		IO_PLAN_ENTRY *plan, int capacity) {
+	FILE_LOCK *lock;
+	FS3Sector partialBufs[FS3_IO_BOUNCE_SECTORS];
+	FS3Sector straddled;
+	IOVEC_CURSOR cursor = {iov, iovcnt, 0, 0};
+	IOVEC_CURSOR scatterAt[FS3_IO_BOUNCE_SECTORS];
+	char *scatterFrom[FS3_IO_BOUNCE_SECTORS];
+	int32_t scatterLength[FS3_IO_BOUNCE_SECTORS];
+	IO_PLAN_ENTRY *entry;
+	char *dest;
+	int planned;
+	int partials;
+	int scattered;
+	int i;
+	TRACK_SECTOR_PAIR current;
+	TRACK_SECTOR_PAIR *pair;
+	int run;
+	uint32_t offset;
+	int32_t bytesRead;
+	int32_t chunk;
+
+	bytesRead = 0;
+
+	//Coalesced appends in the span are stored before reading (file locked exclusive by caller if so)
+	if((bytesToRead > 0) && (file->tailSector >= SECTOR_INDEX_NUMBER(pos)) && (file->tailSector <= SECTOR_INDEX_NUMBER(pos+bytesToRead-1))){
+		if(flush_file_tail(file) == -1){
+			logMessage(FS3DriverLLevel, "FS3 DRVR: failed read on fh %d (%d bytes)",file->fileHandle,count);
+			return(-1);
+		}
+	}
+
+	//Copies cached sectors of the span straight into place in buf, plans the rest
+	planned = 0;
+	partials = 0;
+	scattered = 0;
+	run = 0;
+	while(bytesRead < bytesToRead){
+		//Looks up the block map once per contiguous run
+		if(run == 0){
+			run = get_file_sector(file, SECTOR_INDEX_NUMBER(pos), &current);
+			if(run == -1){
+				logMessage(FS3DriverLLevel, "FS3 DRVR: failed read on fh %d (%d bytes)",file->fileHandle,count);
+				return(-1);
+			}
+		}
+		else{
+			current.sectorIndex++;
+		}
+		run--;
+		pair = &current;
+		offset = pos%FS3_SECTOR_SIZE;
+		chunk = CMPSC311_MINVAL((int32_t)(FS3_SECTOR_SIZE-offset), bytesToRead-bytesRead);
+		dest = iovec_span(&cursor, chunk);
+
+		if(dest != NULL){
+			//Copies sector bytes from the cache if there
+			if(fs3_read_cache(pair->trackIndex,pair->sectorIndex,dest,offset,chunk) == -1){
+				//Whole sectors are received directly into buf, partial (head/tail) ones go through a stack sector
+				entry = &plan[planned];
+				entry->pair = *pair;
+				entry->dest = dest;
+				entry->offset = offset;
+				entry->chunk = chunk;
+				entry->data = (chunk == FS3_SECTOR_SIZE) ? dest : partialBufs[partials++];
+				planned++;
+			}
+			iovec_copy_out(&cursor, NULL, chunk);
+		}
+		else if(fs3_read_cache(pair->trackIndex,pair->sectorIndex,straddled,offset,chunk) == 0){
+			//Cached sector bytes straddling segments are scattered at once
+			iovec_copy_out(&cursor, straddled, chunk);
+		}
+		else{
+			//Sectors straddling segments go through a stack sector, scattered once read
+			entry = &plan[planned];
+			entry->pair = *pair;
+			entry->data = partialBufs[partials++];
+			entry->dest = entry->data;
+			entry->offset = offset;
+			entry->chunk = chunk;
+			scatterAt[scattered] = cursor;
+			scatterFrom[scattered] = entry->data+offset;
+			scatterLength[scattered] = chunk;
+			scattered++;
+			planned++;
+			iovec_copy_out(&cursor, NULL, chunk);
+		}
+		bytesRead += chunk;
+		pos += chunk;
+
+		//Reads planned sectors once the plan or stack sectors are full or the span is done
+		if((planned == capacity) || (partials == FS3_IO_BOUNCE_SECTORS) || ((bytesRead == bytesToRead) && (planned > 0))){
+			if(execute_read_plan(plan, planned, NULL) == -1){
+				//Failed read
+				logMessage(FS3DriverLLevel, "FS3 DRVR: failed read on fh %d (%d bytes)",file->fileHandle,count);
+				return(-1);
+			}
+			for(i=0; i<scattered; i++){
+				iovec_copy_out(&scatterAt[i], scatterFrom[i], scatterLength[i]);
+			}
+			planned = 0;
+			partials = 0;
+			scattered = 0;
+		}
+	}
+
+	//Reads ahead if this read continues a pattern, once other readers of the file may go on (a failed prefetch only ends readahead)
+	if(bytesToRead > 0){
+		lock = get_file_lock(file->fileHandle);
+		pthread_mutex_lock(&lock->state);
+		planned = update_readahead(file, SECTOR_INDEX_NUMBER(pos-bytesToRead), SECTOR_INDEX_NUMBER(pos-1), plan);
+		pthread_mutex_unlock(&lock->state);
+		if(planned > 0){
+			prefetch_sectors(file, plan, planned);
+		}
+	}
+
+	logMessage(FS3DriverLLevel, "FS3 DRVR: read successful on fh %d (%d bytes)",file->fileHandle,bytesToRead);
+	return(bytesToRead);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_file
+// Description  : Writes buffer segments at a position of a file, growing it
+//                as needed, planning its sectors on the stack or, for a
+//                larger write, on the heap
+//
+// Inputs       : file - file to write to (locked exclusive by caller)
+//                pos - first byte written, at most the file length
+//                iov - buffer segments to write from
+//                iovcnt - number of segments
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t write_file(FILE_INFO *file, uint32_t pos, const struct iovec *iov, int iovcnt, int32_t count) {
+	IO_PLAN_ENTRY stackPlan[FS3_IO_PLAN_STACK_SIZE];
+	IO_PLAN_ENTRY *plan;
+	int32_t result;
+	int capacity;
+
+	plan = reserve_io_plan((count > 0) ? SECTOR_INDEX_NUMBER(pos+count-1)-SECTOR_INDEX_NUMBER(pos)+1 : 0,
+		stackPlan, &capacity);
+	result = write_file_span(file, pos, iov, iovcnt, count, plan, capacity);
+	release_io_plan(plan, stackPlan);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_file_span
+// Description  : Writes buffer segments at a position of a file, growing it
+//                as needed, storing sectors in batches of the plan's capacity
+//
+// Inputs       : file - file to write to (locked exclusive by caller)
+//                pos - first byte written, at most the file length
+//                iov - buffer segments to write from
+//                iovcnt - number of segments
+//                count - number of bytes to write
+//                plan - sector operations planned
+//                capacity - number of entries of plan
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t write_file_span(FILE_INFO *file, uint32_t pos, const struct iovec *iov, int iovcnt, int32_t count,
+		IO_PLAN_ENTRY *plan, int capacity) {
+	FS3Sector partialBufs[FS3_IO_BOUNCE_SECTORS];
+	FS3Sector gathered;
+	IOVEC_CURSOR cursor = {iov, iovcnt, 0, 0};
+	char *src;
+	char *sectorBytes;
+	int cached;
+	int planned;
+	int partials;
+	TRACK_SECTOR_PAIR current;
+	TRACK_SECTOR_PAIR *pair;
+	int run;
+	uint32_t offset;
+	uint32_t sectorStart;
+	uint32_t sectorFill;
+	uint32_t oldLength;
+	int32_t totalBytesWritten;
+	int32_t chunk;
+
+	//Walks the sector span of the write once, planning device writes
+	oldLength = file->length;
+	totalBytesWritten = 0;
+	planned = 0;
+	partials = 0;
+	run = 0;
+	while(totalBytesWritten<count){
+		offset = pos%FS3_SECTOR_SIZE;
+		sectorStart = pos-offset;
+		chunk = CMPSC311_MINVAL((int32_t)(FS3_SECTOR_SIZE-offset), count-totalBytesWritten);
+
+		//Sector bytes straddling segments are gathered first, whole sectors into a stack sector planned as is
+		src = iovec_span(&cursor, chunk);
+		if(src == NULL){
+			src = (chunk == FS3_SECTOR_SIZE) ? partialBufs[partials++] : gathered;
+			iovec_copy_in(&cursor, src, chunk);
+		}
+		else{
+			iovec_copy_out(&cursor, NULL, chunk);
+		}
+
+		//If out of sectors allocate every new sector the rest of the write needs at once
+		if(SECTOR_INDEX_NUMBER(pos) >= file->numOfSectors){
+			if(allocate_file_sectors(file, SECTOR_INDEX_NUMBER(pos+(count-totalBytesWritten)-1)-file->numOfSectors+1) == -1){
+				logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",file->fileHandle,count);
+				return(-1);
+			}
+		}
+
+		//Looks up the block map once per contiguous run
+		if(run == 0){
+			run = get_file_sector(file, SECTOR_INDEX_NUMBER(pos), &current);
+			if(run == -1){
+				logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",file->fileHandle,count);
+				return(-1);
+			}
+		}
+		else{
+			current.sectorIndex++;
+		}
+		run--;
+		pair = &current;
+
+		//Partial appends are absorbed by the tail buffer until its sector fills
+		if((pos == file->length) && (chunk < FS3_SECTOR_SIZE)){
+			if(append_file_tail(file,src,chunk) == -1){
+				logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",file->fileHandle,count);
+				return(-1);
+			}
+		}
+		else{
+			//Overwrites of the buffered sector go through the device image
+			if((file->tailSector == SECTOR_INDEX_NUMBER(pos)) && (flush_file_tail(file) == -1)){
+				logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",file->fileHandle,count);
+				return(-1);
+			}
+
+			//Bytes of the sector that already hold file data
+			sectorFill = (file->length > sectorStart) ? CMPSC311_MINVAL(file->length-sectorStart, FS3_SECTOR_SIZE) : 0;
+
+			if(chunk == FS3_SECTOR_SIZE){
+				//Full overwrites are planned straight from buf
+				sectorBytes = src;
+			}
+			else{
+				//Partial head or tail, patched in place if cached (sectors without data are never cached)
+				sectorBytes = partialBufs[partials++];
+				cached = (sectorFill > 0) ? fs3_update_cache(pair->trackIndex,pair->sectorIndex,src,offset,chunk,sectorBytes) : -1;
+				if(cached == 1){
+					//Held dirty by the write-back cache
+					sectorBytes = NULL;
+					partials--;
+				}
+				else if(cached == -1){
+					if((offset == 0) && ((uint32_t)chunk >= sectorFill)){
+						//Nothing to preserve
+						memset(sectorBytes, 0, FS3_SECTOR_SIZE);
+						memcpy(sectorBytes, src, chunk);
+					}
+					else{
+						//Sector holds data around the write, fetch it first
+						if(read_sector(pair->trackIndex,pair->sectorIndex,sectorBytes) == -1){
+							logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",file->fileHandle,count);
+							return(-1);
+						}
+						memcpy(sectorBytes+offset, src, chunk);
+					}
+				}
+			}
+
+			//Plans storing the sector image
+			if(sectorBytes != NULL){
+				plan[planned].pair = *pair;
+				plan[planned].data = sectorBytes;
+				planned++;
+			}
+		}
+
+		//Updates file info after write
+		totalBytesWritten += chunk;
+		pos += chunk;
+		if(pos > file->length){
+			file->length = pos;
+			file->inodeDirty = 1;
+		}
+
+		//Stores planned sectors once the plan or stack sectors are full or the span is done
+		if((planned == capacity) || (partials == FS3_IO_BOUNCE_SECTORS) || ((totalBytesWritten == count) && (planned > 0))){
+			if(execute_write_plan(plan, planned) == -1){
+				//Failed write
+				logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",file->fileHandle,count);
+				return(-1);
+			}
+			planned = 0;
+			partials = 0;
+		}
+	}
+
+	//Length is journaled once the bytes it covers are stored
+	if((file->length > oldLength) && (journal_length(file) == -1)){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: failed write on fh %d (%d bytes)",file->fileHandle,count);
+		return(-1);
+	}
+
+	//Returns bytes written
+	logMessage(FS3DriverLLevel, "FS3 DRVR: write on fh %d (%d bytes) [pos=%d, len=%d]",file->fileHandle,count,pos,file->length);
+	return(totalBytesWritten);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iovec_length
+// Description  : Totals the bytes of the buffer segments of a vectored call
+//
+// Inputs       : iov - buffer segments
+//                iovcnt - number of segments
+// Outputs      : total bytes if valid, -1 if too many segments or bytes
+
+int32_t iovec_length(const struct iovec *iov, int iovcnt) {
+	size_t total = 0;
+	int i;
+
+	if((iovcnt < 0) || (iovcnt > FS3_MAX_IOVEC) || ((iov == NULL) && (iovcnt > 0))){
+		return(-1);
+	}
+	for(i=0; i<iovcnt; i++){
+		if((iov[i].iov_len > (size_t)INT32_MAX) || (total+iov[i].iov_len > (size_t)INT32_MAX)){
+			return(-1);
+		}
+		total += iov[i].iov_len;
+	}
+	return((int32_t)total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iovec_span
+// Description  : Finds the bytes at the position of a cursor if they lie in
+//                one segment, without moving the cursor
+//
+// Inputs       : cursor - position in the buffer segments
+//                length - number of bytes
+// Outputs      : pointer to the bytes, NULL if they straddle segments
+
+char * iovec_span(IOVEC_CURSOR *cursor, int32_t length) {
+	//Skips segments already used up
+	while((cursor->segment < cursor->iovcnt) && (cursor->offset == cursor->iov[cursor->segment].iov_len)){
+		cursor->segment++;
+		cursor->offset = 0;
+	}
+	if((cursor->segment == cursor->iovcnt) || (cursor->iov[cursor->segment].iov_len-cursor->offset < (size_t)length)){
+		return(NULL);
+	}
+	return((char *)cursor->iov[cursor->segment].iov_base+cursor->offset);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iovec_copy_out
+// Description  : Copies bytes into the buffer segments at a cursor, moving it
+//                past them
+//
+// Inputs       : cursor - position in the buffer segments
+//                src - bytes to copy (NULL to only move the cursor)
+//                length - number of bytes
+// Outputs      : none
+
+void iovec_copy_out(IOVEC_CURSOR *cursor, const char *src, int32_t length) {
+	size_t piece;
+
+	while((length > 0) && (cursor->segment < cursor->iovcnt)){
+		piece = CMPSC311_MINVAL(cursor->iov[cursor->segment].iov_len-cursor->offset, (size_t)length);
+		if((src != NULL) && (piece > 0)){
+			memcpy((char *)cursor->iov[cursor->segment].iov_base+cursor->offset, src, piece);
+			src += piece;
+		}
+		cursor->offset += piece;
+		length -= piece;
+		if(cursor->offset == cursor->iov[cursor->segment].iov_len){
+			cursor->segment++;
+			cursor->offset = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iovec_copy_in
+// Description  : Gathers bytes from the buffer segments at a cursor, moving
+//                it past them
+//
+// Inputs       : cursor - position in the buffer segments
+//                dest - buffer to gather into
+//                length - number of bytes
+// Outputs      : none
+
+void iovec_copy_in(IOVEC_CURSOR *cursor, char *dest, int32_t length) {
+	size_t piece;
+
+	while((length > 0) && (cursor->segment < cursor->iovcnt)){
+		piece = CMPSC311_MINVAL(cursor->iov[cursor->segment].iov_len-cursor->offset, (size_t)length);
+		if(piece > 0){
+			memcpy(dest, (char *)cursor->iov[cursor->segment].iov_base+cursor->offset, piece);
+			dest += piece;
+		}
+		cursor->offset += piece;
+		length -= piece;
+		if(cursor->offset == cursor->iov[cursor->segment].iov_len){
+			cursor->segment++;
+			cursor->offset = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_superblock
+// Description  : Reads the superblock at mount and replays the journal if
+//                the last unmount was not clean. The directory, bitmap and
+//                inodes are otherwise read on first use. A disk without a
+//                superblock is formatted. A volume must be mounted over as
+//                many servers as it was formatted over, its tracks are
+//                striped by that count.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t load_superblock(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3Sector sector;
+	FS3_SUPERBLOCK *superblock = (FS3_SUPERBLOCK *)sector;
+
+	if(read_sector(FS3_META_TRACK,FS3_SUPERBLOCK_SECTOR,sector) == -1){
+		return(-1);
+	}
+
+	//New disk, its layout is written at once so journal commits can be found
+	if(superblock->magic != FS3_SUPERBLOCK_MAGIC){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: No file system found, formatting disk");
+		format_disk();
+		return(sync_metadata());
+	}
+	if(superblock->version != FS3_LAYOUT_VERSION){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Unsupported layout version %d",superblock->version);
+		return(-1);
+	}
+	if((int)superblock->servers != disk->servers){
+		logMessage(LOG_ERROR_LEVEL, "FS3 DRVR: Volume is striped over %u servers, mounted over %d",superblock->servers,disk->servers);
+		return(-1);
+	}
+
+	disk->nextTrack = superblock->nextTrack;
+	disk->nextSector = superblock->nextSector;
+	disk->journalEpoch = superblock->journalEpoch;
+	disk->directoryLoaded = 0;
+	disk->bitmapLoaded = 0;
+	disk->indexed = 0;
+	reset_journal();
+	return(replay_journal());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : format_disk
+// Description  : Lays out an empty file system in memory, written to the
+//                disk at the next sync. Tracks past those of the servers
+//                the volume is striped over are kept full.
+//
+// Inputs       : none
+// Outputs      : none
+
+void format_disk(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	TRACK_SECTOR_PAIR reserved;
+	int i;
+
+	memset(disk->nameHashes, 0, sizeof(disk->nameHashes));
+	memset(disk->sectorMap, 0, sizeof(disk->sectorMap));
+	memset(disk->trackUsed, 0, sizeof(disk->trackUsed));
+
+	//Metadata tracks, and tracks the volume does not have, are never allocated to files
+	for(i=0; i<FS3_VOLUME_TRACKS; i++){
+		if((i < FS3_FIRST_DATA_TRACK) || (i >= disk->servers*FS3_MAX_TRACKS)){
+			reserved.trackIndex = i;
+			reserved.sectorIndex = 0;
+			mark_track_sectors(reserved, FS3_TRACK_SIZE, 1);
+		}
+	}
+	for(i=0; i<(int)FS3_DIRECTORY_SECTORS; i++){
+		disk->directoryDirty[i] = 1;
+	}
+	for(i=0; i<(int)FS3_BITMAP_SECTORS; i++){
+		disk->bitmapDirty[i] = 1;
+	}
+
+	disk->nextTrack = FS3_FIRST_DATA_TRACK;
+	disk->nextSector = 0;
+
+	//Epoch differs from any left in the journal track by an earlier file system
+	disk->journalEpoch = (uint32_t)time(NULL);
+	reset_journal();
+	disk->directoryLoaded = 1;
+	disk->bitmapLoaded = 1;
+	disk->superblockDirty = 1;
+	disk->indexed = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_directory
+// Description  : Reads the directory of file name hashes on first use, in
+//                one pipelined batch
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t load_directory(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	IO_PLAN_ENTRY plan[FS3_DIRECTORY_SECTORS];
+	int i;
+
+	if(disk->directoryLoaded){
+		return(0);
+	}
+	for(i=0; i<(int)FS3_DIRECTORY_SECTORS; i++){
+		plan[i].pair.trackIndex = FS3_META_TRACK;
+		plan[i].pair.sectorIndex = FS3_DIRECTORY_SECTOR+i;
+		plan[i].data = (char *)disk->nameHashes+i*FS3_SECTOR_SIZE;
+	}
+	if(pipeline_sector_ops(FS3_OP_RDSECT, plan, FS3_DIRECTORY_SECTORS) == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to read directory");
+		return(-1);
+	}
+	memset(disk->directoryDirty, 0, sizeof(disk->directoryDirty));
+	disk->directoryLoaded = 1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_free_space_map
+// Description  : Reads the free space bitmap on first use, in one
+//                pipelined batch
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t load_free_space_map(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	IO_PLAN_ENTRY plan[FS3_BITMAP_SECTORS];
+	int i;
+	int w;
+
+	if(disk->bitmapLoaded){
+		return(0);
+	}
+	for(i=0; i<(int)FS3_BITMAP_SECTORS; i++){
+		plan[i].pair.trackIndex = FS3_META_TRACK;
+		plan[i].pair.sectorIndex = FS3_BITMAP_SECTOR+i;
+		plan[i].data = (char *)disk->sectorMap+i*FS3_SECTOR_SIZE;
+	}
+	if(pipeline_sector_ops(FS3_OP_RDSECT, plan, FS3_BITMAP_SECTORS) == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to read free space bitmap");
+		return(-1);
+	}
+
+	//Used counts are not stored, they follow from the bitmap
+	for(i=0; i<FS3_VOLUME_TRACKS; i++){
+		disk->trackUsed[i] = 0;
+		for(w=0; w<FS3_SECTOR_MAP_WORDS; w++){
+			disk->trackUsed[i] += __builtin_popcountll(disk->sectorMap[i][w]);
+		}
+	}
+	memset(disk->bitmapDirty, 0, sizeof(disk->bitmapDirty));
+	disk->bitmapLoaded = 1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_file_inode
+// Description  : Reads the inode of a file slot and its extent overflow
+//                sectors, rebuilding the file's block map
+//
+// Inputs       : slot - slot of the file (its inode sector)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t load_file_inode(int slot){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FILE_INFO *file = &disk->files[slot];
+	FS3Sector sector;
+	FS3_INODE *inode = (FS3_INODE *)sector;
+	FS3_DISK_EXTENT *overflowExtents = NULL;
+	FS3_DISK_EXTENT *extent;
+	IO_PLAN_ENTRY plan[FS3_INODE_OVERFLOW_SECTORS];
+	TRACK_SECTOR_PAIR pair;
+	int i;
+
+	if(read_sector(FS3_INODE_TRACK,slot,sector) == -1){
+		return(-1);
+	}
+
+	//Checks inode is in use and its block map fits where it claims
+	if((inode->magic != FS3_INODE_MAGIC) || (inode->numOfOverflow < 0) || (inode->numOfOverflow > FS3_INODE_OVERFLOW_SECTORS) ||
+		(inode->numOfExtents < 0) || (inode->numOfExtents > FS3_INODE_EXTENTS+inode->numOfOverflow*(int)FS3_OVERFLOW_EXTENTS)){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Bad inode for file slot %d",slot);
+		return(-1);
+	}
+
+	//Reads the rest of the block map in one batch
+	if(inode->numOfOverflow > 0){
+		overflowExtents = malloc(inode->numOfOverflow*FS3_SECTOR_SIZE);
+		if(overflowExtents == NULL){
+			return(-1);
+		}
+		for(i=0; i<inode->numOfOverflow; i++){
+			plan[i].pair = inode->overflow[i];
+			plan[i].data = (char *)overflowExtents+i*FS3_SECTOR_SIZE;
+		}
+		sort_io_plan(plan, inode->numOfOverflow);
+		if(pipeline_sector_ops(FS3_OP_RDSECT, plan, inode->numOfOverflow) == -1){
+			free(overflowExtents);
+			return(-1);
+		}
+	}
+
+	//Rebuilds file information
+	free(file->extents);
+	memset(file, 0, sizeof(FILE_INFO));
+	strncpy(file->name, inode->name, FS3_MAX_PATH_LENGTH-1);
+	file->fileHandle = slot;
+	file->length = inode->length;
+	file->tailSector = -1;
+	reset_readahead(file);
+	for(i=0; i<inode->numOfExtents; i++){
+		extent = (i < FS3_INODE_EXTENTS) ? &inode->extents[i] : &overflowExtents[i-FS3_INODE_EXTENTS];
+		pair.trackIndex = extent->trackIndex;
+		pair.sectorIndex = extent->sectorIndex;
+		if(add_file_sectors(file, pair, extent->length) == -1){
+			free(overflowExtents);
+			return(-1);
+		}
+	}
+	memcpy(file->overflow, inode->overflow, sizeof(file->overflow));
+	file->numOfOverflow = inode->numOfOverflow;
+	file->inodeDirty = 0;
+	file->loaded = 1;
+	free(overflowExtents);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sync_metadata
+// Description  : Checkpoints metadata, writing changed inode, bitmap and
+//                directory sectors in pipelined batches, then the
+//                superblock with a new journal epoch so the journal so far
+//                is no longer replayed. Inodes go first since they may
+//                allocate overflow sectors. File tails and the write-back
+//                cache are flushed beforehand, so no length it writes
+//                covers data not yet on the disk (ordered mode).
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t sync_metadata(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	IO_PLAN_ENTRY *plan;
+	FS3Sector *bufs;
+	FS3_SUPERBLOCK *superblock;
+	int count = 0;
+	int result = 0;
+	int i;
+
+	if(disk->mounted != 1){
+		return(0);
+	}
+
+	//Nothing to checkpoint
+	if(!disk->superblockDirty && (disk->journalHead == 0) && (((FS3_JOURNAL_HEADER *)disk->journal)->count == 0)){
+		return(0);
+	}
+
+	//Data goes before the metadata describing it
+	for(i=0; i<FS3_MAX_TOTAL_FILES; i++){
+		if(disk->files[i].loaded && (flush_file_tail(&disk->files[i]) == -1)){
+			return(-1);
+		}
+	}
+	if(fs3_flush_cache() == -1){
+		return(-1);
+	}
+
+	plan = malloc(FS3_IO_PLAN_SIZE*sizeof(IO_PLAN_ENTRY));
+	bufs = malloc(FS3_IO_PLAN_SIZE*sizeof(FS3Sector));
+	if((plan == NULL) || (bufs == NULL)){
+		free(plan);
+		free(bufs);
+		return(-1);
+	}
+
+	//Inodes of changed files, sending the batch before it could overflow
+	for(i=0; (i<FS3_MAX_TOTAL_FILES) && (result == 0); i++){
+		if(!disk->files[i].loaded || !disk->files[i].inodeDirty){
+			continue;
+		}
+		if((count+1+FS3_INODE_OVERFLOW_SECTORS > FS3_IO_PLAN_SIZE)){
+			result = pipeline_sector_ops(FS3_OP_WRSECT, plan, count);
+			count = 0;
+		}
+		if((result == 0) && (write_file_inode(&disk->files[i], plan, bufs, &count) == -1)){
+			result = -1;
+		}
+	}
+
+	//Bitmap and directory sectors are sent straight from memory
+	if((result == 0) && (count+FS3_BITMAP_SECTORS+FS3_DIRECTORY_SECTORS+1 > FS3_IO_PLAN_SIZE)){
+		result = pipeline_sector_ops(FS3_OP_WRSECT, plan, count);
+		count = 0;
+	}
+	for(i=0; (i<(int)FS3_BITMAP_SECTORS) && (result == 0); i++){
+		if(disk->bitmapLoaded && disk->bitmapDirty[i]){
+			plan[count].pair.trackIndex = FS3_META_TRACK;
+			plan[count].pair.sectorIndex = FS3_BITMAP_SECTOR+i;
+			plan[count].data = (char *)disk->sectorMap+i*FS3_SECTOR_SIZE;
+			count++;
+		}
+	}
+	for(i=0; (i<(int)FS3_DIRECTORY_SECTORS) && (result == 0); i++){
+		if(disk->directoryLoaded && disk->directoryDirty[i]){
+			plan[count].pair.trackIndex = FS3_META_TRACK;
+			plan[count].pair.sectorIndex = FS3_DIRECTORY_SECTOR+i;
+			plan[count].data = (char *)disk->nameHashes+i*FS3_SECTOR_SIZE;
+			count++;
+		}
+	}
+	if(result == 0){
+		sort_io_plan(plan, count);
+		result = pipeline_sector_ops(FS3_OP_WRSECT, plan, count);
+	}
+
+	//Superblock goes last, its new epoch is the commit point of the checkpoint
+	if(result == 0){
+		memset(bufs[0], 0, FS3_SECTOR_SIZE);
+		superblock = (FS3_SUPERBLOCK *)bufs[0];
+		superblock->magic = FS3_SUPERBLOCK_MAGIC;
+		superblock->version = FS3_LAYOUT_VERSION;
+		superblock->nextTrack = disk->nextTrack;
+		superblock->nextSector = disk->nextSector;
+		superblock->journalEpoch = disk->journalEpoch+1;
+		superblock->servers = disk->servers;
+		result = write_sector(FS3_META_TRACK,FS3_SUPERBLOCK_SECTOR,bufs[0]);
+	}
+	free(plan);
+	free(bufs);
+
+	//Everything stays dirty to be written again if any batch failed
+	if(result == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to write metadata");
+		return(-1);
+	}
+	for(i=0; i<FS3_MAX_TOTAL_FILES; i++){
+		disk->files[i].inodeDirty = 0;
+	}
+	memset(disk->bitmapDirty, 0, sizeof(disk->bitmapDirty));
+	memset(disk->directoryDirty, 0, sizeof(disk->directoryDirty));
+	disk->superblockDirty = 0;
+	disk->journalEpoch++;
+	reset_journal();
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_file_inode
+// Description  : Plans writing the inode of a file and its extent overflow
+//                sectors, allocating overflow sectors as the block map grows
+//
+// Inputs       : file - file to write the inode of
+//                plan - planned metadata writes
+//                bufs - sector buffers of the plan
+//                count - number of planned writes, updated
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t write_file_inode(FILE_INFO *file, IO_PLAN_ENTRY *plan, FS3Sector *bufs, int *count){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3_INODE *inode;
+	FS3_DISK_EXTENT *extent;
+	TRACK_SECTOR_PAIR pair;
+	int needed;
+	int i;
+
+	//Overflow sectors needed for extents past the inode's own
+	needed = 0;
+	if(file->numOfExtents > FS3_INODE_EXTENTS){
+		needed = (file->numOfExtents-FS3_INODE_EXTENTS+FS3_OVERFLOW_EXTENTS-1)/FS3_OVERFLOW_EXTENTS;
+	}
+	if(needed > FS3_INODE_OVERFLOW_SECTORS){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Block map of fh %d too fragmented to store (%d extents)",file->fileHandle,file->numOfExtents);
+		return(-1);
+	}
+	while(file->numOfOverflow < needed){
+		if((load_free_space_map() == -1) || (get_free_track_sector_pair(disk->nextTrack,disk->nextSector,1,&pair) == -1)){
+			return(-1);
+		}
+		file->overflow[file->numOfOverflow++] = pair;
+	}
+
+	//Inode sector
+	inode = (FS3_INODE *)bufs[*count];
+	memset(inode, 0, FS3_SECTOR_SIZE);
+	inode->magic = FS3_INODE_MAGIC;
+	strncpy(inode->name, file->name, FS3_MAX_PATH_LENGTH-1);
+	inode->length = file->length;
+	inode->numOfExtents = file->numOfExtents;
+	inode->numOfOverflow = file->numOfOverflow;
+	memcpy(inode->overflow, file->overflow, sizeof(inode->overflow));
+	plan[*count].pair.trackIndex = FS3_INODE_TRACK;
+	plan[*count].pair.sectorIndex = file->fileHandle;
+	plan[*count].data = bufs[*count];
+
+	//Overflow sectors follow it in the batch
+	for(i=0; i<file->numOfOverflow; i++){
+		memset(bufs[*count+1+i], 0, FS3_SECTOR_SIZE);
+		plan[*count+1+i].pair = file->overflow[i];
+		plan[*count+1+i].data = bufs[*count+1+i];
+	}
+	for(i=0; i<file->numOfExtents; i++){
+		if(i < FS3_INODE_EXTENTS){
+			extent = &inode->extents[i];
+		}
+		else{
+			extent = &((FS3_DISK_EXTENT *)bufs[*count+1+(i-FS3_INODE_EXTENTS)/FS3_OVERFLOW_EXTENTS])[(i-FS3_INODE_EXTENTS)%FS3_OVERFLOW_EXTENTS];
+		}
+		extent->trackIndex = file->extents[i].start.trackIndex;
+		extent->sectorIndex = file->extents[i].start.sectorIndex;
+		extent->length = file->extents[i].length;
+	}
+	*count += 1+file->numOfOverflow;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_journal
+// Description  : Applies the journal sectors of the current epoch, which
+//                are there only if the last unmount was not clean, then
+//                checkpoints the result. The first sector is read alone so
+//                a clean mount costs one read.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t replay_journal(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	IO_PLAN_ENTRY plan[FS3_JOURNAL_READ_BATCH];
+	FS3Sector *sectors;
+	FS3_JOURNAL_HEADER *header;
+	FS3_JOURNAL_RECORD *records;
+	int sequence = 0;
+	int replayed = 0;
+	int done = 0;
+	int result = 0;
+	int batch;
+	int i;
+	uint32_t r;
+
+	sectors = malloc(FS3_JOURNAL_READ_BATCH*sizeof(FS3Sector));
+	if(sectors == NULL){
+		return(-1);
+	}
+
+	while(!done && (sequence < FS3_TRACK_SIZE)){
+		batch = (sequence == 0) ? 1 : CMPSC311_MINVAL(FS3_JOURNAL_READ_BATCH, FS3_TRACK_SIZE-sequence);
+		for(i=0; i<batch; i++){
+			plan[i].pair.trackIndex = FS3_JOURNAL_TRACK;
+			plan[i].pair.sectorIndex = sequence+i;
+			plan[i].data = sectors[i];
+		}
+		if(pipeline_sector_ops(FS3_OP_RDSECT, plan, batch) == -1){
+			result = -1;
+			break;
+		}
+
+		for(i=0; (i<batch) && !done; i++){
+			//Journal ends at the first sector not written in this epoch
+			header = (FS3_JOURNAL_HEADER *)sectors[i];
+			if((header->epoch != disk->journalEpoch) || (header->sequence != (uint32_t)(sequence+i)) ||
+				(header->count > FS3_JOURNAL_RECORDS) || (header->checksum != journal_checksum(sectors[i]))){
+				done = 1;
+				break;
+			}
+
+			//Metadata the records change is loaded before the first is applied
+			if((replayed == 0) && ((load_directory() == -1) || (load_free_space_map() == -1))){
+				result = -1;
+				done = 1;
+				break;
+			}
+			records = (FS3_JOURNAL_RECORD *)(sectors[i]+sizeof(FS3_JOURNAL_HEADER));
+			for(r=0; r<header->count; r++){
+				if(apply_journal_record(&records[r]) == -1){
+					result = -1;
+					done = 1;
+					break;
+				}
+				replayed++;
+			}
+		}
+		sequence += batch;
+	}
+	free(sectors);
+
+	if(result == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to replay journal");
+		return(-1);
+	}
+	if(replayed == 0){
+		return(0);
+	}
+
+	//Checkpoints so the replayed changes are no longer only in the journal
+	logMessage(FS3DriverLLevel, "FS3 DRVR: Replayed %d journal records",replayed);
+	disk->superblockDirty = 1;
+	return(sync_metadata());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : apply_journal_record
+// Description  : Applies one journal record to the in-memory metadata.
+//                Records are idempotent so a checkpoint cut short before its
+//                superblock was written can be replayed over.
+//
+// Inputs       : record - journal record to apply
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t apply_journal_record(FS3_JOURNAL_RECORD *record){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FILE_INFO *file;
+	FS3_DISK_EXTENT extent;
+	TRACK_SECTOR_PAIR pair;
+	uint32_t skip;
+	int i;
+
+	if(record->slot >= FS3_MAX_TOTAL_FILES){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Journal record for bad file slot %d",record->slot);
+		return(-1);
+	}
+	file = &disk->files[record->slot];
+
+	//New file, its name and sectors follow in later records. No name hash voids a failed create.
+	if(record->type == FS3_JOURNAL_CREATE){
+		if(file->loaded && (record->value == 0)){
+			//Sectors replayed for the file are free again
+			for(i=0; i<file->numOfExtents; i++){
+				mark_track_sectors(file->extents[i].start, file->extents[i].length, 0);
+			}
+		}
+		free(file->extents);
+		memset(file, 0, sizeof(FILE_INFO));
+		file->fileHandle = record->slot;
+		file->tailSector = -1;
+		file->loaded = (record->value != 0);
+		file->inodeDirty = file->loaded;
+		reset_readahead(file);
+		disk->nameHashes[record->slot] = record->value;
+		disk->directoryDirty[(record->slot*sizeof(uint32_t))/FS3_SECTOR_SIZE] = 1;
+		return(0);
+	}
+
+	//Other records change files whose inode is read first
+	if(!file->loaded && ((disk->nameHashes[record->slot] == 0) || (load_file_inode(record->slot) == -1))){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Journal record for missing file slot %d",record->slot);
+		return(-1);
+	}
+
+	switch(record->type){
+	case FS3_JOURNAL_NAME:
+		if(record->value < FS3_MAX_PATH_LENGTH-1){
+			memcpy(file->name+record->value, record->data, CMPSC311_MINVAL(FS3_JOURNAL_NAME_CHUNK, FS3_MAX_PATH_LENGTH-1-record->value));
+			file->inodeDirty = 1;
+		}
+		return(0);
+
+	case FS3_JOURNAL_EXTENT:
+		memcpy(&extent, record->data, sizeof(FS3_DISK_EXTENT));
+		if((record->value > (uint32_t)file->numOfSectors) || (extent.sectorIndex+extent.length > FS3_TRACK_SIZE)){
+			logMessage(FS3DriverLLevel, "FS3 DRVR: Journal extent out of order for file slot %d",record->slot);
+			return(-1);
+		}
+		pair.trackIndex = extent.trackIndex;
+		pair.sectorIndex = extent.sectorIndex;
+		mark_track_sectors(pair, extent.length, 1);
+
+		//Only sectors past those the inode already holds are added
+		skip = file->numOfSectors-record->value;
+		if(skip < extent.length){
+			pair.sectorIndex += skip;
+			return(add_file_sectors(file, pair, extent.length-skip));
+		}
+		return(0);
+
+	case FS3_JOURNAL_LENGTH:
+		if(record->value > file->length){
+			file->length = record->value;
+			file->inodeDirty = 1;
+		}
+		return(0);
+
+	default:
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Bad journal record type %d",record->type);
+		return(-1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_checksum
+// Description  : Checksums the header fields and records of a journal
+//                sector (FNV-1a)
+//
+// Inputs       : sector - journal sector image
+// Outputs      : checksum of the sector
+
+uint32_t journal_checksum(char *sector){
+	FS3_JOURNAL_HEADER *header = (FS3_JOURNAL_HEADER *)sector;
+	uint32_t hash = 2166136261u;
+	size_t length;
+	size_t i;
+
+	length = CMPSC311_MINVAL(header->count, FS3_JOURNAL_RECORDS)*sizeof(FS3_JOURNAL_RECORD);
+	for(i=0; i<sizeof(FS3_JOURNAL_HEADER)+length; i++){
+		//Skips the checksum field itself
+		if((i >= offsetof(FS3_JOURNAL_HEADER, checksum)) && (i < sizeof(FS3_JOURNAL_HEADER))){
+			continue;
+		}
+		hash ^= (unsigned char)sector[i];
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_append
+// Description  : Adds a record to the journal sector being filled. Length
+//                and extent records fold into the file's last one in the
+//                sector when they only extend it, so many writes share a
+//                record. A full sector is written and the next started,
+//                asking for a checkpoint once the journal track is nearly
+//                used up.
+//
+// Inputs       : record - journal record to add (journal lock held)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t journal_append(FS3_JOURNAL_RECORD *record){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3_JOURNAL_HEADER *header = (FS3_JOURNAL_HEADER *)disk->journal;
+	FS3_JOURNAL_RECORD *records = (FS3_JOURNAL_RECORD *)(disk->journal+sizeof(FS3_JOURNAL_HEADER));
+	FS3_DISK_EXTENT lastExtent;
+	FS3_DISK_EXTENT extent;
+	int i;
+
+	//Finds the file's last record of the same type in this sector
+	for(i=(int)header->count-1; i>=0; i--){
+		if((records[i].slot == record->slot) && (records[i].type == record->type)){
+			break;
+		}
+	}
+	if((i >= 0) && (record->type == FS3_JOURNAL_LENGTH)){
+		records[i].value = CMPSC311_MAXVAL(records[i].value, record->value);
+		disk->journalDirty = 1;
+		return(0);
+	}
+	if((i >= 0) && (record->type == FS3_JOURNAL_EXTENT)){
+		memcpy(&lastExtent, records[i].data, sizeof(FS3_DISK_EXTENT));
+		memcpy(&extent, record->data, sizeof(FS3_DISK_EXTENT));
+		if((lastExtent.trackIndex == extent.trackIndex) && (lastExtent.sectorIndex+lastExtent.length == extent.sectorIndex) &&
+			(records[i].value+lastExtent.length == record->value)){
+			lastExtent.length += extent.length;
+			memcpy(records[i].data, &lastExtent, sizeof(FS3_DISK_EXTENT));
+			disk->journalDirty = 1;
+			return(0);
+		}
+	}
+
+	//Starts the next sector once this one is full, asking for a checkpoint as the track runs out
+	if(header->count == FS3_JOURNAL_RECORDS){
+		if(disk->journalHead == FS3_TRACK_SIZE-1){
+			logMessage(FS3DriverLLevel, "FS3 DRVR: Journal full before a checkpoint");
+			return(-1);
+		}
+		if(write_journal_sector() == -1){
+			return(-1);
+		}
+		disk->journalHead++;
+		memset(disk->journal, 0, FS3_SECTOR_SIZE);
+		if(disk->journalHead >= FS3_JOURNAL_CHECKPOINT_MARK){
+			disk->checkpointWanted = 1;
+		}
+	}
+	records[header->count++] = *record;
+	disk->journalDirty = 1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_create
+// Description  : Journals the creation of a file and its name
+//
+// Inputs       : file - file created
+//                hash - name hash of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t journal_create(FILE_INFO *file, uint32_t hash){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3_JOURNAL_RECORD record;
+	size_t offset;
+
+	memset(&record, 0, sizeof(record));
+	record.type = FS3_JOURNAL_CREATE;
+	record.slot = file->fileHandle;
+	record.value = hash;
+	pthread_mutex_lock(&disk->journalLock);
+	if(journal_append(&record) == -1){
+		pthread_mutex_unlock(&disk->journalLock);
+		return(-1);
+	}
+
+	//Name is carried a chunk per record
+	for(offset=0; offset<strlen(file->name); offset+=FS3_JOURNAL_NAME_CHUNK){
+		memset(&record, 0, sizeof(record));
+		record.type = FS3_JOURNAL_NAME;
+		record.slot = file->fileHandle;
+		record.value = offset;
+		strncpy(record.data, file->name+offset, FS3_JOURNAL_NAME_CHUNK);
+		if(journal_append(&record) == -1){
+			pthread_mutex_unlock(&disk->journalLock);
+			return(-1);
+		}
+	}
+	pthread_mutex_unlock(&disk->journalLock);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_extent
+// Description  : Journals sectors added to the end of a file
+//
+// Inputs       : file - file grown
+//                fileSector - first file sector of the run
+//                pair - device location of the run
+//                count - number of sectors in the run
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t journal_extent(FILE_INFO *file, int fileSector, TRACK_SECTOR_PAIR pair, int count){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3_JOURNAL_RECORD record;
+	FS3_DISK_EXTENT extent;
+	int32_t result;
+
+	memset(&record, 0, sizeof(record));
+	record.type = FS3_JOURNAL_EXTENT;
+	record.slot = file->fileHandle;
+	record.value = fileSector;
+	extent.trackIndex = pair.trackIndex;
+	extent.sectorIndex = pair.sectorIndex;
+	extent.length = count;
+	memcpy(record.data, &extent, sizeof(FS3_DISK_EXTENT));
+	pthread_mutex_lock(&disk->journalLock);
+	result = journal_append(&record);
+	pthread_mutex_unlock(&disk->journalLock);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_length
+// Description  : Journals the length of a file after it grew, leaving out
+//                bytes still in its tail buffer (journaled when it is stored)
+//
+// Inputs       : file - file grown
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t journal_length(FILE_INFO *file){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3_JOURNAL_RECORD record;
+	int32_t result;
+
+	memset(&record, 0, sizeof(record));
+	record.type = FS3_JOURNAL_LENGTH;
+	record.slot = file->fileHandle;
+	record.value = file->length;
+	if((file->tailSector != -1) && (record.value > (uint32_t)file->tailSector*FS3_SECTOR_SIZE)){
+		record.value = (uint32_t)file->tailSector*FS3_SECTOR_SIZE;
+	}
+	pthread_mutex_lock(&disk->journalLock);
+	result = journal_append(&record);
+	pthread_mutex_unlock(&disk->journalLock);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : commit_journal
+// Description  : Writes the journal sector being filled, committing every
+//                metadata change made since the last commit in one sector
+//                write (group commit)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t commit_journal(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	int32_t result;
+
+	//Records other threads added since are committed too
+	pthread_mutex_lock(&disk->journalLock);
+	result = write_journal_sector();
+	pthread_mutex_unlock(&disk->journalLock);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_journal_sector
+// Description  : Writes the journal sector being filled if it holds records
+//                not yet written. Data reaches the disk first, so the
+//                write-back cache is flushed before it (ordered mode).
+//
+// Inputs       : none (journal lock held)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t write_journal_sector(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3_JOURNAL_HEADER *header = (FS3_JOURNAL_HEADER *)disk->journal;
+
+	if((disk->mounted != 1) || !disk->journalDirty){
+		return(0);
+	}
+	if(fs3_flush_cache() == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to flush data before the journal");
+		return(-1);
+	}
+	header->epoch = disk->journalEpoch;
+	header->sequence = disk->journalHead;
+	header->checksum = journal_checksum(disk->journal);
+	if(write_sector(FS3_JOURNAL_TRACK,disk->journalHead,disk->journal) == -1){
+		logMessage(FS3DriverLLevel, "FS3 DRVR: Failed to commit journal");
+		return(-1);
+	}
+	disk->journalDirty = 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reset_journal
+// Description  : Starts an empty journal for the current epoch
+//
+// Inputs       : none
+// Outputs      : none
+
+void reset_journal(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	memset(disk->journal, 0, FS3_SECTOR_SIZE);
+	disk->journalHead = 0;
+	disk->journalDirty = 0;
+	disk->checkpointWanted = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_file_table
+// Description  : Drops in-memory file metadata at unmount, it is read back
+//                from the disk after the next mount
+//
+// Inputs       : none
+// Outputs      : none
+
+void release_file_table(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	int i;
+
+	for(i=0; i<FS3_MAX_TOTAL_FILES; i++){
+		free(disk->files[i].extents);
+		memset(&disk->files[i], 0, sizeof(FILE_INFO));
+	}
+	disk->directoryLoaded = 0;
+	disk->bitmapLoaded = 0;
+	disk->indexed = 0;
+	reset_journal();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : build_file_index
+// Description  : Rebuilds the file name index and free slot list from the
+//                directory
+//
+// Inputs       : none
+// Outputs      : none
+
+void build_file_index(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	int i;
+
+	memset(disk->nameIndex, 0, sizeof(disk->nameIndex));
+	disk->freeSlotCount = 0;
+
+	//Free slots are pushed highest first so the lowest is used next
+	for(i=FS3_MAX_TOTAL_FILES-1; i>=0; i--){
+		if(disk->nameHashes[i] == 0){
+			disk->freeSlots[disk->freeSlotCount++] = i;
+		}
+		else{
+			insert_file_index(disk->nameHashes[i], i);
+		}
+	}
+	disk->indexed = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_new_file
+// Description  : Undoes the creation of a file that failed part way, so the
+//                next open of its name creates it afresh. Its slot, name and
+//                any sectors given to it are freed, and a create record with
+//                no name hash voids the slot should the journal be replayed.
+//                (namespace lock held, file locked exclusive by caller)
+//
+// Inputs       : file - file being created
+// Outputs      : none
+
+void release_new_file(FILE_INFO *file){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3_JOURNAL_RECORD record;
+	int i;
+
+	//Gives back sectors allocated before the failure
+	pthread_mutex_lock(&disk->allocLock);
+	for(i=0; i<file->numOfExtents; i++){
+		release_track_sector_pair(file->extents[i].start, file->extents[i].length);
+	}
+	pthread_mutex_unlock(&disk->allocLock);
+	free(file->extents);
+	file->extents = NULL;
+	file->numOfExtents = 0;
+	file->extentCapacity = 0;
+	file->numOfSectors = 0;
+	file->open = 0;
+	file->loaded = 0;
+	file->inodeDirty = 0;
+	file->name[0] = '\0';
+
+	//Should the journal not take it, a crash before the next checkpoint leaves the file empty
+	memset(&record, 0, sizeof(record));
+	record.type = FS3_JOURNAL_CREATE;
+	record.slot = file->fileHandle;
+	pthread_mutex_lock(&disk->journalLock);
+	journal_append(&record);
+	pthread_mutex_unlock(&disk->journalLock);
+
+	//Slot leaves the directory, the index is rebuilt as entries are never removed from it
+	disk->nameHashes[file->fileHandle] = 0;
+	disk->directoryDirty[(file->fileHandle*sizeof(uint32_t))/FS3_SECTOR_SIZE] = 1;
+	build_file_index();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hash_file_name
+// Description  : Hashes a file name for the name index (FNV-1a)
+//
+// Inputs       : name - file name to hash
+// Outputs      : hash of the name, never 0 (marks an unused directory slot)
+
+uint32_t hash_file_name(const char *name){
+	uint32_t hash = 2166136261u;
+
+	while(*name != '\0'){
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return((hash == 0) ? 1 : hash);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_file_slot
+// Description  : Finds the slot of a file by name in the name index. Slots
+//                whose name hash matches have their inode read if not yet
+//                loaded, so an open reads only the inodes it needs.
+//
+// Inputs       : name - file name to find
+// Outputs      : slot of the file if found, -1 if not, -2 if an inode read failed
+
+int find_file_slot(const char *name){
+	DISK *disk = &fs3_ctx_current()->disk;
+	uint32_t hash;
+	uint32_t probe;
+	int slot;
+
+	//Probes linearly until the name or an empty entry is found
+	hash = hash_file_name(name);
+	for(probe = hash&(FS3_FILE_INDEX_SIZE-1); disk->nameIndex[probe] != 0; probe = (probe+1)&(FS3_FILE_INDEX_SIZE-1)){
+		slot = disk->nameIndex[probe]-1;
+		if(disk->nameHashes[slot] != hash){
+			continue;
+		}
+		if(!disk->files[slot].loaded && (load_file_inode(slot) == -1)){
+			return(-2);
+		}
+		if(strcmp(disk->files[slot].name,name) == 0){
+			return(slot);
+		}
+	}
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insert_file_index
+// Description  : Adds a file slot to the name index. Files are never
+//                removed, so the index never needs tombstones.
+//
+// Inputs       : hash - name hash of the slot
+//                slot - slot of the file in disk->files
+// Outputs      : none
+
+void insert_file_index(uint32_t hash, int slot){
+	DISK *disk = &fs3_ctx_current()->disk;
+	uint32_t probe;
+
+	//Index holds at most half its entries, so an empty one is always found
+	for(probe = hash&(FS3_FILE_INDEX_SIZE-1); disk->nameIndex[probe] != 0; probe = (probe+1)&(FS3_FILE_INDEX_SIZE-1));
+	disk->nameIndex[probe] = slot+1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tseek
+// Description  : Seeks track to given track
+//
+// Inputs       : trackToSeek - track index to seek to 
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t tseek(FS3TrackIndex trackToSeek){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3CmdBlk tseek;
+	FS3CmdBlk cmd;
+	uint8_t returnVal;
+
+	//Seeks track to given trackToSeek
+	cmd = construct_fs3cmdblock(FS3_OP_TSEEK,0,trackToSeek,0);
+	if(network_fs3_syscall(cmd,&tseek,NULL)==-1){
+		//Failed syscall
+		return(-1);
+	}
+	
+	deconstruct_fs3cmdblock(tseek,NULL,NULL,NULL,&returnVal);
+	if(returnVal == 0){
+		//Successful track seek
+		logMessage(FS3DriverLLevel, "Track seeked to %d",trackToSeek);
+		disk->stats.tseeks++;
+		disk->currentTrackIndex = trackToSeek;
+		disk->connectionTrack[network_fs3_track_connection(trackToSeek)] = trackToSeek;
+		return(0);
+	}
+	else {
+		//Failed track seek
+		logMessage(FS3DriverLLevel, "Failed track seek to %d",trackToSeek);
+		return(-1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reset_connection_tracks
+// Description  : Forgets the track of every pooled connection, so the next
+//                sector on each is preceded by a track seek
+//
+// Inputs       : none
+// Outputs      : none
+
+void reset_connection_tracks(void){
+	DISK *disk = &fs3_ctx_current()->disk;
+	int i;
+
+	for(i=0; i<FS3_MAX_CONNECTIONS; i++){
+		pthread_mutex_lock(&disk->connectionLocks[i]);
+		disk->connectionTrack[i] = FS3_NO_TRACK;
+		pthread_mutex_unlock(&disk->connectionLocks[i]);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_free_track_sector_pair
+// Description  : Allocates a run of free sectors on one track. The run
+//                starts at trk/sct if that sector is free, else is the first
+//                free run long enough on the nearest track with room.
+//
+// Inputs       : trk - track to allocate near
+//                sct - sector to allocate at if free (may be FS3_TRACK_SIZE)
+//                count - number of sectors wanted
+//                pair - set to the first sector of the run
+// Outputs      : sectors allocated (1 to count) if successful, -1 if disk full
+
+int32_t get_free_track_sector_pair(FS3TrackIndex trk, FS3SectorIndex sct, int count, TRACK_SECTOR_PAIR *pair){
+	DISK *disk = &fs3_ctx_current()->disk;
+	int distance;
+	int track;
+	int start;
+	int length;
+	int pass;
+
+	count = CMPSC311_MINVAL(count, FS3_TRACK_SIZE);
+
+	//Continues the run ending at trk/sct if possible
+	if((trk < FS3_VOLUME_TRACKS) && (sct < FS3_TRACK_SIZE) && (next_free_sector(trk, sct) == sct)){
+		start = sct;
+		length = free_run_length(trk, sct, count);
+		track = trk;
+	}
+	else{
+		//Searches tracks outward from trk, first for room for the whole run then for any room
+		start = -1;
+		track = 0;
+		for(pass = 0; (pass < 2) && (start == -1); pass++){
+			for(distance = 0; distance < 2*FS3_VOLUME_TRACKS; distance++){
+				track = (distance%2 == 0) ? (int)trk+distance/2 : (int)trk-(distance+1)/2;
+				if((track < 0) || (track >= FS3_VOLUME_TRACKS) ||
+					(FS3_TRACK_SIZE-disk->trackUsed[track] < ((pass == 0) ? count : 1))){
+					continue;
+				}
+				start = find_free_run(track, count, &length);
+				if(start != -1){
+					break;
+				}
+			}
+		}
+		if(start == -1){
+			logMessage(FS3DriverLLevel, "FS3 driver: no free sectors left on disk");
+			return(-1);
+		}
+	}
+
+	pair->trackIndex = track;
+	pair->sectorIndex = start;
+	mark_track_sectors(*pair, length, 1);
+	return(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_track_sector_pair
+// Description  : Returns a run of sectors to the free space bitmap
+//
+// Inputs       : pair - first sector of the run
+//                count - number of sectors in the run
+// Outputs      : none
+
+void release_track_sector_pair(TRACK_SECTOR_PAIR pair, int count){
+	mark_track_sectors(pair, count, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mark_track_sectors
+// Description  : Sets a run of sectors used or free in the bitmap, keeping
+//                the used count of the track
+//
+// Inputs       : pair - first sector of the run
+//                count - number of sectors in the run (on the same track)
+//                used - if the sectors are now used (1:true)
+// Outputs      : none
+
+void mark_track_sectors(TRACK_SECTOR_PAIR pair, int count, int used){
+	DISK *disk = &fs3_ctx_current()->disk;
+	uint64_t *word;
+	uint64_t mask;
+	int sector = pair.sectorIndex;
+	int end;
+	int bits;
+
+	//Bounds check, the run must stay on its track
+	if((pair.trackIndex >= FS3_VOLUME_TRACKS) || (count <= 0) || (sector+count > FS3_TRACK_SIZE)){
+		logMessage(FS3DriverLLevel, "FS3 driver: bad sector run Trk %d Sct %d (%d)",pair.trackIndex,sector,count);
+		return;
+	}
+
+	end = sector+count;
+	while(sector < end){
+		word = &disk->sectorMap[pair.trackIndex][sector/64];
+		bits = CMPSC311_MINVAL(64-sector%64, end-sector);
+		mask = ((bits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits)-1)) << (sector%64);
+		disk->trackUsed[pair.trackIndex] -= __builtin_popcountll(*word);
+		*word = used ? (*word | mask) : (*word & ~mask);
+		disk->trackUsed[pair.trackIndex] += __builtin_popcountll(*word);
+		sector += bits;
+	}
+	disk->bitmapDirty[pair.trackIndex/FS3_BITMAP_TRACKS_PER_SECTOR] = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_free_sector
+// Description  : Finds the first free sector of a track at or after from,
+//                skipping full words of the bitmap
+//
+// Inputs       : trk - track to search
+//                from - first sector to consider
+// Outputs      : sector index if found, -1 if none
+
+int next_free_sector(FS3TrackIndex trk, int from){
+	DISK *disk = &fs3_ctx_current()->disk;
+	uint64_t freeBits;
+	int w;
+
+	if(from >= FS3_TRACK_SIZE){
+		return(-1);
+	}
+	w = from/64;
+	freeBits = ~disk->sectorMap[trk][w] & (~(uint64_t)0 << (from%64));
+	while(freeBits == 0){
+		if(++w == FS3_SECTOR_MAP_WORDS){
+			return(-1);
+		}
+		freeBits = ~disk->sectorMap[trk][w];
+	}
+	return(w*64+__builtin_ctzll(freeBits));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_run_length
+// Description  : Counts the free sectors of a track from start, up to max
+//
+// Inputs       : trk - track to search
+//                start - first sector of the run (free)
+//                max - most sectors wanted
+// Outputs      : length of the free run
+
+int free_run_length(FS3TrackIndex trk, int start, int max){
+	DISK *disk = &fs3_ctx_current()->disk;
+	uint64_t usedBits;
+	int length = 0;
+	int sector = start;
+
+	while((length < max) && (sector < FS3_TRACK_SIZE)){
+		usedBits = disk->sectorMap[trk][sector/64] >> (sector%64);
+		if(usedBits != 0){
+			//Run ends at the next used sector of this word
+			length += __builtin_ctzll(usedBits);
+			break;
+		}
+		length += 64-sector%64;
+		sector += 64-sector%64;
+	}
+	return(CMPSC311_MINVAL(length, max));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_free_run
+// Description  : Finds the first free run of count sectors on a track, or
+//                its longest free run if none is that long
+//
+// Inputs       : trk - track to search
+//                count - number of sectors wanted
+//                length - set to the length of the run found
+// Outputs      : first sector of the run if found, -1 if the track is full
+
+int find_free_run(FS3TrackIndex trk, int count, int *length){
+	int best = -1;
+	int bestLength = 0;
+	int start;
+	int runLength;
+
+	for(start = next_free_sector(trk, 0); start != -1; start = next_free_sector(trk, start+runLength)){
+		runLength = free_run_length(trk, start, count);
+		if(runLength == count){
+			*length = runLength;
+			return(start);
+		}
+		if(runLength > bestLength){
+			best = start;
+			bestLength = runLength;
+		}
+	}
+	*length = bestLength;
+	return(best);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocate_file_sectors
+// Description  : Allocates count sectors at the end of a file, continuing
+//                its last run where possible so it stays contiguous. Files
+//                growing at once take turns at the bitmap.
+//
+// Inputs       : file - file to grow
+//                count - number of sectors to add
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t allocate_file_sectors(FILE_INFO *file, int count){
+	DISK *disk = &fs3_ctx_current()->disk;
+	TRACK_SECTOR_PAIR pair;
+	EXTENT *last;
+	FS3TrackIndex trk;
+	FS3SectorIndex sct;
+	int allocated;
+	int fileSector;
+	int32_t result = 0;
+
+	//Free space bitmap is read on first allocation
+	pthread_mutex_lock(&disk->allocLock);
+	if(load_free_space_map() == -1){
+		pthread_mutex_unlock(&disk->allocLock);
+		return(-1);
+	}
+
+	while(count > 0){
+		//Files grow after their last sector, new files near the last file placed
+		if(file->numOfExtents > 0){
+			last = &file->extents[file->numOfExtents-1];
+			trk = last->start.trackIndex;
+			sct = last->start.sectorIndex+last->length;
+		}
+		else{
+			trk = disk->nextTrack;
+			sct = disk->nextSector;
+		}
+
+		allocated = get_free_track_sector_pair(trk, sct, count, &pair);
+		if(allocated == -1){
+			logMessage(FS3DriverLLevel, "FS3 driver: failed to allocat fs3 track and sector");
+			result = -1;
+			break;
+		}
+		fileSector = file->numOfSectors;
+		if(add_file_sectors(file, pair, allocated) == -1){
+			release_track_sector_pair(pair, allocated);
+			result = -1;
+			break;
+		}
+		if(journal_extent(file, fileSector, pair, allocated) == -1){
+			result = -1;
+			break;
+		}
+		logMessage(FS3DriverLLevel, "FS3 driver: allocated fs3 track %d, sectors %d-%d for fh %d"
+			,pair.trackIndex,pair.sectorIndex,pair.sectorIndex+allocated-1,file->fileHandle);
+
+		disk->nextTrack = pair.trackIndex;
+		disk->nextSector = pair.sectorIndex+allocated;
+		disk->superblockDirty = 1;
+		count -= allocated;
+	}
+	pthread_mutex_unlock(&disk->allocLock);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_file_sectors
+// Description  : Appends a run of device sectors to the block map of a
+//                file, extending the last extent when the run follows it on
+//                the same track
+//
+// Inputs       : file - file to grow
+//                pair - device location of the first sector of the run
+//                count - number of sectors in the run
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t add_file_sectors(FILE_INFO *file, TRACK_SECTOR_PAIR pair, int count){
+	EXTENT *last;
+	EXTENT *grown;
+	int capacity;
+
+	//Extends the last run if the sectors are contiguous with it
+	if(file->numOfExtents > 0){
+		last = &file->extents[file->numOfExtents-1];
+		if((last->start.trackIndex == pair.trackIndex) && (last->start.sectorIndex+last->length == pair.sectorIndex)){
+			last->length += count;
+			file->numOfSectors += count;
+			file->inodeDirty = 1;
+			return(0);
+		}
+	}
+
+	//Starts a new run, growing the block map as needed
+	if(file->numOfExtents == file->extentCapacity){
+		capacity = (file->extentCapacity == 0) ? FS3_INITIAL_EXTENTS : file->extentCapacity*2;
+		grown = realloc(file->extents, capacity*sizeof(EXTENT));
+		if(grown == NULL){
+			logMessage(FS3DriverLLevel, "FS3 driver: failed to grow block map of fh %d",file->fileHandle);
+			return(-1);
+		}
+		file->extents = grown;
+		file->extentCapacity = capacity;
+	}
+	file->extents[file->numOfExtents].fileSector = file->numOfSectors;
+	file->extents[file->numOfExtents].start = pair;
+	file->extents[file->numOfExtents].length = count;
+	file->numOfExtents++;
+	file->numOfSectors += count;
+	file->inodeDirty = 1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_file_sector
+// Description  : Finds the device sector of a file sector by binary search
+//                of the block map
+//
+// Inputs       : file - file to look in
+//                sectorNumber - sector of the file
+//                pair - set to the device location of the sector
+// Outputs      : sectors contiguous on the track from this one (including
+//                it) if successful, -1 if the file has no such sector
+
+int32_t get_file_sector(FILE_INFO *file, int sectorNumber, TRACK_SECTOR_PAIR *pair){
+	EXTENT *extent;
+	int low = 0;
+	int high = file->numOfExtents-1;
+	int mid;
+
+	if((sectorNumber < 0) || (sectorNumber >= file->numOfSectors)){
+		logMessage(FS3DriverLLevel, "FS3 driver: fh %d has no sector %d",file->fileHandle,sectorNumber);
+		return(-1);
+	}
+
+	//Finds the last extent starting at or before the sector
+	while(low < high){
+		mid = (low+high+1)/2;
+		if(file->extents[mid].fileSector <= sectorNumber){
+			low = mid;
+		}
+		else{
+			high = mid-1;
+		}
+	}
+	extent = &file->extents[low];
+	pair->trackIndex = extent->start.trackIndex;
+	pair->sectorIndex = extent->start.sectorIndex+(sectorNumber-extent->fileSector);
+	return(extent->length-(sectorNumber-extent->fileSector));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_sector
+// Description  : Reads a sector from the device, seeking track if needed
+//
+// Inputs       : trk - track index of sector
+//                sct - sector index of sector
+//                buf - buffer of FS3_SECTOR_SIZE bytes to read into
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t read_sector(FS3TrackIndex trk, FS3SectorIndex sct, void *buf){
+	IO_PLAN_ENTRY plan;
+
+	//A batch of one, so it is ordered against other threads' batches
+	plan.pair.trackIndex = trk;
+	plan.pair.sectorIndex = sct;
+	plan.data = buf;
+	if(pipeline_sector_ops(FS3_OP_RDSECT, &plan, 1) == -1){
+		logMessage(FS3DriverLLevel, "Failed sector read Trk %d Sct %d",trk,sct);
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_sector
+// Description  : Writes a sector to the device, seeking track if needed
+//
+// Inputs       : trk - track index of sector
+//                sct - sector index of sector
+//                buf - buffer of FS3_SECTOR_SIZE bytes to write
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t write_sector(FS3TrackIndex trk, FS3SectorIndex sct, void *buf){
+	IO_PLAN_ENTRY plan;
+
+	plan.pair.trackIndex = trk;
+	plan.pair.sectorIndex = sct;
+	plan.data = buf;
+	if(pipeline_sector_ops(FS3_OP_WRSECT, &plan, 1) == -1){
+		logMessage(FS3DriverLLevel, "Failed sector write Trk %d Sct %d",trk,sct);
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_sectors
+// Description  : Writes a batch of sectors back for the write-back cache in
+//                the order given, so sectors it has sorted along a track go
+//                out as one range where the server takes them
+//
+// Inputs       : trks - track index of each sector
+//                scts - sector index of each sector
+//                bufs - buffer of FS3_SECTOR_SIZE bytes of each sector
+//                count - number of sectors
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t flush_sectors(FS3TrackIndex *trks, FS3SectorIndex *scts, void **bufs, int count){
+	IO_PLAN_ENTRY stackPlan[FS3_IO_PLAN_STACK_SIZE];
+	IO_PLAN_ENTRY *plan;
+	int32_t result = 0;
+	int capacity;
+	int planned;
+	int i;
+	int j;
+
+	plan = reserve_io_plan(count, stackPlan, &capacity);
+	for(i=0; (i<count) && (result == 0); i+=planned){
+		planned = CMPSC311_MINVAL(count-i, capacity);
+		for(j=0; j<planned; j++){
+			plan[j].pair.trackIndex = trks[i+j];
+			plan[j].pair.sectorIndex = scts[i+j];
+			plan[j].data = bufs[i+j];
+		}
+		if(pipeline_sector_ops(FS3_OP_WRSECT, plan, planned) == -1){
+			logMessage(FS3DriverLLevel, "Failed write back of %d sectors from Trk %d Sct %d",planned,trks[i],scts[i]);
+			result = -1;
+		}
+	}
+	release_io_plan(plan, stackPlan);
+	return(result);
+}
 
-	//If out of sectors on track go to next track
-	if(my_disk.nextSector >= FS3_TRACK_SIZE){
-		my_disk.nextSector = 0;
-		my_disk.nextTrack++;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_sector
+// Description  : Stores a modified sector in the cache and writes it to the
+//                device unless the cache holds it for write-back
+//
+// Inputs       : trk - track index of sector
+//                sct - sector index of sector
+//                buf - buffer of FS3_SECTOR_SIZE bytes holding the sector
+//                cached - if buf is already the sector's cache line (1:true)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t store_sector(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, int cached){
+
+	//Keeps cache up to date
+	if(!cached){
+		fs3_put_cache(trk,sct,buf);
+	}
+
+	//Writes sector unless the cache holds it for write-back
+	if(fs3_mark_cache_dirty(trk,sct) == -1){
+		return(write_sector(trk,sct,buf));
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : append_file_tail
+// Description  : Appends bytes within the last sector of a file to its tail
+//                buffer, storing the sector once it fills
+//
+// Inputs       : file - file being appended to, at its length
+//                buf - bytes to append
+//                count - number of bytes, not past the end of the sector
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t append_file_tail(FILE_INFO *file, void *buf, int32_t count){
+	TRACK_SECTOR_PAIR location;
+	TRACK_SECTOR_PAIR *pair;
+	int sectorNumber;
+	uint32_t offset;
+
+	sectorNumber = SECTOR_INDEX_NUMBER(file->length);
+	offset = file->length%FS3_SECTOR_SIZE;
+	if(get_file_sector(file, sectorNumber, &location) == -1){
+		return(-1);
+	}
+	pair = &location;
+
+	//Loads the sector into the tail if not already buffered
+	if(file->tailSector != sectorNumber){
+		if(flush_file_tail(file) == -1){
+			return(-1);
+		}
+
+		//Existing bytes of the sector are fetched once
+		if((offset > 0) && (fs3_read_cache(pair->trackIndex,pair->sectorIndex,file->tail,0,offset) == -1)){
+			if(read_sector(pair->trackIndex,pair->sectorIndex,file->tail) == -1){
+				return(-1);
+			}
+		}
+		memset(&file->tail[offset], 0, FS3_SECTOR_SIZE-offset);
+		file->tailSector = sectorNumber;
+	}
+
+	//Appends bytes, storing the sector once full
+	memcpy(&file->tail[offset], buf, count);
+	if(offset+count == FS3_SECTOR_SIZE){
+		return(flush_file_tail(file));
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_file_tail
+// Description  : Stores the tail buffer of a file if it holds appended bytes,
+//                then journals the length now on the disk
+//
+// Inputs       : file - file to flush
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t flush_file_tail(FILE_INFO *file){
+	TRACK_SECTOR_PAIR location;
+	TRACK_SECTOR_PAIR *pair;
+
+	//Checks if there is anything buffered
+	if(file->tailSector == -1){
+		return(0);
+	}
+
+	if(get_file_sector(file, file->tailSector, &location) == -1){
+		return(-1);
+	}
+	pair = &location;
+	if(store_sector(pair->trackIndex,pair->sectorIndex,file->tail,0) == -1){
+		logMessage(FS3DriverLLevel, "Failed to store tail of fh %d",file->fileHandle);
+		return(-1);
+	}
+	file->tailSector = -1;
+	return(journal_length(file));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reserve_io_plan
+// Description  : Gets a plan for a call's sector operations. Calls of more
+//                sectors than the stack plan holds have theirs planned
+//                together on the heap (up to FS3_IO_PLAN_SIZE), or in batches
+//                of the stack plan if that cannot be allocated.
+//
+// Inputs       : sectors - number of sectors of the call
+//                stackPlan - plan of FS3_IO_PLAN_STACK_SIZE entries on the
+//                            caller's stack
+//                capacity - set to the number of entries of the plan
+// Outputs      : the plan, freed by release_io_plan
+
+IO_PLAN_ENTRY *reserve_io_plan(int sectors, IO_PLAN_ENTRY *stackPlan, int *capacity){
+	IO_PLAN_ENTRY *plan = NULL;
+
+	if(sectors > FS3_IO_PLAN_STACK_SIZE){
+		*capacity = CMPSC311_MINVAL(sectors, FS3_IO_PLAN_SIZE);
+		plan = malloc((size_t)*capacity*sizeof(IO_PLAN_ENTRY));
+	}
+	if(plan == NULL){
+		*capacity = FS3_IO_PLAN_STACK_SIZE;
+		plan = stackPlan;
+	}
+	return(plan);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_io_plan
+// Description  : Frees a plan from reserve_io_plan if it is on the heap
+//
+// Inputs       : plan - the plan
+//                stackPlan - plan on the caller's stack
+// Outputs      : none
+
+void release_io_plan(IO_PLAN_ENTRY *plan, IO_PLAN_ENTRY *stackPlan){
+	if(plan != stackPlan){
+		free(plan);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sort_io_plan
+// Description  : Orders planned sector operations by track in elevator order:
+//                tracks from the current one upward, then the ones below it
+//                downward, so each track is sought once
+//
+// Inputs       : plan - planned sector operations
+//                count - number of planned operations
+// Outputs      : none
+
+void sort_io_plan(IO_PLAN_ENTRY *plan, int count){
+	DISK *disk = &fs3_ctx_current()->disk;
+	FS3TrackIndex current;
+	int i;
+
+	//Sweeps from the track the device was last left on by any thread
+	pthread_mutex_lock(&disk->deviceLock);
+	current = disk->currentTrackIndex;
+	pthread_mutex_unlock(&disk->deviceLock);
+
+	//Gives each track its position in the sweep
+	for(i=0; i<count; i++){
+		if(plan[i].pair.trackIndex >= current){
+			plan[i].order = plan[i].pair.trackIndex-current;
+		}
+		else{
+			plan[i].order = FS3_VOLUME_TRACKS+(current-plan[i].pair.trackIndex);
+		}
+	}
+	qsort(plan, count, sizeof(IO_PLAN_ENTRY), compare_io_plan_entries);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_io_plan_entries
+// Description  : Orders planned sector operations by sweep position then
+//                sector for qsort
+//
+// Inputs       : a - pointer to first entry
+//                b - pointer to second entry
+// Outputs      : <0, 0, >0 as entry a sorts before, with, after entry b
+
+int compare_io_plan_entries(const void *a, const void *b){
+	const IO_PLAN_ENTRY *entryA = a;
+	const IO_PLAN_ENTRY *entryB = b;
+
+	if(entryA->order != entryB->order){
+		return(entryA->order-entryB->order);
+	}
+	return(entryA->pair.sectorIndex-entryB->pair.sectorIndex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : execute_read_plan
+// Description  : Reads planned sectors in elevator order, caches them and
+//                copies partial sectors into place in the caller buffer
+//
+// Inputs       : plan - planned sector reads
+//                count - number of planned reads
+//                prefetch - prefetch counters of the file if sectors are read
+//                           ahead of use (NULL if not)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t execute_read_plan(IO_PLAN_ENTRY *plan, int count, CACHE_PREFETCH_STATS *prefetch){
+	int i;
+
+	sort_io_plan(plan, count);
+	if(pipeline_sector_ops(FS3_OP_RDSECT, plan, count) == -1){
+		return(-1);
+	}
+	for(i=0; i<count; i++){
+		if(prefetch != NULL){
+			fs3_prefetch_cache(plan[i].pair.trackIndex,plan[i].pair.sectorIndex,plan[i].data,prefetch);
+			continue;
+		}
+		fs3_put_cache(plan[i].pair.trackIndex,plan[i].pair.sectorIndex,plan[i].data);
+		if(plan[i].data != plan[i].dest){
+			memcpy(plan[i].dest, plan[i].data+plan[i].offset, plan[i].chunk);
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : execute_write_plan
+// Description  : Stores planned sectors in elevator order
+//
+// Inputs       : plan - planned sector writes
+//                count - number of planned writes
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t execute_write_plan(IO_PLAN_ENTRY *plan, int count){
+	int i;
+	int writes = 0;
+
+	//Caches sectors, keeping those not held for write-back to send
+	sort_io_plan(plan, count);
+	for(i=0; i<count; i++){
+		fs3_put_cache(plan[i].pair.trackIndex,plan[i].pair.sectorIndex,plan[i].data);
+		if(fs3_mark_cache_dirty(plan[i].pair.trackIndex,plan[i].pair.sectorIndex) == -1){
+			plan[writes++] = plan[i];
+		}
+	}
+	return(pipeline_sector_ops(FS3_OP_WRSECT, plan, writes));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pipeline_sector_ops
+// Description  : Sends planned sector reads or writes (and the track seeks
+//                between them) without waiting on each reply, completing
+//                the oldest once the batch has FS3_PIPELINE_DEPTH in flight
+//                (a connection only has FS3_MAX_OUTSTANDING slots) and the
+//                rest at the end. Each sector goes on the pooled connection
+//                serving its track. The locks of the connections a batch
+//                uses are only held while sending, so a batch's seeks stay
+//                with its sectors while other threads' batches go out on the
+//                other connections and complete alongside it. Servers
+//                granting track-addressed sector ops need no seeks, so nor is
+//                the track of each connection or of the device kept. Servers
+//                granting range ops take each run of sectors along a track as
+//                one command per piece of the run together in memory, short
+//                pieces apart in memory (e.g., bounce sectors) are staged
+//                together for one.
+//
+// Inputs       : op - FS3_OP_RDSECT or FS3_OP_WRSECT
+//                plan - planned sector operations, in order to send
+//                count - number of planned operations
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t pipeline_sector_ops(uint8_t op, IO_PLAN_ENTRY *plan, int count){
+	DISK *disk = &fs3_ctx_current()->disk;
+	SECTOR_PIPELINE pipeline;
+	char *staging = NULL;
+	char *data;
+	uint32_t used = 0;
+	size_t staged = 0;
+	int result = 0;
+	int connection;
+	int tseeks = 0;
+	int ranges = 0;
+	int sectors = 0;
+	int trackOps;
+	int rangeOps;
+	int stage = 0;
+	int run;
+	int i;
+	int j;
+
+	if(count == 0){
+		return(0);
+	}
+	pipeline.submitted = 0;
+	pipeline.completed = 0;
+	pipeline.failed = 0;
+
+	//Stages the short pieces of runs apart in memory, sending them on their own if nothing can be staged
+	rangeOps = disk->extensions & FS3_EXT_RANGE_OPS;
+	trackOps = disk->extensions & (FS3_EXT_TRACK_OPS|FS3_EXT_RANGE_OPS);
+	if(rangeOps){
+		for(i=0; i<count; i+=run){
+			run = sector_range_length(plan+i, count-i, &stage);
+			staged += stage ? run : 0;
+		}
+		if(staged > 0){
+			staging = malloc(staged*FS3_SECTOR_SIZE);
+		}
+	}
+
+	//Locks every connection of the batch in order before sending, a thread
+	//holding replies it has not collected never waits on another's connection
+	for(i=0; i<count; i++){
+		used |= (uint32_t)1<<network_fs3_track_connection(plan[i].pair.trackIndex);
+	}
+	for(i=0; i<FS3_MAX_CONNECTIONS; i++){
+		if(used & ((uint32_t)1<<i)){
+			pthread_mutex_lock(&disk->connectionLocks[i]);
+		}
+	}
+
+	//Cache locks are taken before the connection locks, so none are taken here
+	staged = 0;
+	for(i=0; i<count; i+=run){
+		connection = network_fs3_track_connection(plan[i].pair.trackIndex);
+		run = 1;
+
+		//Sends a run of sectors along a track as one command if the server takes it
+		if(rangeOps){
+			run = sector_range_length(plan+i, count-i, &stage);
+			data = plan[i].data;
+			if(stage && (staging == NULL)){
+				run = sector_buffer_length(plan+i, run);
+			}
+			else if(stage){
+				data = staging+staged*FS3_SECTOR_SIZE;
+				staged += run;
+				for(j=0; (j<run) && (op == FS3_OP_WRSECT); j++){
+					memcpy(data+(size_t)j*FS3_SECTOR_SIZE, plan[i+j].data, FS3_SECTOR_SIZE);
+				}
+			}
+			if(pipeline_submit(&pipeline,connection,construct_fs3cmdblock((op == FS3_OP_RDSECT) ? FS3_OP_RDRANGE : FS3_OP_WRRANGE,
+					plan[i].pair.sectorIndex,plan[i].pair.trackIndex,0)|(FS3CmdBlk)run,data) == -1){
+				result = -1;
+				break;
+			}
+			sectors += run;
+			ranges++;
+			continue;
+		}
+
+		//Sends the track with the sector if the server takes it
+		if(trackOps){
+			if(pipeline_submit(&pipeline,connection,construct_fs3cmdblock((op == FS3_OP_RDSECT) ? FS3_OP_TRDSECT : FS3_OP_TWRSECT,
+					plan[i].pair.sectorIndex,plan[i].pair.trackIndex,0),plan[i].data) == -1){
+				result = -1;
+				break;
+			}
+			sectors++;
+			continue;
+		}
+
+		//Seeks the connection to track of sector, replies come back in order on each connection
+		if(plan[i].pair.trackIndex != disk->connectionTrack[connection]){
+			if(pipeline_submit(&pipeline,connection,construct_fs3cmdblock(FS3_OP_TSEEK,0,plan[i].pair.trackIndex,0),NULL) == -1){
+				result = -1;
+				break;
+			}
+			disk->connectionTrack[connection] = plan[i].pair.trackIndex;
+			tseeks++;
+		}
+
+		if(pipeline_submit(&pipeline,connection,construct_fs3cmdblock(op,plan[i].pair.sectorIndex,0,0),plan[i].data) == -1){
+			result = -1;
+			break;
+		}
+		sectors++;
+	}
+	for(i=0; i<FS3_MAX_CONNECTIONS; i++){
+		if(used & ((uint32_t)1<<i)){
+			pthread_mutex_unlock(&disk->connectionLocks[i]);
+		}
+	}
+
+	pthread_mutex_lock(&disk->deviceLock);
+	if(!trackOps){
+		disk->currentTrackIndex = plan[count-1].pair.trackIndex;
+	}
+	disk->stats.tseeks += tseeks;
+	if(op == FS3_OP_RDSECT){
+		disk->stats.sectorReads += sectors;
+		disk->stats.rangeReads += ranges;
+	}
+	else{
+		disk->stats.sectorWrites += sectors;
+		disk->stats.rangeWrites += ranges;
+	}
+	pthread_mutex_unlock(&disk->deviceLock);
+
+	//Completes every command sent, even after a failure
+	pipeline_complete(&pipeline, pipeline.submitted);
+	if(pipeline.failed){
+		result = -1;
+	}
+
+	//Moves staged sectors read into place
+	if((result == 0) && (staging != NULL) && (op == FS3_OP_RDSECT)){
+		staged = 0;
+		for(i=0; i<count; i+=run){
+			run = sector_range_length(plan+i, count-i, &stage);
+			for(j=0; (j<run) && stage; j++){
+				memcpy(plan[i+j].data, staging+(staged++)*FS3_SECTOR_SIZE, FS3_SECTOR_SIZE);
+			}
+		}
+	}
+	free(staging);
+
+	if(result == -1){
+		//Tracks are unknown after a failed batch
+		logMessage(FS3DriverLLevel, "Failed pipelined sector operations");
+		if(!trackOps){
+			reset_connection_tracks();
+			pthread_mutex_lock(&disk->deviceLock);
+			disk->currentTrackIndex = FS3_NO_TRACK;
+			pthread_mutex_unlock(&disk->deviceLock);
+		}
+	}
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pipeline_submit
+// Description  : Sends a command of a batch. The slot of a connection is
+//                only freed when its reply is collected, so once the batch
+//                has FS3_PIPELINE_DEPTH in flight its oldest is completed
+//                first. The batch's own replies never wait on another thread.
+//
+// Inputs       : pipeline - commands of the batch in flight
+//                connection - pooled connection to send on (locked by caller)
+//                cmd - command block to send
+//                data - sector bytes sent or received into (NULL if none)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t pipeline_submit(SECTOR_PIPELINE *pipeline, int connection, FS3CmdBlk cmd, void *data){
+	int slot;
+
+	if(pipeline->submitted-pipeline->completed == FS3_PIPELINE_DEPTH){
+		pipeline_complete(pipeline, pipeline->completed+1);
+	}
+	slot = pipeline->submitted%FS3_PIPELINE_DEPTH;
+	if(network_fs3_submit(connection,cmd,data,&pipeline->tickets[slot]) == -1){
+		return(-1);
+	}
+	pipeline->connections[slot] = connection;
+	pipeline->submitted++;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pipeline_complete
+// Description  : Completes the commands of a batch in the order sent, up to
+//                (not including) the given one, noting any that failed
+//
+// Inputs       : pipeline - commands of the batch in flight
+//                until - number of the first command left in flight
+// Outputs      : none
+
+void pipeline_complete(SECTOR_PIPELINE *pipeline, int until){
+	FS3CmdBlk ret;
+	uint8_t returnVal;
+	int slot;
+
+	while(pipeline->completed < until){
+		slot = (pipeline->completed++)%FS3_PIPELINE_DEPTH;
+		if(network_fs3_complete(pipeline->connections[slot], pipeline->tickets[slot], &ret) == -1){
+			pipeline->failed = 1;
+			continue;
+		}
+		deconstruct_fs3cmdblock(ret,NULL,NULL,NULL,&returnVal);
+		if(returnVal != 0){
+			pipeline->failed = 1;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sector_run_length
+// Description  : Gets the number of planned sectors, from the first, that
+//                follow one another along a single track
+//
+// Inputs       : plan - planned sector operations
+//                count - number of planned operations (at least 1)
+// Outputs      : length of the run, at most FS3_RANGE_MAX_SECTORS
+
+int sector_run_length(IO_PLAN_ENTRY *plan, int count){
+	int run = 1;
+
+	while((run < count) && (run < FS3_RANGE_MAX_SECTORS) && (plan[run].pair.trackIndex == plan[0].pair.trackIndex) &&
+			(plan[run].pair.sectorIndex == plan[0].pair.sectorIndex+run)){
+		run++;
+	}
+	return(run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sector_buffer_length
+// Description  : Gets the number of planned sectors, from the first, whose
+//                buffers follow one another in memory
+//
+// Inputs       : plan - planned sector operations
+//                count - number of planned operations (at least 1)
+// Outputs      : length of the piece
+
+int sector_buffer_length(IO_PLAN_ENTRY *plan, int count){
+	int length = 1;
+
+	while((length < count) && (plan[length].data == plan[0].data+(size_t)length*FS3_SECTOR_SIZE)){
+		length++;
 	}
+	return(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sector_range_length
+// Description  : Gets the number of planned sectors, from the first, sent as
+//                one range op. A run along a track is split where its
+//                buffers part, pieces of FS3_RANGE_STAGE_SECTORS or more go
+//                straight from their buffers and neighbouring shorter ones
+//                are staged together.
+//
+// Inputs       : plan - planned sector operations
+//                count - number of planned operations (at least 1)
+//                stage - set to 1 if the sectors are staged, 0 if not
+// Outputs      : number of sectors of the range op
+
+int sector_range_length(IO_PLAN_ENTRY *plan, int count, int *stage){
+	int run = sector_run_length(plan, count);
+	int length = sector_buffer_length(plan, run);
+	int piece;
+
+	*stage = 0;
+	if((length >= FS3_RANGE_STAGE_SECTORS) || (length == run)){
+		return(length);
+	}
+
+	//A single piece is sent from its buffer whatever its length
+	while((length < run) && ((piece = sector_buffer_length(plan+length, run-length)) < FS3_RANGE_STAGE_SECTORS)){
+		*stage = 1;
+		length += piece;
+	}
+	return(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reset_readahead
+// Description  : Forgets the access pattern of a file
+//
+// Inputs       : file - file to reset
+// Outputs      : none
+
+void reset_readahead(FILE_INFO *file){
+	file->readahead.lastStart = -1;
+	file->readahead.lastEnd = -1;
+	file->readahead.stride = 0;
+	file->readahead.streak = 0;
+	file->readahead.window = FS3_READAHEAD_INITIAL_WINDOW;
+	file->readahead.next = -1;
+	fs3_take_cache_prefetch_stats(&file->readahead.prefetches, NULL, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : update_readahead
+// Description  : Detects sequential and strided reads of a file and plans
+//                prefetching the sectors that will be read next. The window
+//                grows while the file's prefetched sectors get used and
+//                shrinks when they are ejected unused. (state of the file
+//                locked by caller, the prefetch is left to do unlocked)
+//
+// Inputs       : file - file that was read
+//                start - first sector of the read
+//                end - last sector of the read
+//                plan - planned prefetch reads, at least FS3_READAHEAD_MAX_WINDOW
+// Outputs      : number of sectors to prefetch
+
+int update_readahead(FILE_INFO *file, int start, int end, IO_PLAN_ENTRY *plan){
+	READAHEAD *ra = &file->readahead;
+	int sequential;
+	int strided;
+	int sector;
+	int readStart;
+	int span;
+	int limit;
+	int maxWindow;
+	int usedPrefetches;
+	int wastedPrefetches;
+	int planned = 0;
+
+	//Classifies read against the previous one
+	sequential = (ra->lastStart != -1) && ((start == ra->lastEnd) || (start == ra->lastEnd+1));
+	strided = (ra->lastStart != -1) && !sequential && (ra->stride > 1) && (start-ra->lastStart == ra->stride);
+
+	//Only this file's prefetches since its last read count, not those of other files
+	fs3_take_cache_prefetch_stats(&ra->prefetches, &usedPrefetches, &wastedPrefetches);
+
+	if(sequential || strided){
+		ra->streak++;
+		if(sequential){
+			ra->stride = 1;
+		}
+
+		//Adapts window to how useful prefetching has been
+		if(wastedPrefetches > 0){
+			ra->window = CMPSC311_MAXVAL(ra->window/2, FS3_READAHEAD_MIN_WINDOW);
+		}
+		else if(usedPrefetches > 0){
+			ra->window = CMPSC311_MINVAL(ra->window*2, FS3_READAHEAD_MAX_WINDOW);
+		}
+	}
+	else{
+		//Pattern broken, these two reads give the candidate stride
+		ra->stride = ((ra->lastStart != -1) && (start > ra->lastStart)) ? start-ra->lastStart : 0;
+		ra->streak = 0;
+		ra->window = FS3_READAHEAD_INITIAL_WINDOW;
+		ra->next = -1;
+	}
+	ra->lastStart = start;
+	ra->lastEnd = end;
+
+	if(ra->streak < FS3_READAHEAD_TRIGGER){
+		return(0);
+	}
+
+	//Prefetched sectors must not push each other out of the cache
+	span = end-start+1;
+	maxWindow = CMPSC311_MINVAL(FS3_READAHEAD_MAX_WINDOW, fs3_get_cache_size()/FS3_READAHEAD_CACHE_SHARE);
+	if(!sequential){
+		maxWindow /= span;
+	}
+	if(maxWindow < 1){
+		return(0);
+	}
+	ra->window = CMPSC311_MINVAL(ra->window, maxWindow);
+
+	if(sequential){
+		//Keeps the next window of sectors prefetched
+		limit = end+ra->window;
+		for(sector = CMPSC311_MAXVAL(end+1, ra->next); sector <= limit; sector++){
+			if(prefetch_file_sector(file, sector, plan, &planned) == -1){
+				break;
+			}
+		}
+		ra->next = sector;
+	}
+	else{
+		//Keeps the next window of reads prefetched, each as long as this one
+		for(readStart = start+ra->stride; readStart <= start+ra->window*ra->stride; readStart += ra->stride){
+			if(readStart < ra->next){
+				continue;
+			}
+			for(sector = readStart; sector < readStart+span; sector++){
+				if(prefetch_file_sector(file, sector, plan, &planned) == -1){
+					break;
+				}
+			}
+			ra->next = readStart+1;
+		}
+	}
+
+	return(planned);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_sectors
+// Description  : Reads the planned readahead window of a file into the cache
+//                in one pipelined batch
+//
+// Inputs       : file - file read ahead (locked shared by caller)
+//                plan - planned prefetch reads
+//                count - number of planned reads, at most FS3_READAHEAD_MAX_WINDOW
+// Outputs      : 0 if successful, -1 if failure
 
+int32_t prefetch_sectors(FILE_INFO *file, IO_PLAN_ENTRY *plan, int count){
+	FS3Sector prefetchBufs[FS3_READAHEAD_MAX_WINDOW];
+	int i;
+
+	for(i=0; i<count; i++){
+		plan[i].data = prefetchBufs[i];
+	}
+	return(execute_read_plan(plan, count, &file->readahead.prefetches));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_file_sector
+// Description  : Plans the read of a sector of a file into the cache ahead
+//                of use
+//
+// Inputs       : file - file to read from
+//                sectorNumber - sector of the file to prefetch
+//                plan - planned prefetch reads
+//                count - number of planned reads, updated
+// Outputs      : 0 if planned or already cached, -1 if past the file data
+//                or the plan is full
+
+int32_t prefetch_file_sector(FILE_INFO *file, int sectorNumber, IO_PLAN_ENTRY *plan, int *count){
+	TRACK_SECTOR_PAIR location;
+	TRACK_SECTOR_PAIR *pair;
+
+	//Only sectors holding data on the device can be prefetched
+	if((sectorNumber >= file->numOfSectors) || ((uint32_t)sectorNumber*FS3_SECTOR_SIZE >= file->length) ||
+		(sectorNumber == file->tailSector) || (*count == FS3_READAHEAD_MAX_WINDOW)){
+		return(-1);
+	}
+
+	if(get_file_sector(file, sectorNumber, &location) == -1){
+		return(-1);
+	}
+	pair = &location;
+	if(fs3_check_cache(pair->trackIndex,pair->sectorIndex)){
+		return(0);
+	}
+	plan[*count].pair = *pair;
+	(*count)++;
 	return(0);
-}
\ No newline at end of file
+}
@@ -15,6 +15,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <fs3_controller.h>
 #include <fs3_cache.h>
 #include <fs3_common.h>
@@ -23,8 +25,52 @@
 // Defines
 #define FS3_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define FS3_MAX_PATH_LENGTH 128 // Maximum length of filename length
-#define FS3_MAX_TRACK_SECTOR_PAIRS FS3_MAX_TRACKS*FS3_TRACK_SIZE	//Max amount of sectors of file
+#define FS3_MAX_TRACK_SECTOR_PAIRS FS3_VOLUME_TRACKS*FS3_TRACK_SIZE	//Max amount of sectors of file
 #define FS3_MAX_FILE_LENGTH FS3_MAX_TRACK_SECTOR_PAIRS*FS3_MAX_SECTOR_SIZE	//Max amount of bytes of file
+#define FS3_READAHEAD_TRIGGER 2			//Matching reads in a row before prefetching starts
+#define FS3_READAHEAD_INITIAL_WINDOW 4	//Readahead window of a newly detected stream
+#define FS3_READAHEAD_MIN_WINDOW 1		//Smallest readahead window
+#define FS3_READAHEAD_MAX_WINDOW 64		//Largest readahead window
+#define FS3_READAHEAD_CACHE_SHARE 4		//Readahead may fill at most 1/N of the cache
+#define FS3_IO_PLAN_SIZE (FS3_RANGE_MAX_SECTORS*FS3_MAX_SERVERS)	//Device sector operations planned together (a whole track of each server of a volume)
+#define FS3_IO_PLAN_STACK_SIZE FS3_READAHEAD_MAX_WINDOW	//Plan entries of a call kept on the stack, larger calls plan on the heap
+#define FS3_IO_BOUNCE_SECTORS 8			//Partial sectors of a plan staged outside the caller's buffers
+#define FS3_PIPELINE_DEPTH (FS3_MAX_OUTSTANDING/2)	//Commands a batch has in flight before completing its oldest (within a connection's slots)
+#define FS3_RANGE_STAGE_SECTORS 4		//Pieces of a run apart in memory shorter than this are staged together into one range op
+#define FS3_MAX_IOVEC 1024				//Most buffer segments of a vectored call
+#define FS3_DRIVER_EXTENSIONS (FS3_EXT_TRACK_OPS|FS3_EXT_RANGE_OPS)	//Protocol extensions offered to the server at mount
+#define FS3_SECTOR_MAP_WORDS (FS3_TRACK_SIZE/64)	//Words of a track's sector bitmap
+#define FS3_INITIAL_EXTENTS 4			//Extents allocated for a new file's block map
+#define FS3_FILE_INDEX_SIZE 2048		//Slots of the file name index (power of 2, over twice the files)
+
+//On-disk layout (tracks below FS3_FIRST_DATA_TRACK are reserved for metadata). Tracks are those of
+//the volume, track N is on server N%servers as its track N/servers
+#define FS3_META_TRACK 0				//Track of the superblock, directory and free space bitmap
+#define FS3_SUPERBLOCK_SECTOR 0			//Sector of the superblock
+#define FS3_DIRECTORY_SECTOR 1			//First sector of the directory (name hash of each file slot)
+#define FS3_DIRECTORY_SECTORS ((FS3_MAX_TOTAL_FILES*sizeof(uint32_t))/FS3_SECTOR_SIZE)
+#define FS3_BITMAP_SECTOR 8				//First sector of the free space bitmap
+#define FS3_BITMAP_SECTORS ((FS3_VOLUME_TRACKS*FS3_SECTOR_MAP_WORDS*sizeof(uint64_t))/FS3_SECTOR_SIZE)
+#define FS3_BITMAP_TRACKS_PER_SECTOR (FS3_VOLUME_TRACKS/FS3_BITMAP_SECTORS)
+#define FS3_INODE_TRACK 1				//Track of the inode table, sector N holds file slot N
+#define FS3_JOURNAL_TRACK 2				//Track of the metadata journal
+#define FS3_FIRST_DATA_TRACK 3			//First track holding file data
+#define FS3_SUPERBLOCK_MAGIC 0x46533353	//Marks a formatted disk
+#define FS3_LAYOUT_VERSION 3			//Version of the on-disk layout
+#define FS3_INODE_MAGIC 0x494e4f44		//Marks an inode in use
+#define FS3_INODE_OVERFLOW_SECTORS 32	//Extent overflow sectors an inode can point to
+#define FS3_INODE_EXTENTS 94			//Extents held in the inode sector itself
+#define FS3_OVERFLOW_EXTENTS (FS3_SECTOR_SIZE/sizeof(FS3_DISK_EXTENT))	//Extents per overflow sector
+#define FS3_JOURNAL_RECORDS ((FS3_SECTOR_SIZE-sizeof(FS3_JOURNAL_HEADER))/sizeof(FS3_JOURNAL_RECORD))	//Records per journal sector
+#define FS3_JOURNAL_READ_BATCH 16		//Journal sectors read together at replay
+#define FS3_JOURNAL_NAME_CHUNK 8		//Name bytes carried by a NAME record
+#define FS3_JOURNAL_CHECKPOINT_MARK (FS3_TRACK_SIZE-64)	//Journal sector from which a checkpoint is taken at the next safe point
+
+//Journal record types
+#define FS3_JOURNAL_CREATE 1			//File created in slot, value is its name hash
+#define FS3_JOURNAL_NAME 2				//Part of a created file's name, value is its offset
+#define FS3_JOURNAL_EXTENT 3			//Sectors added to a file, value is the first file sector
+#define FS3_JOURNAL_LENGTH 4			//File grew, value is its length
 
 //File structure
 
@@ -34,27 +80,188 @@ typedef struct
 	FS3TrackIndex trackIndex;	//Track index
 	FS3SectorIndex sectorIndex;	//Sector index
 }TRACK_SECTOR_PAIR;
+
+//EXTENT structure (run of a file's sectors contiguous on one track)
+typedef struct
+{
+	int fileSector;				//First sector of the file in the run
+	TRACK_SECTOR_PAIR start;	//Device location of the first sector of the run
+	int length;					//Number of sectors in the run
+}EXTENT;
+
+//FS3_DISK_EXTENT structure (extent as stored on disk, file sectors are implied by order)
+typedef struct
+{
+	FS3TrackIndex trackIndex;	//Track of the first sector of the run
+	FS3SectorIndex sectorIndex;	//First sector of the run
+	uint32_t length;			//Number of sectors in the run
+}FS3_DISK_EXTENT;
+
+//FS3_SUPERBLOCK structure (start of the superblock sector)
+typedef struct
+{
+	uint32_t magic;				//FS3_SUPERBLOCK_MAGIC if formatted
+	uint32_t version;			//FS3_LAYOUT_VERSION
+	int32_t nextTrack;			//Track new files are placed near
+	int32_t nextSector;			//Sector new files are placed near
+	uint32_t journalEpoch;		//Journal sectors of this epoch are replayed at mount
+	uint32_t servers;			//Servers the volume is striped over
+}FS3_SUPERBLOCK;
+
+//FS3_JOURNAL_HEADER structure (start of a journal sector)
+typedef struct
+{
+	uint32_t epoch;				//Checkpoint epoch the sector belongs to
+	uint32_t sequence;			//Position of the sector in the journal
+	uint32_t count;				//Number of records in the sector
+	uint32_t checksum;			//Checksum of the header fields and records
+}FS3_JOURNAL_HEADER;
+
+//FS3_JOURNAL_RECORD structure (one metadata change)
+typedef struct
+{
+	uint16_t type;							//FS3_JOURNAL_CREATE, _NAME, _EXTENT or _LENGTH
+	uint16_t slot;							//File slot changed
+	uint32_t value;							//Hash, name offset, file sector or length (by type)
+	char data[FS3_JOURNAL_NAME_CHUNK];		//Name bytes (NAME) or FS3_DISK_EXTENT (EXTENT)
+}FS3_JOURNAL_RECORD;
+
+//FS3_INODE structure (fills an inode table sector)
+typedef struct
+{
+	uint32_t magic;												//FS3_INODE_MAGIC if in use
+	char name[FS3_MAX_PATH_LENGTH];								//Name of file
+	uint32_t length;											//Length of file
+	int32_t numOfExtents;										//Number of extents in block map
+	int32_t numOfOverflow;										//Number of extent overflow sectors
+	TRACK_SECTOR_PAIR overflow[FS3_INODE_OVERFLOW_SECTORS];		//Sectors holding extents past the inode's own
+	FS3_DISK_EXTENT extents[FS3_INODE_EXTENTS];					//First extents of block map
+}FS3_INODE;
+
+//READAHEAD structure (access pattern of a file's reads)
+typedef struct
+{
+	int lastStart;		//First sector of previous read (-1 if none)
+	int lastEnd;		//Last sector of previous read
+	int stride;			//Sectors between starts of consecutive reads (1 if sequential)
+	int streak;			//Consecutive reads following the pattern
+	int window;			//Sectors (sequential) or reads (strided) to keep prefetched
+	int next;			//First sector or read start not yet prefetched (-1 if none)
+	CACHE_PREFETCH_STATS prefetches;	//Uses and ejections of the file's prefetched lines, counted by the cache
+}READAHEAD;
 typedef struct
 {
 	char name[FS3_MAX_PATH_LENGTH];							//Name of file
 	int16_t fileHandle;										//Unique file handle of file
 	int open;												//If file is open(1 True : 0 False)
-	TRACK_SECTOR_PAIR loc[FS3_MAX_TRACK_SECTOR_PAIRS];		//Track and sector locations of file
+	EXTENT *extents;										//Block map of file, ordered by file sector
+	int numOfExtents;										//Number of extents in block map
+	int extentCapacity;										//Extents allocated for block map
 	uint32_t pos;											//Postition of file pointer
 	uint32_t length;										//Length of file
 	int numOfSectors;										//Number of sectors the file spans
+	FS3Sector tail;											//Image of the last sector while appends are coalesced
+	int tailSector;											//Sector number held in tail (-1 if none)
+	READAHEAD readahead;									//Access pattern for readahead
+	int loaded;												//If read from its inode or created(1 True : 0 False)
+	int inodeDirty;											//If changed since its inode was written(1 True : 0 False)
+	TRACK_SECTOR_PAIR overflow[FS3_INODE_OVERFLOW_SECTORS];	//Extent overflow sectors of inode
+	int numOfOverflow;										//Number of extent overflow sectors
 }FILE_INFO;
 
+//FILE_LOCK structure (locks of a file slot, kept apart from FILE_INFO as it is cleared at unmount)
+typedef struct
+{
+	pthread_rwlock_t access;	//Shared by reads, exclusive for writes, seeks and close
+	pthread_mutex_t state;		//Guards pos and readahead between readers sharing the file
+}FILE_LOCK;
+
+//IO_PLAN_ENTRY structure (one sector operation of a planned call)
+typedef struct
+{
+	TRACK_SECTOR_PAIR pair;		//Device location of sector
+	int order;					//Elevator position of track from the current track
+	char *data;					//Sector bytes received into or sent from
+	char *dest;					//Where read bytes land in the caller buffer
+	uint32_t offset;			//Offset of read bytes in sector
+	int32_t chunk;				//Number of read bytes
+}IO_PLAN_ENTRY;
+
+//SECTOR_PIPELINE structure (commands of a batch sent and not yet completed)
+typedef struct
+{
+	uint32_t tickets[FS3_PIPELINE_DEPTH];	//Ticket of each command in flight, by order sent modulo the depth
+	int connections[FS3_PIPELINE_DEPTH];	//Connection of each command in flight
+	int submitted;							//Commands sent
+	int completed;							//Commands completed
+	int failed;								//If a command failed or was refused (1:true)
+}SECTOR_PIPELINE;
+
+//IOVEC_CURSOR structure (position in the buffer segments of a vectored call)
+typedef struct
+{
+	const struct iovec *iov;	//Buffer segments
+	int iovcnt;					//Number of segments
+	int segment;				//Segment of the position
+	size_t offset;				//Offset of the position in its segment
+}IOVEC_CURSOR;
+
+//DISK_STATS structure (device commands issued)
+typedef struct
+{
+	int tseeks;			//Tracks TSEEK commands
+	int sectorReads;	//Tracks sectors read, one command each unless in a range
+	int sectorWrites;	//Tracks sectors written, one command each unless in a range
+	int rangeReads;		//Tracks RDRANGE commands
+	int rangeWrites;	//Tracks WRRANGE commands
+}DISK_STATS;
+
 // Disk structure
 typedef struct
 {
 	int mounted;							//If disk is mounted(1 True : 0 False)
+	int servers;							//Servers the volume is striped over (tracks past theirs are kept full)
 	FILE_INFO files[FS3_MAX_TOTAL_FILES];	//Files on disk
-	FS3TrackIndex currentTrackIndex;		//Current track of disk your in
-	int nextSector;							//Next Sector to write
-	int nextTrack;							//Next Track to write
+	uint32_t extensions;					//Protocol extensions granted by the server at mount
+	FS3TrackIndex currentTrackIndex;		//Current track of disk your in (last sought on any connection)
+	FS3TrackIndex connectionTrack[FS3_MAX_CONNECTIONS];	//Current track of each pooled connection
+	int nextSector;							//Sector new files are placed near
+	int nextTrack;							//Track new files are placed near
+	uint64_t sectorMap[FS3_VOLUME_TRACKS][FS3_SECTOR_MAP_WORDS];	//Used sectors of each track (bit set if used)
+	int trackUsed[FS3_VOLUME_TRACKS];		//Number of used sectors of each track
+	DISK_STATS stats;						//Stats of disk
+	int indexed;							//If name index and free slots are built(1 True : 0 False)
+	int16_t nameIndex[FS3_FILE_INDEX_SIZE];	//Open addressed index of file names (file slot+1, 0 if empty)
+	int16_t freeSlots[FS3_MAX_TOTAL_FILES];	//Unused file slots, lowest on top
+	int freeSlotCount;						//Number of unused file slots
+	uint32_t nameHashes[FS3_MAX_TOTAL_FILES];	//Directory, name hash of each file slot (0 if unused)
+	int directoryLoaded;					//If directory is read from disk(1 True : 0 False)
+	int directoryDirty[FS3_DIRECTORY_SECTORS];	//Directory sectors changed since written
+	int bitmapLoaded;						//If free space bitmap is read from disk(1 True : 0 False)
+	int bitmapDirty[FS3_BITMAP_SECTORS];	//Bitmap sectors changed since written
+	int superblockDirty;					//If superblock changed since written(1 True : 0 False)
+	uint32_t journalEpoch;					//Epoch of the journal since the last checkpoint
+	int journalHead;						//Journal sector being filled
+	int journalDirty;						//If journal sector has records not yet written(1 True : 0 False)
+	int checkpointWanted;					//If the journal is nearly full(1 True : 0 False)
+	FS3Sector journal;						//Image of journal sector being filled
+	pthread_mutex_t connectionLocks[FS3_MAX_CONNECTIONS];	//Keeps a batch's track seeks together with its sectors on each connection
+	pthread_mutex_t deviceLock;				//Guards the device stats and last sought track
+	pthread_rwlock_t metadataLock;			//Shared by calls, exclusive for mount, unmount and checkpoints
+	pthread_mutex_t namespaceLock;			//Guards the directory, name index and opening/closing files
+	pthread_mutex_t allocLock;				//Guards the free space bitmap and placement hint
+	pthread_mutex_t journalLock;			//Guards the journal sector being filled
+	FILE_LOCK fileLocks[FS3_MAX_TOTAL_FILES];	//Locks of each file slot
 }DISK;
 
+//FS3_CONTEXT structure (everything the driver keeps for one FS3 server)
+struct FS3_CONTEXT
+{
+	DISK disk;							//Disk metadata and locks
+	CACHE cache;						//Sector cache
+	NETWORK_POOL pool;					//Connections to the server
+};
+
 //
 // Interface functions
 
@@ -76,9 +283,93 @@ int32_t fs3_read(int16_t fd, void *buf, int32_t count);
 int32_t fs3_write(int16_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
+int32_t fs3_pread(int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Reads "count" bytes at "offset" of the file into "buf", the file position is unchanged
+
+int32_t fs3_pwrite(int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Writes "count" bytes at "offset" of the file from "buf", the file position is unchanged
+
+int32_t fs3_readv(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Reads from the file position into each buffer segment in turn
+
+int32_t fs3_writev(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Writes each buffer segment in turn at the file position
+
 int32_t fs3_seek(int16_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int32_t fs3_fsync(int16_t fd);
+	// Returns once all writes made so far are on the device
+
+int32_t fs3_log_driver_metrics(void);
+	// Log the device command metrics for the driver
+
+//
+// Context interface functions (each as above, on the given context)
+
+fs3_ctx * fs3_ctx_create(const char *address, unsigned short port);
+	// Create an unmounted context for the server at address:port (NULL/0 for the defaults)
+
+void fs3_ctx_destroy(fs3_ctx *ctx);
+	// Unmount the disk of a context, close its cache and free it
+
+int32_t fs3_ctx_mount_disk(fs3_ctx *ctx);
+	// FS3 interface, mount/initialize filesystem
+
+int32_t fs3_ctx_unmount_disk(fs3_ctx *ctx);
+	// FS3 interface, unmount the disk, close all files
+
+int16_t fs3_ctx_open(fs3_ctx *ctx, char *path);
+	// This function opens a file and returns a file handle
+
+int16_t fs3_ctx_close(fs3_ctx *ctx, int16_t fd);
+	// This function closes a file
+
+int32_t fs3_ctx_read(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count);
+	// Reads "count" bytes from the file handle "fh" into the buffer  "buf"
+
+int32_t fs3_ctx_write(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count);
+	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
+
+int32_t fs3_ctx_pread(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Reads "count" bytes at "offset" of the file into "buf", the file position is unchanged
+
+int32_t fs3_ctx_pwrite(fs3_ctx *ctx, int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Writes "count" bytes at "offset" of the file from "buf", the file position is unchanged
+
+int32_t fs3_ctx_readv(fs3_ctx *ctx, int16_t fd, const struct iovec *iov, int iovcnt);
+	// Reads from the file position into each buffer segment in turn
+
+int32_t fs3_ctx_writev(fs3_ctx *ctx, int16_t fd, const struct iovec *iov, int iovcnt);
+	// Writes each buffer segment in turn at the file position
+
+int32_t fs3_ctx_seek(fs3_ctx *ctx, int16_t fd, uint32_t loc);
+	// Seek to specific point in the file
+
+int32_t fs3_ctx_fsync(fs3_ctx *ctx, int16_t fd);
+	// Returns once all writes made so far are on the device
+
+int32_t fs3_ctx_log_driver_metrics(fs3_ctx *ctx);
+	// Log the device command metrics for the driver
+
+int fs3_ctx_init_cache(fs3_ctx *ctx, uint16_t cachelines);
+	// Initialize the cache with a fixed number of cache lines
+
+int fs3_ctx_close_cache(fs3_ctx *ctx);
+	// Close the cache, freeing any buffers held in it
+
+int fs3_ctx_enable_cache_write_back(fs3_ctx *ctx);
+	// Switch the cache to write-back mode, flushing through the context
+
+int fs3_ctx_log_cache_metrics(fs3_ctx *ctx);
+	// Log the metrics for the cache
+
+void init_context(FS3_CONTEXT *ctx);
+	//Initializes an unmounted context and its locks
+
+void init_default_context(void);
+	//Initializes the default context on first use
+
 FS3CmdBlk construct_fs3cmdblock(uint8_t op, uint16_t sec, uint_fast32_t trk, uint8_t ret);
 	// Create an FS3 array opcode from the variable feilds 
 
@@ -88,10 +379,219 @@ int deconstruct_fs3cmdblock(FS3CmdBlk cmdblock, uint8_t *op, uint16_t *sec, uint
 FILE_INFO * get_file(int16_t fd);
 	// Gets file associated with file handle if vailid file handle
 
+FILE_LOCK * get_file_lock(int slot);
+	//Gets the locks of a file slot
+
+FILE_INFO * lock_file(int16_t fd, int exclusive);
+	//Locks an open file shared or exclusive, NULL if not open
+
+void unlock_file(FILE_INFO *file);
+	//Releases the lock taken by lock_file
+
+void checkpoint_if_wanted(void);
+	//Checkpoints metadata once the journal is nearly full, called with no locks held
+
+int16_t open_file(char *path);
+	//Opens a file by name, creating it if it does not exist (namespace lock held)
+
+int32_t read_file_handle(int16_t fd, const struct iovec *iov, int iovcnt, int positional, uint32_t offset);
+	//Reads a file into buffer segments from its position or an offset
+
+int32_t write_file_handle(int16_t fd, const struct iovec *iov, int iovcnt, int positional, uint32_t offset);
+	//Writes buffer segments to a file at its position or an offset
+
+int32_t read_file(FILE_INFO *file, uint32_t pos, int32_t bytesToRead, const struct iovec *iov, int iovcnt, int32_t count);
+	//Reads a reserved span of a file into buffer segments (file locked)
+
+int32_t read_file_span(FILE_INFO *file, uint32_t pos, int32_t bytesToRead, const struct iovec *iov, int iovcnt, int32_t count,
+		IO_PLAN_ENTRY *plan, int capacity);
+	//Reads a reserved span of a file into buffer segments in batches of a plan
+
+int32_t write_file(FILE_INFO *file, uint32_t pos, const struct iovec *iov, int iovcnt, int32_t count);
+	//Writes buffer segments at a position of a file (file locked exclusive)
+
+int32_t write_file_span(FILE_INFO *file, uint32_t pos, const struct iovec *iov, int iovcnt, int32_t count,
+		IO_PLAN_ENTRY *plan, int capacity);
+	//Writes buffer segments at a position of a file in batches of a plan
+
+int32_t iovec_length(const struct iovec *iov, int iovcnt);
+	//Gets the total length of buffer segments, -1 if too many or too long
+
+char * iovec_span(IOVEC_CURSOR *cursor, int32_t length);
+	//Gets where the next bytes are if they lie in one segment, NULL if they straddle segments
+
+void iovec_copy_out(IOVEC_CURSOR *cursor, const char *src, int32_t length);
+	//Scatters bytes to the segments at the cursor and moves past them (NULL src only moves)
+
+void iovec_copy_in(IOVEC_CURSOR *cursor, char *dest, int32_t length);
+	//Gathers bytes from the segments at the cursor and moves past them
+
+int32_t load_superblock(void);
+	//Reads the superblock at mount, formatting the disk if it has none
+
+void format_disk(void);
+	//Lays out an empty file system in memory, written at the next sync
+
+int32_t load_directory(void);
+	//Reads the directory of file name hashes on first use
+
+int32_t load_free_space_map(void);
+	//Reads the free space bitmap on first use
+
+int32_t load_file_inode(int slot);
+	//Reads the inode of a file slot (and its extent overflow sectors)
+
+int32_t sync_metadata(void);
+	//Writes changed superblock, directory, bitmap and inode sectors
+
+int32_t write_file_inode(FILE_INFO *file, IO_PLAN_ENTRY *plan, FS3Sector *bufs, int *count);
+	//Plans writing the inode of a file and its extent overflow sectors
+
+int32_t replay_journal(void);
+	//Applies the journal sectors of the current epoch after an unclean unmount
+
+int32_t apply_journal_record(FS3_JOURNAL_RECORD *record);
+	//Applies one journal record to the in-memory metadata
+
+uint32_t journal_checksum(char *sector);
+	//Checksums a journal sector
+
+int32_t journal_append(FS3_JOURNAL_RECORD *record);
+	//Adds a record to the journal sector being filled
+
+int32_t journal_create(FILE_INFO *file, uint32_t hash);
+	//Journals the creation of a file
+
+int32_t journal_extent(FILE_INFO *file, int fileSector, TRACK_SECTOR_PAIR pair, int count);
+	//Journals sectors added to a file
+
+int32_t journal_length(FILE_INFO *file);
+	//Journals the length of a file
+
+int32_t commit_journal(void);
+	//Writes the journal sector being filled (group commit)
+
+int32_t write_journal_sector(void);
+	//Writes the journal sector being filled (journal lock held)
+
+void reset_journal(void);
+	//Starts an empty journal for the current epoch
+
+void release_file_table(void);
+	//Drops in-memory file metadata at unmount, reloaded from disk at next mount
+
+void build_file_index(void);
+	//Rebuilds the file name index and free slot list from the files on disk
+
+void release_new_file(FILE_INFO *file);
+	//Undoes the creation of a file that failed part way
+
+uint32_t hash_file_name(const char *name);
+	//Hashes a file name for the name index (never 0)
+
+int find_file_slot(const char *name);
+	//Finds the slot of a file by name in the name index, loading inodes it checks
+
+void insert_file_index(uint32_t hash, int slot);
+	//Adds a file slot to the name index
+
 int32_t tseek(FS3TrackIndex track);
 	// Seeks track to given track 
 
-int32_t get_free_track_sector_pair(TRACK_SECTOR_PAIR *pair);
-	//Finds a free track and sector pair for a file
+void reset_connection_tracks(void);
+	//Forgets the track of every pooled connection
+
+int32_t get_free_track_sector_pair(FS3TrackIndex trk, FS3SectorIndex sct, int count, TRACK_SECTOR_PAIR *pair);
+	//Allocates a run of free sectors on one track, as near trk/sct as possible
+
+void release_track_sector_pair(TRACK_SECTOR_PAIR pair, int count);
+	//Returns a run of sectors to the free space bitmap
+
+void mark_track_sectors(TRACK_SECTOR_PAIR pair, int count, int used);
+	//Sets a run of sectors used or free in the bitmap
+
+int next_free_sector(FS3TrackIndex trk, int from);
+	//Finds the first free sector of a track at or after from
+
+int free_run_length(FS3TrackIndex trk, int start, int max);
+	//Counts free sectors of a track from start, up to max
+
+int find_free_run(FS3TrackIndex trk, int count, int *length);
+	//Finds the first free run of count sectors on a track, or its longest
+
+int32_t allocate_file_sectors(FILE_INFO *file, int count);
+	//Allocates count sectors at the end of a file, keeping it contiguous
+
+int32_t add_file_sectors(FILE_INFO *file, TRACK_SECTOR_PAIR pair, int count);
+	//Appends a run of device sectors to the block map of a file
+
+int32_t get_file_sector(FILE_INFO *file, int sectorNumber, TRACK_SECTOR_PAIR *pair);
+	//Finds the device sector of a file sector and the contiguous run from it
+
+int32_t read_sector(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+	//Reads a sector from the device, seeking track if needed
+
+int32_t write_sector(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+	//Writes a sector to the device, seeking track if needed
+
+int32_t flush_sectors(FS3TrackIndex *trks, FS3SectorIndex *scts, void **bufs, int count);
+	//Writes a batch of sectors back for the write-back cache, in the order given
+
+int32_t store_sector(FS3TrackIndex trk, FS3SectorIndex sct, void *buf, int cached);
+	//Stores a modified sector in the cache and writes it unless held for write-back
+
+int32_t append_file_tail(FILE_INFO *file, void *buf, int32_t count);
+	//Appends bytes within the last sector of a file to its tail buffer
+
+int32_t flush_file_tail(FILE_INFO *file);
+	//Stores the tail buffer of a file if it holds appended bytes
+
+IO_PLAN_ENTRY *reserve_io_plan(int sectors, IO_PLAN_ENTRY *stackPlan, int *capacity);
+	//Gets a plan for a call's sectors, on the heap if more than the stack plan holds
+
+void release_io_plan(IO_PLAN_ENTRY *plan, IO_PLAN_ENTRY *stackPlan);
+	//Frees a plan from reserve_io_plan if it is on the heap
+
+void sort_io_plan(IO_PLAN_ENTRY *plan, int count);
+	//Orders planned sector operations by track in elevator order
+
+int compare_io_plan_entries(const void *a, const void *b);
+	//Orders planned sector operations for qsort
+
+int32_t execute_read_plan(IO_PLAN_ENTRY *plan, int count, CACHE_PREFETCH_STATS *prefetch);
+	//Reads planned sectors in elevator order and copies them into place
+
+int32_t execute_write_plan(IO_PLAN_ENTRY *plan, int count);
+	//Stores planned sectors in elevator order
+
+int32_t pipeline_sector_ops(uint8_t op, IO_PLAN_ENTRY *plan, int count);
+	//Sends planned sector operations without waiting on each reply, then completes them
+
+int32_t pipeline_submit(SECTOR_PIPELINE *pipeline, int connection, FS3CmdBlk cmd, void *data);
+	//Sends a command of a batch, first completing the oldest if the batch has its most in flight
+
+void pipeline_complete(SECTOR_PIPELINE *pipeline, int until);
+	//Completes the commands of a batch sent before the given one
+
+int sector_run_length(IO_PLAN_ENTRY *plan, int count);
+	//Gets the number of planned sectors from the first that run on along one track
+
+int sector_buffer_length(IO_PLAN_ENTRY *plan, int count);
+	//Gets the number of planned sectors from the first whose buffers follow one another
+
+int sector_range_length(IO_PLAN_ENTRY *plan, int count, int *stage);
+	//Gets the number of planned sectors from the first sent as one range op and if they are staged
+
+void reset_readahead(FILE_INFO *file);
+	//Forgets the access pattern of a file
+
+int update_readahead(FILE_INFO *file, int start, int end, IO_PLAN_ENTRY *plan);
+	//Detects sequential/strided reads and plans prefetching the sectors that follow
+
+int32_t prefetch_sectors(FILE_INFO *file, IO_PLAN_ENTRY *plan, int count);
+	//Reads planned sectors of a file into the cache ahead of use
+
+int32_t prefetch_file_sector(FILE_INFO *file, int sectorNumber, IO_PLAN_ENTRY *plan, int *count);
+	//Plans the read of a sector of a file into the cache ahead of use
 
 #endif
@@ -0,0 +1,1243 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_image_server.c
+//  Description    : This is the FS3 server stand-in. It answers the FS3CmdBlk
+//                   protocol of the stock fs3_server, keeping the disk in a
+//                   memory-mapped image file (so a restart is instant) and
+//                   serving many clients from one epoll event loop. Each
+//                   client has its own current track, so a driver pooling
+//                   several connections can spread tracks over them, and
+//                   the track-addressed sector and range ops are granted at
+//                   mount so a driver can skip track seeks altogether and
+//                   move up to a whole track per command. Latency and
+//                   jitter can be injected per opcode to benchmark the
+//                   client locally. A client on the same host can instead
+//                   be served from a shared memory ring by a thread of its
+//                   own, commands of both ordered by the server lock.
+//
+//   Author        : Matthew Kelleher
+//   Last Modified : 12/1/21
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Project Includes
+#include <fs3_image_server.h>
+#include <fs3_common.h>
+#include <fs3_transport.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define FS3_SERVER_ARGUMENTS "hvf:i:p:d:j:r:x:l:"
+#define USAGE \
+	"USAGE: fs3_image_server [-h] [-v] [-f <image>] [-i <address>] [-p <port>] [-d [<op>=]<usec>] [-j <usec>] [-r <ring>] [-x <extensions>] [-l <logfile>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -f - disk image file, created if missing (default " FS3_SERVER_DEFAULT_IMAGE ")\n" \
+	"    -i - IP address to listen on.\n" \
+	"    -p - port number to listen on.\n" \
+	"    -d - latency added to every command, or to one opcode\n" \
+	"         (mount, tseek, rdsect, wrsect, umount, trdsect, twrsect, rdrange, wrrange),\n" \
+	"         may be repeated\n" \
+	"    -j - most extra latency added to a command at random\n" \
+	"    -r - also serve a client on this host from the shared memory ring <ring>\n" \
+	"         (e.g. /fs3, see fs3_client -r), latency is only added on sockets\n" \
+	"    -x - protocol extensions granted at mount, as a mask (default 3, 0 grants none\n" \
+	"         like the course server: 1 - track-addressed sector ops, 2 - range ops)\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"\n" \
+
+//
+// Global Data
+static FS3_SERVER server;						//State of the server
+static volatile sig_atomic_t serverStopping = 0;	//Set by SIGINT/SIGTERM
+static const char *opNames[FS3_OP_MAXVAL] = {"mount", "tseek", "rdsect", "wrsect", "umount", "trdsect", "twrsect",
+	"rdrange", "wrrange"};
+
+//
+// Functional Prototypes
+
+void server_signal(int sig);	// Asks the event loop to stop
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 server stand-in
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0, result, op;
+	char *image = FS3_SERVER_DEFAULT_IMAGE;
+	char *address = FS3_DEFAULT_IP;
+	unsigned short port = FS3_DEFAULT_PORT;
+	struct sigaction action;
+
+	// Process the command line parameters
+	server.extensions = FS3_SERVER_EXTENSIONS;
+	while ((ch = getopt(argc, argv, FS3_SERVER_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'f': // Set the image file
+			image = optarg;
+			break;
+
+		case 'i': // Get the IP address
+			if (inet_addr(optarg) == INADDR_NONE) {
+				logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", optarg );
+				return(-1);
+			}
+			address = optarg;
+			break;
+
+		case 'p': // Set the network port number
+			if ( sscanf(optarg, "%hu", &port) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad port number [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'd': // Set the injected latency
+			if ( server_parse_latency(&server, optarg) == -1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad latency [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'j': // Set the injected jitter
+			if ( sscanf(optarg, "%u", &server.jitter) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad jitter [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'r': // Set the shared memory ring
+			server.ringName = optarg;
+			break;
+
+		case 'x': // Set the extensions granted
+			if ( sscanf(optarg, "%u", &server.extensions) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad extensions [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	FS3ControllerLLevel = registerLogLevel("FS3_CONTROLLER", 0); // Controller log level
+	if ( verbose ) {
+		enableLogLevels(FS3ControllerLLevel);
+	}
+
+	// Stop cleanly on interrupt, failed sends are seen as errors
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	srandom((unsigned int)time(NULL));
+
+	// Serve until stopped
+	pthread_mutex_init(&server.lock, NULL);
+	if ( (server_open_image(&server, image) == -1) ) {
+		return( -1 );
+	}
+	if ( server_listen(&server, address, port) == -1 ) {
+		server_close_image(&server);
+		return( -1 );
+	}
+	if ( (server.ringName != NULL) && (server_start_ring(&server, server.ringName) == -1) ) {
+		server_close_image(&server);
+		return( -1 );
+	}
+	result = server_run(&server);
+	server_stop_ring(&server);
+	server_close_image(&server);
+
+	// Log what was served
+	logMessage( LOG_OUTPUT_LEVEL, "FS3 server served %llu clients, %llu failed commands",
+		(unsigned long long)server.stats.clients, (unsigned long long)server.stats.errors );
+	for ( op=0; op<FS3_OP_MAXVAL; op++ ) {
+		logMessage( LOG_OUTPUT_LEVEL, "FS3 server %-6s commands [%llu]", opNames[op],
+			(unsigned long long)server.stats.commands[op] );
+	}
+	return( result );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_signal
+// Description  : Asks the event loop to stop
+//
+// Inputs       : sig - the signal received
+// Outputs      : none
+
+void server_signal(int sig) {
+	(void)sig;
+	serverStopping = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_parse_latency
+// Description  : Sets the latency injected for every opcode ("usec") or for
+//                one of them ("op=usec")
+//
+// Inputs       : server - the server
+//                arg - the latency argument
+// Outputs      : 0 if successful, -1 if failure
+
+int server_parse_latency(FS3_SERVER *server, const char *arg) {
+	const char *value;
+	uint32_t latency;
+	int op;
+
+	value = strchr(arg, '=');
+	if(sscanf((value != NULL) ? value+1 : arg, "%u", &latency) != 1){
+		return(-1);
+	}
+
+	//Sets every opcode
+	if(value == NULL){
+		for(op=0; op<FS3_OP_MAXVAL; op++){
+			server->latency[op] = latency;
+		}
+		return(0);
+	}
+
+	//Sets the opcode named
+	for(op=0; op<FS3_OP_MAXVAL; op++){
+		if((strlen(opNames[op]) == (size_t)(value-arg)) && (strncasecmp(arg, opNames[op], value-arg) == 0)){
+			server->latency[op] = latency;
+			return(0);
+		}
+	}
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_open_image
+// Description  : Maps the disk image file, creating it or sizing it to the
+//                disk as needed (new space reads as zeros)
+//
+// Inputs       : server - the server
+//                path - path of the image file
+// Outputs      : 0 if successful, -1 if failure
+
+int server_open_image(FS3_SERVER *server, const char *path) {
+	struct stat info;
+
+	server->image_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if((server->image_fd == -1) || (fstat(server->image_fd, &info) == -1)){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed opening image [%s], error: %s", path, strerror(errno));
+		if(server->image_fd != -1){
+			close(server->image_fd);
+		}
+		return(-1);
+	}
+
+	//Images of another size are grown or cut to the disk
+	if((size_t)info.st_size != FS3_SERVER_IMAGE_SIZE){
+		if(info.st_size != 0){
+			logMessage(LOG_WARNING_LEVEL, "FS3 server resizing image [%s] from %lld bytes", path, (long long)info.st_size);
+		}
+		if(ftruncate(server->image_fd, FS3_SERVER_IMAGE_SIZE) == -1){
+			logMessage(LOG_ERROR_LEVEL, "FS3 server failed sizing image [%s], error: %s", path, strerror(errno));
+			close(server->image_fd);
+			return(-1);
+		}
+	}
+
+	server->image = mmap(NULL, FS3_SERVER_IMAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, server->image_fd, 0);
+	if(server->image == MAP_FAILED){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed mapping image [%s], error: %s", path, strerror(errno));
+		close(server->image_fd);
+		return(-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "FS3 server using image [%s]", path);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_close_image
+// Description  : Writes the disk image back to its file and unmaps it
+//
+// Inputs       : server - the server
+// Outputs      : none
+
+void server_close_image(FS3_SERVER *server) {
+	msync(server->image, FS3_SERVER_IMAGE_SIZE, MS_SYNC);
+	munmap(server->image, FS3_SERVER_IMAGE_SIZE);
+	close(server->image_fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_listen
+// Description  : Opens the listening socket, the event loop and the timer
+//                that wakes it when held replies are due
+//
+// Inputs       : server - the server
+//                address - IP address to listen on
+//                port - port to listen on
+// Outputs      : 0 if successful, -1 if failure
+
+int server_listen(FS3_SERVER *server, const char *address, unsigned short port) {
+	struct sockaddr_in addr;
+	struct epoll_event event;
+	int on = 1;
+	int i;
+
+	for(i=0; i<FS3_SERVER_MAX_CLIENTS; i++){
+		server->clients[i].socket_fd = -1;
+	}
+
+	//Listens without blocking, clients are accepted as the loop sees them
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(address);
+	server->listen_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if((server->listen_fd == -1) || (setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) ||
+			(bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+			(listen(server->listen_fd, FS3_SERVER_MAX_CLIENTS) == -1)){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed listening on %s:%d, error: %s", address, port, strerror(errno));
+		return(-1);
+	}
+
+	//Listening socket and timer are told apart from clients by their pointers
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	server->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if((server->epoll_fd == -1) || (server->timer_fd == -1)){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed creating event loop, error: %s", strerror(errno));
+		return(-1);
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = &server->listen_fd;
+	if(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) == -1){
+		return(-1);
+	}
+	event.data.ptr = &server->timer_fd;
+	if(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->timer_fd, &event) == -1){
+		return(-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "FS3 server listening on %s:%d", address, port);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_run
+// Description  : Serves clients until told to stop, closing them on exit
+//
+// Inputs       : server - the server
+// Outputs      : 0 if stopped, -1 if failure
+
+int server_run(FS3_SERVER *server) {
+	struct epoll_event events[FS3_SERVER_MAX_EVENTS];
+	SERVER_CLIENT *client;
+	uint64_t expirations;
+	int result = 0;
+	int count;
+	int i;
+
+	while(!serverStopping){
+		if(server_arm_timer(server) == -1){
+			result = -1;
+			break;
+		}
+		count = epoll_wait(server->epoll_fd, events, FS3_SERVER_MAX_EVENTS, -1);
+		if(count == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			logMessage(LOG_ERROR_LEVEL, "FS3 server event loop failed, error: %s", strerror(errno));
+			result = -1;
+			break;
+		}
+
+		for(i=0; i<count; i++){
+			//New clients
+			if(events[i].data.ptr == &server->listen_fd){
+				server_accept(server);
+				continue;
+			}
+
+			//Held replies are due
+			if(events[i].data.ptr == &server->timer_fd){
+				if(read(server->timer_fd, &expirations, sizeof(expirations)) == -1){
+					//Timer already drained
+				}
+				server_release_due(server, server_now());
+				continue;
+			}
+
+			//Client commands and room to send replies, a client failing either is closed
+			client = (SERVER_CLIENT *)events[i].data.ptr;
+			if(client->socket_fd == -1){
+				continue;
+			}
+			if((events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && (server_receive(server, client) == -1)){
+				server_drop_client(server, client);
+				continue;
+			}
+			if(server_send(server, client) == -1){
+				server_drop_client(server, client);
+			}
+		}
+	}
+
+	//Closes clients still connected
+	for(i=0; i<FS3_SERVER_MAX_CLIENTS; i++){
+		if(server->clients[i].socket_fd != -1){
+			server_drop_client(server, &server->clients[i]);
+		}
+	}
+	close(server->timer_fd);
+	close(server->epoll_fd);
+	close(server->listen_fd);
+	return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_accept
+// Description  : Accepts every pending client connection into a free slot
+//
+// Inputs       : server - the server
+// Outputs      : 0 if successful, -1 if failure
+
+int server_accept(FS3_SERVER *server) {
+	SERVER_CLIENT *client;
+	struct epoll_event event;
+	int on = 1;
+	int fd;
+	int i;
+
+	while(1){
+		fd = accept(server->listen_fd, NULL, NULL);
+		if(fd == -1){
+			if((errno == EINTR) || (errno == ECONNABORTED)){
+				continue;
+			}
+			if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+				return(0);
+			}
+			logMessage(LOG_ERROR_LEVEL, "FS3 server failed accepting client, error: %s", strerror(errno));
+			return(-1);
+		}
+
+		//Finds a free slot
+		client = NULL;
+		for(i=0; i<FS3_SERVER_MAX_CLIENTS; i++){
+			if(server->clients[i].socket_fd == -1){
+				client = &server->clients[i];
+				break;
+			}
+		}
+		if(client == NULL){
+			logMessage(LOG_WARNING_LEVEL, "FS3 server full, refusing client");
+			close(fd);
+			continue;
+		}
+
+		//Replies are small and pipelined, so they are sent at once
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		memset(client, 0, sizeof(SERVER_CLIENT));
+		client->received = malloc(FS3_SERVER_RECEIVE_SIZE);
+		if(client->received == NULL){
+			logMessage(LOG_ERROR_LEVEL, "FS3 server failed to allocate client buffer, refusing client");
+			close(fd);
+			client->socket_fd = -1;
+			continue;
+		}
+		client->receivedCapacity = FS3_SERVER_RECEIVE_SIZE;
+		client->socket_fd = fd;
+		client->events = EPOLLIN;
+		event.events = client->events;
+		event.data.ptr = client;
+		if(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+			logMessage(LOG_ERROR_LEVEL, "FS3 server failed polling client, error: %s", strerror(errno));
+			close(fd);
+			client->socket_fd = -1;
+			free(client->received);
+			client->received = NULL;
+			continue;
+		}
+		server->stats.clients++;
+		logMessage(FS3ControllerLLevel, "FS3 server accepted client %d", i);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_drop_client
+// Description  : Closes a client, dropping replies not yet sent. A client
+//                that goes away holding the mount unmounts the disk so the
+//                next one can mount it.
+//
+// Inputs       : server - the server
+//                client - the client
+// Outputs      : none
+
+void server_drop_client(FS3_SERVER *server, SERVER_CLIENT *client) {
+	SERVER_REPLY *held;
+
+	close(client->socket_fd);
+	client->socket_fd = -1;
+	while(client->delayedHead != NULL){
+		held = client->delayedHead;
+		client->delayedHead = held->next;
+		free(held);
+	}
+	client->delayedTail = NULL;
+	free(client->out);
+	client->out = NULL;
+	free(client->received);
+	client->received = NULL;
+
+	pthread_mutex_lock(&server->lock);
+	if(server->mountHolder == client){
+		logMessage(LOG_WARNING_LEVEL, "FS3 server client holding the mount left, unmounting");
+		server->mounted = 0;
+		server->mountHolder = NULL;
+	}
+	pthread_mutex_unlock(&server->lock);
+	logMessage(FS3ControllerLLevel, "FS3 server closed client %d", (int)(client-server->clients));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_receive
+// Description  : Receives what a client has sent and executes every whole
+//                command, in order
+//
+// Inputs       : server - the server
+//                client - the client
+// Outputs      : 0 if successful, -1 if the client failed or left
+
+int server_receive(FS3_SERVER *server, SERVER_CLIENT *client) {
+	static char reply[FS3_SERVER_MESSAGE_SIZE];	//One thread serves every client, so one reply is built at a time
+	FS3CmdBlk cmd;
+	FS3CmdBlk ret;
+	ssize_t result;
+	size_t used;
+	size_t needed;
+	size_t length;
+	char *received;
+	uint8_t op;
+
+	//Reads what the socket holds, anything more is read on the next wait
+	result = recv(client->socket_fd, client->received+client->receivedLength, client->receivedCapacity-client->receivedLength, 0);
+	if(result == 0){
+		return(-1);
+	}
+	if(result == -1){
+		return(((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1);
+	}
+	client->receivedLength += result;
+
+	//Executes every whole command, a write is followed by its sectors
+	used = 0;
+	needed = 0;
+	while(client->receivedLength-used >= FS3_NET_HEADER_SIZE){
+		memcpy(&cmd, client->received+used, sizeof(cmd));
+		cmd = ntohll64(cmd);
+		op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
+		needed = server_command_length(cmd);
+		if(((op == FS3_OP_RDRANGE) || (op == FS3_OP_WRRANGE)) && ((cmd&FS3_RANGE_COUNT_MASK) > FS3_RANGE_MAX_SECTORS)){
+			logMessage(LOG_ERROR_LEVEL, "FS3 server got a range of %u sectors from client %d, dropping it",
+				(unsigned)(cmd&FS3_RANGE_COUNT_MASK), (int)(client-server->clients));
+			return(-1);
+		}
+		if(client->receivedLength-used < needed){
+			break;
+		}
+		pthread_mutex_lock(&server->lock);
+		ret = server_execute(server, client, cmd, client->received+used+FS3_NET_HEADER_SIZE, reply+FS3_NET_HEADER_SIZE);
+		pthread_mutex_unlock(&server->lock);
+		ret = htonll64(ret);
+		memcpy(reply, &ret, sizeof(ret));
+		length = FS3_NET_HEADER_SIZE+server_reply_length(cmd);
+		if(server_queue_reply(server, client, op, reply, length) == -1){
+			return(-1);
+		}
+		used += needed;
+		needed = 0;
+	}
+	memmove(client->received, client->received+used, client->receivedLength-used);
+	client->receivedLength -= used;
+
+	//Grows the buffer to take the whole of a range being received
+	if(needed > client->receivedCapacity){
+		received = realloc(client->received, needed);
+		if(received == NULL){
+			logMessage(LOG_ERROR_LEVEL, "FS3 server failed to grow receive buffer");
+			return(-1);
+		}
+		client->received = received;
+		client->receivedCapacity = needed;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_command_length
+// Description  : Gets the bytes of a command on the wire, with the sectors
+//                following a WRSECT, TWRSECT or WRRANGE
+//
+// Inputs       : cmd - the command (host order)
+// Outputs      : bytes of the command and its sectors
+
+size_t server_command_length(FS3CmdBlk cmd) {
+	uint8_t op;
+
+	op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
+	if((op == FS3_OP_WRSECT) || (op == FS3_OP_TWRSECT)){
+		return(FS3_NET_HEADER_SIZE+FS3_SECTOR_SIZE);
+	}
+	if(op == FS3_OP_WRRANGE){
+		return(FS3_NET_HEADER_SIZE+(size_t)(cmd&FS3_RANGE_COUNT_MASK)*FS3_SECTOR_SIZE);
+	}
+	return(FS3_NET_HEADER_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_reply_length
+// Description  : Gets the bytes of sectors following the reply to a command,
+//                the sector of a RDSECT or TRDSECT or the run of a RDRANGE
+//
+// Inputs       : cmd - the command (host order)
+// Outputs      : bytes of sectors
+
+size_t server_reply_length(FS3CmdBlk cmd) {
+	uint8_t op;
+
+	op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
+	if((op == FS3_OP_RDSECT) || (op == FS3_OP_TRDSECT)){
+		return(FS3_SECTOR_SIZE);
+	}
+	if(op == FS3_OP_RDRANGE){
+		return((size_t)(cmd&FS3_RANGE_COUNT_MASK)*FS3_SECTOR_SIZE);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_execute
+// Description  : Executes a command against the image (server lock held).
+//                The reply is the command with its return bit set if it
+//                failed, and the sector for RDSECT and TRDSECT or the run of
+//                sectors for RDRANGE is placed in out (zeros if failed). A
+//                MOUNT reply grants the extensions offered that the server
+//                has above the offer bits.
+//
+// Inputs       : server - the server
+//                client - the client that sent the command
+//                cmd - the command (host order)
+//                data - the sectors following a WRSECT, TWRSECT or WRRANGE
+//                out - buffer for the sectors read
+// Outputs      : the reply (host order)
+
+FS3CmdBlk server_execute(FS3_SERVER *server, SERVER_CLIENT *client, FS3CmdBlk cmd, char *data, char *out) {
+	uint32_t granted = 0;
+	int failed = 0;
+	uint8_t op;
+	uint16_t sec;
+	uint32_t trk;
+	uint32_t count;
+	char *sector;
+
+	op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
+	count = cmd&FS3_RANGE_COUNT_MASK;
+	sec = ((((uint64_t)1 << 16)-1)&(cmd>>44));
+	trk = ((((uint64_t)1 << 32)-1)&(cmd>>12));
+
+	switch(op){
+	case FS3_OP_MOUNT:
+		if(server->mounted){
+			failed = 1;
+		}
+		else{
+			server->mounted = 1;
+			server->mountHolder = client;
+			granted = cmd&FS3_EXT_MASK&FS3_SERVER_EXTENSIONS&server->extensions;
+		}
+		break;
+
+	case FS3_OP_UMOUNT:
+		if(!server->mounted){
+			failed = 1;
+		}
+		else{
+			//Starts writing the image back, the mapping stays current either way
+			server->mounted = 0;
+			server->mountHolder = NULL;
+			msync(server->image, FS3_SERVER_IMAGE_SIZE, MS_ASYNC);
+		}
+		break;
+
+	case FS3_OP_TSEEK:
+		if(!server->mounted || (trk >= FS3_MAX_TRACKS)){
+			failed = 1;
+		}
+		else{
+			client->track = trk;
+		}
+		break;
+
+	case FS3_OP_RDSECT:
+		if(!server->mounted || (sec >= FS3_TRACK_SIZE)){
+			failed = 1;
+			memset(out, 0, FS3_SECTOR_SIZE);
+		}
+		else{
+			sector = server_sector(server, client->track, sec);
+			memcpy(out, sector, FS3_SECTOR_SIZE);
+		}
+		break;
+
+	case FS3_OP_WRSECT:
+		if(!server->mounted || (sec >= FS3_TRACK_SIZE)){
+			failed = 1;
+		}
+		else{
+			sector = server_sector(server, client->track, sec);
+			memcpy(sector, data, FS3_SECTOR_SIZE);
+		}
+		break;
+
+	case FS3_OP_TRDSECT:
+		if(!server->mounted || (trk >= FS3_MAX_TRACKS) || (sec >= FS3_TRACK_SIZE)){
+			failed = 1;
+			memset(out, 0, FS3_SECTOR_SIZE);
+		}
+		else{
+			sector = server_sector(server, trk, sec);
+			memcpy(out, sector, FS3_SECTOR_SIZE);
+		}
+		break;
+
+	case FS3_OP_TWRSECT:
+		if(!server->mounted || (trk >= FS3_MAX_TRACKS) || (sec >= FS3_TRACK_SIZE)){
+			failed = 1;
+		}
+		else{
+			sector = server_sector(server, trk, sec);
+			memcpy(sector, data, FS3_SECTOR_SIZE);
+		}
+		break;
+
+	case FS3_OP_RDRANGE:
+		//Runs stay on their track, so are together in the image
+		if(!server->mounted || (trk >= FS3_MAX_TRACKS) || (count == 0) || (sec+count > FS3_TRACK_SIZE)){
+			failed = 1;
+			memset(out, 0, (size_t)count*FS3_SECTOR_SIZE);
+		}
+		else{
+			sector = server_sector(server, trk, sec);
+			memcpy(out, sector, (size_t)count*FS3_SECTOR_SIZE);
+		}
+		break;
+
+	case FS3_OP_WRRANGE:
+		if(!server->mounted || (trk >= FS3_MAX_TRACKS) || (count == 0) || (sec+count > FS3_TRACK_SIZE)){
+			failed = 1;
+		}
+		else{
+			sector = server_sector(server, trk, sec);
+			memcpy(sector, data, (size_t)count*FS3_SECTOR_SIZE);
+		}
+		break;
+
+	default:
+		failed = 1;
+		break;
+	}
+
+	if(op < FS3_OP_MAXVAL){
+		server->stats.commands[op]++;
+	}
+	if(failed){
+		server->stats.errors++;
+		logMessage(FS3ControllerLLevel, "FS3 server failed op %d (trk %u, sec %u) for client %d", op, trk, sec,
+			(client == &server->ringClient) ? -1 : (int)(client-server->clients));
+	}
+
+	return((cmd&~(uint64_t)0xfff)|((uint64_t)failed<<11)|((uint64_t)granted<<FS3_EXT_GRANT_SHIFT));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_sector
+// Description  : Finds a sector in the mapped image
+//
+// Inputs       : server - the server
+//                trk - track of the sector
+//                sec - sector in the track
+// Outputs      : pointer to the sector
+
+char * server_sector(FS3_SERVER *server, uint32_t trk, uint16_t sec) {
+	return(server->image+(((size_t)trk*FS3_TRACK_SIZE)+sec)*FS3_SECTOR_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_queue_reply
+// Description  : Makes a reply ready to send, or holds it until the latency
+//                injected for its opcode passes. Replies of a client keep
+//                their order, so a reply is never due before the one ahead.
+//
+// Inputs       : server - the server
+//                client - the client
+//                op - opcode of the command replied to
+//                reply - the reply
+//                length - bytes of reply
+// Outputs      : 0 if successful, -1 if failure
+
+int server_queue_reply(FS3_SERVER *server, SERVER_CLIENT *client, uint8_t op, char *reply, size_t length) {
+	SERVER_REPLY *held;
+	uint64_t due;
+
+	//Without latency replies are ready unless held ones are ahead of them
+	due = (op < FS3_OP_MAXVAL) ? server->latency[op] : 0;
+	if(server->jitter > 0){
+		due += (uint64_t)random()%(server->jitter+1);
+	}
+	if((due == 0) && (client->delayedHead == NULL)){
+		return(server_append_out(client, reply, length));
+	}
+
+	held = malloc(sizeof(SERVER_REPLY)+length);
+	if(held == NULL){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed to hold reply");
+		return(-1);
+	}
+	due += server_now();
+	held->due = CMPSC311_MAXVAL(due, client->lastDue);
+	held->length = length;
+	held->next = NULL;
+	memcpy(held->bytes, reply, length);
+	client->lastDue = held->due;
+	if(client->delayedTail == NULL){
+		client->delayedHead = held;
+	}
+	else{
+		client->delayedTail->next = held;
+	}
+	client->delayedTail = held;
+	client->delayedLength += length;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_append_out
+// Description  : Adds bytes to the replies ready to send to a client
+//
+// Inputs       : client - the client
+//                bytes - bytes to add
+//                length - number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int server_append_out(SERVER_CLIENT *client, char *bytes, size_t length) {
+	size_t capacity;
+	char *out;
+
+	//Reuses the space of replies already sent before growing
+	if((client->outSent > 0) && (client->outLength+length > client->outCapacity)){
+		memmove(client->out, client->out+client->outSent, client->outLength-client->outSent);
+		client->outLength -= client->outSent;
+		client->outSent = 0;
+	}
+	if(client->outLength+length > client->outCapacity){
+		capacity = CMPSC311_MAXVAL(client->outCapacity*2, (size_t)FS3_SERVER_RECEIVE_SIZE);
+		capacity = CMPSC311_MAXVAL(capacity, client->outLength+length);
+		out = realloc(client->out, capacity);
+		if(out == NULL){
+			logMessage(LOG_ERROR_LEVEL, "FS3 server failed to grow reply buffer");
+			return(-1);
+		}
+		client->out = out;
+		client->outCapacity = capacity;
+	}
+	memcpy(client->out+client->outLength, bytes, length);
+	client->outLength += length;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_release_due
+// Description  : Makes held replies that are due ready and sends them
+//
+// Inputs       : server - the server
+//                now - current time (usec, monotonic)
+// Outputs      : 0 if successful, -1 if failure
+
+int server_release_due(FS3_SERVER *server, uint64_t now) {
+	SERVER_CLIENT *client;
+	SERVER_REPLY *held;
+	int released;
+	int i;
+
+	for(i=0; i<FS3_SERVER_MAX_CLIENTS; i++){
+		client = &server->clients[i];
+		if(client->socket_fd == -1){
+			continue;
+		}
+
+		released = 0;
+		while((client->delayedHead != NULL) && (client->delayedHead->due <= now)){
+			held = client->delayedHead;
+			if(server_append_out(client, held->bytes, held->length) == -1){
+				break;
+			}
+			client->delayedHead = held->next;
+			client->delayedLength -= held->length;
+			free(held);
+			released = 1;
+		}
+		if(client->delayedHead == NULL){
+			client->delayedTail = NULL;
+		}
+		if(released && (server_send(server, client) == -1)){
+			server_drop_client(server, client);
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_send
+// Description  : Sends ready replies until the socket would block
+//
+// Inputs       : server - the server
+//                client - the client
+// Outputs      : 0 if successful, -1 if the client failed
+
+int server_send(FS3_SERVER *server, SERVER_CLIENT *client) {
+	ssize_t result;
+
+	while(client->outSent < client->outLength){
+		result = send(client->socket_fd, client->out+client->outSent, client->outLength-client->outSent, MSG_NOSIGNAL);
+		if(result == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+				break;
+			}
+			return(-1);
+		}
+		client->outSent += result;
+	}
+	if(client->outSent == client->outLength){
+		client->outSent = 0;
+		client->outLength = 0;
+	}
+	return(server_update_events(server, client));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_update_events
+// Description  : Polls a client for commands unless its replies have backed
+//                up, and for room to send while replies are ready
+//
+// Inputs       : server - the server
+//                client - the client
+// Outputs      : 0 if successful, -1 if failure
+
+int server_update_events(FS3_SERVER *server, SERVER_CLIENT *client) {
+	struct epoll_event event;
+	uint32_t events = 0;
+
+	if((client->outLength-client->outSent)+client->delayedLength < FS3_SERVER_MAX_BUFFERED){
+		events |= EPOLLIN;
+	}
+	if(client->outSent < client->outLength){
+		events |= EPOLLOUT;
+	}
+	if(events == client->events){
+		return(0);
+	}
+	event.events = events;
+	event.data.ptr = client;
+	if(epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &event) == -1){
+		return(-1);
+	}
+	client->events = events;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_arm_timer
+// Description  : Sets the timer to the earliest held reply, or disarms it
+//
+// Inputs       : server - the server
+// Outputs      : 0 if successful, -1 if failure
+
+int server_arm_timer(FS3_SERVER *server) {
+	struct itimerspec timer;
+	uint64_t earliest = 0;
+	int i;
+
+	for(i=0; i<FS3_SERVER_MAX_CLIENTS; i++){
+		if((server->clients[i].socket_fd != -1) && (server->clients[i].delayedHead != NULL) &&
+				((earliest == 0) || (server->clients[i].delayedHead->due < earliest))){
+			earliest = server->clients[i].delayedHead->due;
+		}
+	}
+
+	//An all-zero time disarms the timer
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = earliest/1000000;
+	timer.it_value.tv_nsec = (earliest%1000000)*1000;
+	if(timerfd_settime(server->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) == -1){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed setting timer, error: %s", strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_start_ring
+// Description  : Creates a shared memory ring and starts the thread serving
+//                it, a client on this host attaches it by name
+//
+// Inputs       : server - the server
+//                name - name of the ring's shared memory object
+// Outputs      : 0 if successful, -1 if failure
+
+int server_start_ring(FS3_SERVER *server, const char *name) {
+	int error;
+
+	server->ring = ring_create(name);
+	if(server->ring == NULL){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed to create ring %s [%s]", name, strerror(errno));
+		return(-1);
+	}
+	server->ringName = name;
+	server->ringClient.socket_fd = -1;
+	error = pthread_create(&server->ringThread, NULL, server_serve_ring, server);
+	if(error != 0){
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed to start ring thread [%s]", strerror(error));
+		ring_release(server->ring, name);
+		server->ring = NULL;
+		return(-1);
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "FS3 server serving ring %s", name);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_stop_ring
+// Description  : Stops serving the ring, if one is served, and removes it
+//
+// Inputs       : server - the server
+// Outputs      : none
+
+void server_stop_ring(FS3_SERVER *server) {
+	if(server->ring == NULL){
+		return;
+	}
+	serverStopping = 1;
+	ring_wake(&server->ring->header->sqTail);
+	pthread_join(server->ringThread, NULL);
+	ring_release(server->ring, server->ringName);
+	server->ring = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_serve_ring
+// Description  : Executes commands submitted on the ring, in order, posting
+//                each reply as it completes. The sectors a command moves are
+//                copied between its slots and the image with no other copy,
+//                and the client is only woken when it went to sleep. An idle
+//                ring is polled a while, then slept on until a submission or
+//                attach wakes the thread (or it looks to stop).
+//
+// Inputs       : arg - the server
+// Outputs      : NULL
+
+void * server_serve_ring(void *arg) {
+	FS3_SERVER *server = arg;
+	FS3_RING *ring = server->ring;
+	FS3_RING_HEADER *header = ring->header;
+	FS3_RING_SQE sqe;
+	FS3CmdBlk ret;
+	uint32_t head = 0;
+	uint32_t cqTail = 0;
+	uint32_t tail;
+	uint32_t request;
+	size_t bytes;
+	int spins = 0;
+	char *slot;
+
+	while(!serverStopping){
+		//A client attaching gets empty rings
+		request = __atomic_load_n(&header->attachRequest, __ATOMIC_ACQUIRE);
+		if(request != __atomic_load_n(&header->attachDone, __ATOMIC_RELAXED)){
+			server_reset_ring(server, request);
+			head = cqTail = 0;
+			continue;
+		}
+
+		//Waits for a submission, and for a free completion (the client never has more in flight than fit)
+		tail = __atomic_load_n(&header->sqTail, __ATOMIC_ACQUIRE);
+		if((head == tail) || (cqTail-__atomic_load_n(&header->cqHead, __ATOMIC_ACQUIRE) >= FS3_RING_ENTRIES)){
+			if(spins < FS3_RING_SPIN){
+				spins++;
+				continue;
+			}
+
+			//Says it sleeps before looking again, so a submission in between wakes it
+			__atomic_store_n(&header->sqSleeping, 1, __ATOMIC_SEQ_CST);
+			if((__atomic_load_n(&header->sqTail, __ATOMIC_SEQ_CST) == tail) &&
+					(__atomic_load_n(&header->attachRequest, __ATOMIC_SEQ_CST) == request)){
+				ring_wait(&header->sqTail, tail, transport_deadline(FS3_RING_IDLE_MS));
+			}
+			__atomic_store_n(&header->sqSleeping, 0, __ATOMIC_RELAXED);
+			spins = 0;
+			continue;
+		}
+		spins = 0;
+
+		//The entry is copied so a client cannot change it while it executes
+		sqe = ring->sq[head%FS3_RING_ENTRIES];
+		bytes = CMPSC311_MAXVAL(server_command_length(sqe.cmd)-FS3_NET_HEADER_SIZE, server_reply_length(sqe.cmd));
+		pthread_mutex_lock(&server->lock);
+		if(((uint64_t)sqe.slot+sqe.count > FS3_RING_SLOTS) || ((size_t)sqe.count*FS3_SECTOR_SIZE < bytes)){
+			logMessage(LOG_ERROR_LEVEL, "FS3 server got %u slots at slot %u for %zu bytes on the ring, failing it",
+				sqe.count, sqe.slot, bytes);
+			server->stats.errors++;
+			ret = (sqe.cmd&~(uint64_t)0xfff)|((uint64_t)1<<11);
+		}
+		else{
+			slot = ring_slot(ring, sqe.slot);
+			ret = server_execute(server, &server->ringClient, sqe.cmd, slot, slot);
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		//Posts the reply, waking the client only if it sleeps
+		ring->cq[cqTail%FS3_RING_ENTRIES].ret = ret;
+		head++;
+		cqTail++;
+		__atomic_store_n(&header->sqHead, head, __ATOMIC_RELEASE);
+		__atomic_store_n(&header->cqTail, cqTail, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&header->cqSleeping, __ATOMIC_SEQ_CST)){
+			ring_wake(&header->cqTail);
+		}
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_reset_ring
+// Description  : Empties the rings for a client attaching. Whatever the
+//                client before it left in flight is dropped, and so is the
+//                mount if it held it, as when a socket client leaves.
+//
+// Inputs       : server - the server
+//                request - the attach request served
+// Outputs      : none
+
+void server_reset_ring(FS3_SERVER *server, uint32_t request) {
+	FS3_RING_HEADER *header = server->ring->header;
+
+	pthread_mutex_lock(&server->lock);
+	if(server->mountHolder == &server->ringClient){
+		logMessage(LOG_WARNING_LEVEL, "FS3 server ring client holding the mount was replaced, unmounting");
+		server->mounted = 0;
+		server->mountHolder = NULL;
+	}
+	server->ringClient.track = 0;
+	pthread_mutex_unlock(&server->lock);
+
+	__atomic_store_n(&header->sqHead, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&header->sqTail, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&header->cqHead, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&header->cqTail, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&header->attachDone, request, __ATOMIC_RELEASE);
+	ring_wake(&header->attachDone);
+	logMessage(FS3ControllerLLevel, "FS3 server ring client attached");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_now
+// Description  : Gets the monotonic time in usec
+//
+// Inputs       : none
+// Outputs      : the time
+
+uint64_t server_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return(((uint64_t)now.tv_sec*1000000)+(now.tv_nsec/1000));
+}
@@ -0,0 +1,167 @@
+#ifndef FS3_IMAGE_SERVER_INCLUDED
+#define FS3_IMAGE_SERVER_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_image_server.h
+//  Description    : This is the interface for the FS3 server stand-in. It
+//                   speaks the FS3CmdBlk protocol of the stock server, keeps
+//                   the disk in a memory-mapped image file and serves many
+//                   clients from one epoll event loop, and a client on the
+//                   same host from a shared memory ring.
+//
+//  Author         : Matthew Kelleher
+//  Last Modified  : 12/1/21
+//
+
+// Include files
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fs3_controller.h>
+#include <fs3_network.h>
+#include <fs3_ring.h>
+
+// Defines
+#define FS3_SERVER_DEFAULT_IMAGE "fs3_disk.img"	//Image file used by default
+#define FS3_SERVER_IMAGE_SIZE ((size_t)FS3_MAX_TRACKS*FS3_TRACK_SIZE*FS3_SECTOR_SIZE)	//Bytes of the disk image
+#define FS3_SERVER_MAX_CLIENTS 256				//Most clients connected at once
+#define FS3_SERVER_MAX_EVENTS 64				//Events taken per wait of the event loop
+#define FS3_SERVER_MESSAGE_SIZE (FS3_NET_HEADER_SIZE+(size_t)FS3_RANGE_MAX_SECTORS*FS3_SECTOR_SIZE)	//Largest command or reply on the wire
+#define FS3_SERVER_RECEIVE_SIZE (64*(FS3_NET_HEADER_SIZE+FS3_SECTOR_SIZE))	//Bytes received from a client per read
+#define FS3_SERVER_MAX_BUFFERED (4*1024*1024)	//Replies held for a client before it is no longer read
+#define FS3_SERVER_EXTENSIONS (FS3_EXT_TRACK_OPS|FS3_EXT_RANGE_OPS)	//Protocol extensions the server can grant at mount
+
+//Structures
+
+//SERVER_REPLY structure (a reply held back until its injected latency passes)
+typedef struct SERVER_REPLY
+{
+	uint64_t due;						//Time the reply is sent (usec, monotonic)
+	size_t length;						//Bytes of reply
+	struct SERVER_REPLY *next;			//Next reply of the client, due no earlier
+	char bytes[];						//Reply on the wire
+}SERVER_REPLY;
+
+//SERVER_CLIENT structure (a connected client)
+typedef struct
+{
+	int socket_fd;								//Socket of client (-1 if slot free)
+	uint32_t track;								//Track the client last sought
+	char *received;								//Bytes received and not yet executed
+	size_t receivedLength;						//Number of bytes received
+	size_t receivedCapacity;					//Bytes allocated for received bytes, grown to fit a range
+	char *out;									//Replies ready to send
+	size_t outLength;							//Bytes of replies ready
+	size_t outSent;								//Bytes of replies already sent
+	size_t outCapacity;							//Bytes allocated for replies
+	SERVER_REPLY *delayedHead;					//Oldest reply waiting out its latency
+	SERVER_REPLY *delayedTail;					//Newest reply waiting out its latency
+	size_t delayedLength;						//Bytes of replies waiting
+	uint64_t lastDue;							//Due time of the newest reply, replies keep their order
+	uint32_t events;							//Events the client is polled for
+}SERVER_CLIENT;
+
+//SERVER_STATS structure (commands served)
+typedef struct
+{
+	uint64_t commands[FS3_OP_MAXVAL];	//Commands executed, by opcode
+	uint64_t errors;					//Commands that failed
+	uint64_t clients;					//Clients accepted
+}SERVER_STATS;
+
+//FS3_SERVER structure (state of the server)
+typedef struct
+{
+	char *image;									//Mapped disk image
+	int image_fd;									//Image file
+	int listen_fd;									//Listening socket
+	int epoll_fd;									//Event loop
+	int timer_fd;									//Wakes the loop when a held reply is due
+	int mounted;									//If the disk is mounted (1:true)
+	SERVER_CLIENT *mountHolder;						//Client that mounted the disk
+	uint32_t latency[FS3_OP_MAXVAL];				//Latency added to each command, by opcode (usec)
+	uint32_t jitter;								//Most extra latency added at random (usec)
+	uint32_t extensions;							//Protocol extensions granted at mount
+	SERVER_CLIENT clients[FS3_SERVER_MAX_CLIENTS];	//Client slots
+	SERVER_STATS stats;								//Commands served
+	FS3_RING *ring;									//Shared memory ring served (NULL if none)
+	const char *ringName;							//Name of the ring's shared memory object
+	SERVER_CLIENT ringClient;						//Client on the ring
+	pthread_t ringThread;							//Thread serving the ring
+	pthread_mutex_t lock;							//Orders commands of the event loop and the ring
+}FS3_SERVER;
+
+//
+// Server functions
+
+int server_open_image(FS3_SERVER *server, const char *path);
+	//Maps the disk image file, creating or sizing it as needed
+
+void server_close_image(FS3_SERVER *server);
+	//Writes the disk image back and unmaps it
+
+int server_listen(FS3_SERVER *server, const char *address, unsigned short port);
+	//Opens the listening socket and the event loop
+
+int server_run(FS3_SERVER *server);
+	//Serves clients until told to stop
+
+int server_accept(FS3_SERVER *server);
+	//Accepts every pending client connection
+
+void server_drop_client(FS3_SERVER *server, SERVER_CLIENT *client);
+	//Closes a client, unmounting the disk if it holds the mount
+
+int server_receive(FS3_SERVER *server, SERVER_CLIENT *client);
+	//Receives and executes every whole command a client has sent
+
+size_t server_command_length(FS3CmdBlk cmd);
+	//Gets the bytes of a command and the sectors following it on the wire
+
+size_t server_reply_length(FS3CmdBlk cmd);
+	//Gets the bytes of sectors following the reply to a command
+
+FS3CmdBlk server_execute(FS3_SERVER *server, SERVER_CLIENT *client, FS3CmdBlk cmd, char *data, char *out);
+	//Executes a command, placing any sectors read in out (returns the reply, host order)
+
+int server_start_ring(FS3_SERVER *server, const char *name);
+	//Creates a shared memory ring and starts the thread serving it
+
+void server_stop_ring(FS3_SERVER *server);
+	//Stops serving the ring and removes it
+
+void * server_serve_ring(void *arg);
+	//Executes commands submitted on the ring until the server stops
+
+void server_reset_ring(FS3_SERVER *server, uint32_t request);
+	//Empties the rings for a client attaching, dropping the mount of the one before
+
+char * server_sector(FS3_SERVER *server, uint32_t trk, uint16_t sec);
+	//Finds a sector in the mapped image
+
+int server_queue_reply(FS3_SERVER *server, SERVER_CLIENT *client, uint8_t op, char *reply, size_t length);
+	//Sends a reply once the latency injected for its opcode passes
+
+int server_parse_latency(FS3_SERVER *server, const char *arg);
+	//Sets the latency of every opcode ("usec") or of one ("op=usec")
+
+int server_append_out(SERVER_CLIENT *client, char *bytes, size_t length);
+	//Adds bytes to the replies ready to send
+
+int server_release_due(FS3_SERVER *server, uint64_t now);
+	//Moves held replies that are due to their clients' ready replies
+
+int server_send(FS3_SERVER *server, SERVER_CLIENT *client);
+	//Sends ready replies without blocking, updating what the client is polled for
+
+int server_update_events(FS3_SERVER *server, SERVER_CLIENT *client);
+	//Polls a client for reads unless it is backed up and for writes if replies are ready
+
+int server_arm_timer(FS3_SERVER *server);
+	//Sets the timer to the earliest held reply
+
+uint64_t server_now(void);
+	//Gets monotonic time in usec
+
+#endif
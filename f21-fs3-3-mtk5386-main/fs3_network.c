@@ -16,17 +16,27 @@
 #include <arpa/inet.h>
 #include <cmpsc311_log.h>
 #include <string.h>
+#include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 // Project Includes
 #include <fs3_network.h>
+#include <fs3_transport.h>
 #include <cmpsc311_util.h>
 
 //
 //  Global data
-unsigned char     *fs3_network_address = NULL; // Address of FS3 server
-unsigned short     fs3_network_port = 0;       // Port of FS3 server
-static int socket_fd;
+unsigned char     *fs3_network_address = NULL; // Address of FS3 server (of every server of a volume without its own)
+unsigned short     fs3_network_port = 0;       // Port of FS3 server (of every server of a volume without its own)
+char              *fs3_network_addresses[FS3_MAX_SERVERS]; // Address of each server of a volume (NULL for fs3_network_address)
+unsigned short     fs3_network_ports[FS3_MAX_SERVERS];     // Port of each server of a volume (0 for fs3_network_port)
+int                fs3_network_servers = 1;    // Servers the volume is striped over
+int                fs3_network_window = FS3_DEFAULT_WINDOW; // Commands kept in flight on each connection
+int                fs3_network_connections = FS3_DEFAULT_CONNECTIONS; // Connections pooled at mount
+int                fs3_network_timeout = FS3_DEFAULT_TIMEOUT_MS; // Time a reply may take in msec (0 waits forever)
+int                fs3_network_reconnects = FS3_DEFAULT_RECONNECTS; // Reconnects tried on a broken connection
+char              *fs3_network_ring = NULL;    // Ring of a server on this host used instead of TCP (NULL if none)
 
 //
 // Network functions
@@ -34,7 +44,11 @@ static int socket_fd;
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : network_fs3_syscall
-// Description  : Perform a system call over the network
+// Description  : Perform a system call over the network. Mount connects the
+//                pool and mounts every server of the volume, unmount
+//                unmounts them and closes it, and a track seek goes on the
+//                connection serving its track. A pool on a server's shared
+//                memory ring has one connection, the ring.
 //
 // Inputs       : cmd - the command block to send
 //                ret - the returned command block
@@ -42,90 +56,967 @@ static int socket_fd;
 // Outputs      : 0 if successful, -1 if failure
 
 int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf){
-    struct sockaddr_in caddr;
-    char *ip;
     uint8_t op;
+    uint32_t ticket;
+    int connection = 0;
+    int i;
+    NETWORK_POOL *pool = fs3_ctx_pool(fs3_ctx_current());
 
     //Deconstructs cmdblock for op value
     op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
 
     //If mount connect
     if(op == FS3_OP_MOUNT){
-        //Sets ip address
-        if(fs3_network_address!=NULL){
-            ip = (char*) fs3_network_address;
+        //Pool size is fixed until unmount, each server of the volume gets the same share of it
+        pool->servers = 1;
+        if((pool->address == NULL) && (pool->port == 0)){
+            pool->servers = CMPSC311_MAXVAL(1, CMPSC311_MINVAL(fs3_network_servers, FS3_MAX_SERVERS));
         }
-        else{
-            ip = FS3_DEFAULT_IP;
+        pool->size = pool->servers*CMPSC311_MAXVAL(1, CMPSC311_MINVAL(fs3_network_connections, FS3_MAX_CONNECTIONS/pool->servers));
+        if((pool->address == NULL) && (pool->port == 0) && (fs3_network_ring != NULL)){
+            if(pool->servers > 1){
+                logMessage(LOG_ERROR_LEVEL, "A ring serves one server, not a volume striped over %d", pool->servers);
+                pool->size = 0;
+                return(-1);
+            }
+            pool->size = 1;
         }
 
-        //Setup adress info
-        caddr.sin_family = AF_INET;
-        if(fs3_network_port == 0){
-            caddr.sin_port = htons(FS3_DEFAULT_PORT);
+        //Each server is mounted over its first connection
+        for(i=0; i<pool->servers; i++){
+            if(network_connect(pool, &pool->connections[i]) == -1){
+                pool->size = i;
+                network_release_connections(pool);
+                return(-1);
+            }
         }
-        else{
-            caddr.sin_port = htons(fs3_network_port);
-        }
-        if (inet_aton(ip, &caddr.sin_addr) == 0 ) { 
+        if(network_volume_syscall(pool, cmd, ret) == -1){
+            network_release_connections(pool);
             return(-1);
-        }   
+        }
 
-        //Create socket
-        socket_fd = socket(PF_INET, SOCK_STREAM, 0); 
-        if (socket_fd == -1) {
-            printf("Error on socket creation [%s]\n", strerror(errno) );
+        //Once mounted the rest of the pool is connected, fewer connections are used if some fail
+        if(((*ret>>11)&1) == 0){
+            //Kept so a reestablished connection can mount a server that lost the mount
+            pool->mounted = 1;
+            pool->mountCmd = cmd;
+            pool->mountRet = *ret;
+            for(i=pool->servers; i<pool->size; i++){
+                if(network_connect(pool, &pool->connections[i]) == -1){
+                    logMessage(LOG_ERROR_LEVEL, "Pooled %d of %d connections to the servers", i-i%pool->servers, pool->size);
+                    pool->size = i-i%pool->servers;
+                }
+            }
+        }
+        return(0);
+    }
+
+    //If unmount disconnect
+    if(op == FS3_OP_UMOUNT){
+        if(network_volume_syscall(pool, cmd, ret) == -1){
             return(-1);
-        }  
+        }
+        pool->mounted = 0;
+        network_release_connections(pool);
+        return(0);
+    }
+
+    //Each connection has its own current track on its server
+    if(op == FS3_OP_TSEEK){
+        connection = network_fs3_track_connection((FS3TrackIndex)((((uint64_t)1 << 32)-1)&(cmd>>12)));
+    }
+
+    //Sends command and waits for its reply
+    if((network_fs3_submit(connection, cmd, buf, &ticket) == -1) || (network_fs3_complete(connection, ticket, ret) == -1)){
+        return(-1);
+    }
+
+    //Return successful
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_volume_syscall
+// Description  : Send a mount or unmount to every server of the volume, each
+//                on its first connection, before waiting for any reply. The
+//                volume mounts only if every server does (those that did are
+//                unmounted again) and is granted the extensions all grant.
+//
+// Inputs       : pool - the pool of the volume
+//                cmd - the mount or unmount command block
+//                ret - set to the combined reply
+// Outputs      : 0 if successful, -1 if failure
+
+int network_volume_syscall(NETWORK_POOL *pool, FS3CmdBlk cmd, FS3CmdBlk *ret){
+    uint32_t tickets[FS3_MAX_SERVERS];
+    FS3CmdBlk reply;
+    FS3CmdBlk undo;
+    uint64_t granted = FS3_EXT_MASK;
+    uint64_t failed = 0;
+    uint32_t succeeded = 0;
+    int submitted;
+    int result = 0;
+    int i;
 
-        //Conects socket to server
-        if (connect(socket_fd, (const struct sockaddr *)&caddr, sizeof(caddr)) == -1 ) { 
-            printf("Error on socket connect [%s]\n", strerror(errno) );
+    for(submitted=0; submitted<pool->servers; submitted++){
+        if(network_fs3_submit(submitted, cmd, NULL, &tickets[submitted]) == -1){
+            result = -1;
+            break;
+        }
+    }
+    *ret = cmd;
+    for(i=0; i<submitted; i++){
+        if(network_fs3_complete(i, tickets[i], &reply) == -1){
+            result = -1;
+            continue;
+        }
+        if(i == 0){
+            *ret = reply;
+        }
+        if(((reply>>11)&1) != 0){
+            failed = 1;
+        }
+        else{
+            succeeded |= (uint32_t)1<<i;
+        }
+        granted &= (reply>>FS3_EXT_GRANT_SHIFT)&FS3_EXT_MASK;
+    }
+
+    //A volume is mounted on all of its servers or none
+    if((((((uint64_t)1 << 4)-1)&(cmd>>60)) == FS3_OP_MOUNT) && (pool->servers > 1) && ((result == -1) || failed)){
+        undo = (FS3CmdBlk)FS3_OP_UMOUNT<<60;
+        for(i=0; i<submitted; i++){
+            if((succeeded & ((uint32_t)1<<i)) && ((network_fs3_submit(i, undo, NULL, &tickets[i]) == -1) ||
+                    (network_fs3_complete(i, tickets[i], &reply) == -1))){
+                logMessage(LOG_ERROR_LEVEL, "Failed to unmount server %d of a volume that did not mount", i);
+            }
+        }
+    }
+    if(result == -1){
+        return(-1);
+    }
+    *ret = (*ret&~(((uint64_t)FS3_EXT_MASK<<FS3_EXT_GRANT_SHIFT)|((uint64_t)1<<11)))|(failed<<11)|
+        ((failed ? 0 : granted)<<FS3_EXT_GRANT_SHIFT);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_connect
+// Description  : Connect a pooled connection to the server, starting a fresh
+//                stream of tickets
+//
+// Inputs       : pool - the pool of the connection
+//                conn - the connection to connect
+// Outputs      : 0 if successful, -1 if failure
+
+int network_connect(NETWORK_POOL *pool, NETWORK_CONNECTION *conn){
+    if(network_open(pool, conn) == -1){
+        return(-1);
+    }
+
+    //Starts a fresh stream of tickets
+    pthread_mutex_lock(&conn->requestLock);
+    conn->nextTicket = conn->receivedTicket = conn->oldestTicket = 0;
+    conn->receiving = conn->broken = conn->failed = 0;
+    conn->track = 0;
+    pthread_mutex_unlock(&conn->requestLock);
+    if(conn == &pool->connections[0]){
+        pool->mounted = 0;
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_open
+// Description  : Open the transport of a connection, closing any it had. A
+//                pool on the default server attaches its ring when one is
+//                given (the server is on this host), else dials a socket.
+//
+// Inputs       : pool - the pool of the connection
+//                conn - the connection
+// Outputs      : 0 if successful, -1 if failure
+
+int network_open(NETWORK_POOL *pool, NETWORK_CONNECTION *conn){
+    network_close(conn);
+    if((pool->address == NULL) && (pool->port == 0) && (fs3_network_ring != NULL) && (pool->servers <= 1)){
+        conn->ring = ring_attach(fs3_network_ring, transport_deadline(fs3_network_timeout));
+        if(conn->ring == NULL){
+            printf("Error attaching ring %s [%s]\n", fs3_network_ring, strerror(errno) );
             return(-1);
-        }   
+        }
+        return(0);
+    }
+    conn->socket_fd = network_dial(pool, (int)(conn-pool->connections)%CMPSC311_MAXVAL(1, pool->servers));
+    return((conn->socket_fd == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_close
+// Description  : Close the transport of a connection, if open
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void network_close(NETWORK_CONNECTION *conn){
+    if(conn->ring != NULL){
+        ring_release(conn->ring, NULL);
+        conn->ring = NULL;
+    }
+    if(conn->socket_fd != -1){
+        close(conn->socket_fd);
+        conn->socket_fd = -1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_release_connections
+// Description  : Close the connections of a pool established at mount
+//
+// Inputs       : pool - the pool
+// Outputs      : none
+
+void network_release_connections(NETWORK_POOL *pool){
+    int i;
+
+    for(i=0; i<pool->size; i++){
+        network_close(&pool->connections[i]);
     }
+    pool->size = 0;
+}
 
-    //Send cmd
-    cmd = htonll64(cmd);
-    if (write(socket_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) { 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_dial
+// Description  : Open a socket to a server of a pool, giving up once a
+//                reply would be overdue
+//
+// Inputs       : pool - the pool
+//                server - the server of the volume
+// Outputs      : socket if successful, -1 if failure
+
+int network_dial(NETWORK_POOL *pool, int server){
+    unsigned short port;
+    char *ip;
+    int fd;
+
+    //Sets ip address, the pool's own server first
+    if(pool->address!=NULL){
+        ip = pool->address;
+    }
+    else if(fs3_network_addresses[server]!=NULL){
+        ip = fs3_network_addresses[server];
+    }
+    else if(fs3_network_address!=NULL){
+        ip = (char*) fs3_network_address;
+    }
+    else{
+        ip = FS3_DEFAULT_IP;
+    }
+
+    //Sets port, the pool's own server first
+    if(pool->port != 0){
+        port = pool->port;
+    }
+    else if(fs3_network_ports[server] != 0){
+        port = fs3_network_ports[server];
+    }
+    else if(fs3_network_port == 0){
+        port = FS3_DEFAULT_PORT;
+    }
+    else{
+        port = fs3_network_port;
+    }
+
+    //Conects socket to server
+    fd = transport_connect(ip, port, transport_deadline(fs3_network_timeout));
+    if (fd == -1) { 
+        printf("Error on socket connect [%s]\n", strerror(errno) );
+        return(-1);
+    }   
+    return(fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_submit
+// Description  : Send a command without waiting for its reply. Any thread may
+//                submit; commands are ticketed in the order they go on the
+//                wire. If the window of commands in flight is full the caller
+//                receives replies (for whichever thread sent them) first. A
+//                broken connection is reestablished before sending.
+//
+// Inputs       : connection - pooled connection to send on
+//                cmd - the command block to send
+//                buf - the sectors to send (WRSECT/TWRSECT/WRRANGE) or receive into
+//                      (RDSECT/TRDSECT/RDRANGE)
+//                ticket - set to the ticket to complete the command with
+// Outputs      : 0 if successful, -1 if failure
+
+int network_fs3_submit(int connection, FS3CmdBlk cmd, void *buf, uint32_t *ticket){
+    NETWORK_REQUEST *request;
+    uint8_t op;
+    size_t sent;
+    size_t received;
+    int window;
+    int result = 0;
+    NETWORK_POOL *pool = fs3_ctx_pool(fs3_ctx_current());
+    NETWORK_CONNECTION *conn;
+
+    if((connection < 0) || (connection >= pool->size)){
+        logMessage(LOG_ERROR_LEVEL, "Network submit on unpooled connection %d", connection);
+        return(-1);
+    }
+    conn = &pool->connections[connection];
+
+    //A volume's server knows the track by its own number
+    cmd = network_volume_command(pool, cmd);
+    op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
+    network_payload_lengths(cmd, &sent, &received);
+    window = CMPSC311_MAXVAL(1, CMPSC311_MINVAL(fs3_network_window, FS3_MAX_OUTSTANDING));
+
+    //Wire order is ticket order, so one sender at a time
+    pthread_mutex_lock(&conn->sendLock);
+    pthread_mutex_lock(&conn->requestLock);
+
+    //Keeps at most window commands on the wire and a free slot to remember this one
+    while(!conn->failed){
+        if(conn->broken){
+            if(!conn->receiving){
+                network_recover(pool, conn);
+            }
+            else{
+                pthread_cond_wait(&conn->requestCond, &conn->requestLock);
+            }
+            continue;
+        }
+        if((conn->nextTicket-conn->receivedTicket < (uint32_t)window) && (conn->nextTicket-conn->oldestTicket < FS3_MAX_OUTSTANDING) &&
+                network_has_room(conn, sent+received)){
+            break;
+        }
+        if(!conn->receiving && (conn->receivedTicket != conn->nextTicket)){
+            network_receive_next(conn);
+        }
+        else{
+            pthread_cond_wait(&conn->requestCond, &conn->requestLock);
+        }
+    }
+    if(conn->failed){
+        pthread_mutex_unlock(&conn->requestLock);
+        pthread_mutex_unlock(&conn->sendLock);
+        logMessage(LOG_ERROR_LEVEL, "Network submit on a failed connection");
+        return(-1);
+    }
+
+    //Remembers command to match its reply, and to resend it if the connection breaks
+    *ticket = conn->nextTicket;
+    request = &conn->requests[conn->nextTicket%FS3_MAX_OUTSTANDING];
+    request->op = op;
+    request->cmd = cmd;
+    request->buf = buf;
+    request->sent = sent;
+    request->length = received;
+    request->track = conn->track;
+    request->deadline = transport_deadline(fs3_network_timeout);
+    request->ret = 0;
+    request->collected = 0;
+    conn->nextTicket++;
+    if(op == FS3_OP_TSEEK){
+        conn->track = (FS3TrackIndex)((((uint64_t)1 << 32)-1)&(cmd>>12));
+    }
+    pthread_mutex_unlock(&conn->requestLock);
+
+    //Send cmd and buf together
+    if(network_send_request(conn, request) == -1){
         printf("Error writing network data [%s]\n", strerror(errno) );
+
+        //Stream is out of step with the server, it is reestablished with this command resent
+        pthread_mutex_lock(&conn->requestLock);
+        conn->broken = 1;
+        pthread_cond_broadcast(&conn->requestCond);
+        while(conn->broken && !conn->failed){
+            if(!conn->receiving){
+                network_recover(pool, conn);
+            }
+            else{
+                pthread_cond_wait(&conn->requestCond, &conn->requestLock);
+            }
+        }
+        result = conn->failed ? -1 : 0;
+        pthread_mutex_unlock(&conn->requestLock);
+    }
+    pthread_mutex_unlock(&conn->sendLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_complete
+// Description  : Wait for the reply of a submitted command. Whichever waiter
+//                finds the socket idle receives replies for all threads in
+//                order until its own arrives, and reestablishes the
+//                connection if it breaks or a reply is overdue.
+//
+// Inputs       : connection - pooled connection the command was sent on
+//                ticket - the ticket returned by network_fs3_submit
+//                ret - the returned command block
+// Outputs      : 0 if successful, -1 if failure
+
+int network_fs3_complete(int connection, uint32_t ticket, FS3CmdBlk *ret){
+    NETWORK_REQUEST *request;
+    int result = 0;
+    NETWORK_POOL *pool = fs3_ctx_pool(fs3_ctx_current());
+    NETWORK_CONNECTION *conn;
+
+    if((connection < 0) || (connection >= pool->size)){
+        logMessage(LOG_ERROR_LEVEL, "Network complete on unpooled connection %d", connection);
         return(-1);
-    }  
+    }
+    conn = &pool->connections[connection];
 
-    //If buffer for write send
-    if(op == FS3_OP_WRSECT){
-        //Send buf
-        if (write(socket_fd, buf, (size_t)FS3_SECTOR_SIZE*sizeof(char)) != (size_t)FS3_SECTOR_SIZE*sizeof(char)) { 
-            printf("Error writing network data [%s]\n", strerror(errno) );
+    pthread_mutex_lock(&conn->requestLock);
+    if((ticket-conn->oldestTicket) >= (conn->nextTicket-conn->oldestTicket)){
+        pthread_mutex_unlock(&conn->requestLock);
+        logMessage(LOG_ERROR_LEVEL, "No outstanding network command with ticket %u", ticket);
+        return(-1);
+    }
+
+    //Receives until the reply for this ticket is in
+    while(!conn->failed && ((ticket-conn->oldestTicket) >= (conn->receivedTicket-conn->oldestTicket))){
+        if(conn->receiving){
+            pthread_cond_wait(&conn->requestCond, &conn->requestLock);
+        }
+        else if(conn->broken){
+            //Reestablishing sends, so the send lock is taken first as senders do
+            pthread_mutex_unlock(&conn->requestLock);
+            pthread_mutex_lock(&conn->sendLock);
+            pthread_mutex_lock(&conn->requestLock);
+            if(conn->broken && !conn->failed && !conn->receiving){
+                network_recover(pool, conn);
+            }
+            pthread_mutex_unlock(&conn->sendLock);
+        }
+        else{
+            network_receive_next(conn);
+        }
+    }
+
+    //Set return cmd
+    request = &conn->requests[ticket%FS3_MAX_OUTSTANDING];
+    if((ticket-conn->oldestTicket) < (conn->receivedTicket-conn->oldestTicket)){
+        *ret = request->ret;
+    }
+    else{
+        result = -1;
+    }
+
+    //Frees slots of commands every submitter has collected
+    request->collected = 1;
+    while((conn->oldestTicket != conn->nextTicket) && conn->requests[conn->oldestTicket%FS3_MAX_OUTSTANDING].collected){
+        conn->oldestTicket++;
+    }
+    pthread_cond_broadcast(&conn->requestCond);
+    pthread_mutex_unlock(&conn->requestLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_outstanding
+// Description  : Get the number of submitted commands not yet completed on
+//                all pooled connections
+//
+// Inputs       : none
+// Outputs      : number of outstanding commands
+
+int network_fs3_outstanding(void){
+    int count = 0;
+    int i;
+    NETWORK_POOL *pool = fs3_ctx_pool(fs3_ctx_current());
+    NETWORK_CONNECTION *conn;
+
+    for(i=0; i<pool->size; i++){
+        conn = &pool->connections[i];
+        pthread_mutex_lock(&conn->requestLock);
+        count += (int)(conn->nextTicket-conn->oldestTicket);
+        pthread_mutex_unlock(&conn->requestLock);
+    }
+    return(count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_track_connection
+// Description  : Get the pooled connection serving a track, neighbouring
+//                tracks are spread over different connections. A volume's
+//                track is on server trk%servers, served by the connections
+//                to it in turn.
+//
+// Inputs       : trk - the track of the volume
+// Outputs      : index of the connection
+
+int network_fs3_track_connection(FS3TrackIndex trk){
+    NETWORK_POOL *pool = fs3_ctx_pool(fs3_ctx_current());
+    int servers = CMPSC311_MAXVAL(1, pool->servers);
+
+    if(pool->size <= 1){
+        return(0);
+    }
+    return((int)(trk%servers)+servers*(int)((trk/servers)%(pool->size/servers)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_servers
+// Description  : Get the number of servers the mounted volume is striped
+//                over, its tracks are theirs taken in turn
+//
+// Inputs       : none
+// Outputs      : number of servers
+
+int network_fs3_servers(void){
+    NETWORK_POOL *pool = fs3_ctx_pool(fs3_ctx_current());
+
+    return(CMPSC311_MAXVAL(1, pool->servers));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_add_servers
+// Description  : Set the addresses or ports of the servers a volume is
+//                striped over from a comma separated list, in server order
+//
+// Inputs       : list - the addresses or ports (e.g. "22887,22888")
+//                ports - if the list holds ports (1:true)
+// Outputs      : number of servers listed if successful, -1 if failure
+
+int network_add_servers(const char *list, int ports){
+    unsigned short port;
+    char *copy;
+    char *item;
+    char *save;
+    int count = 0;
+
+    copy = strdup(list);
+    if(copy == NULL){
+        return(-1);
+    }
+    for(item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)){
+        if(count == FS3_MAX_SERVERS){
+            free(copy);
+            return(-1);
+        }
+        if(ports){
+            if(sscanf(item, "%hu", &port) != 1){
+                free(copy);
+                return(-1);
+            }
+            fs3_network_ports[count] = port;
+        }
+        else{
+            if(inet_addr(item) == INADDR_NONE){
+                free(copy);
+                return(-1);
+            }
+            free(fs3_network_addresses[count]);
+            fs3_network_addresses[count] = strdup(item);
+        }
+        count++;
+    }
+    free(copy);
+    if(count == 0){
+        return(-1);
+    }
+    fs3_network_servers = CMPSC311_MAXVAL(fs3_network_servers, count);
+    return(count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_volume_command
+// Description  : Translate the track a command carries from the volume's
+//                numbering to its server's, track trk being the server's
+//                track trk/servers
+//
+// Inputs       : pool - the pool of the volume
+//                cmd - the command block (host order)
+// Outputs      : the command block as its server takes it
+
+FS3CmdBlk network_volume_command(NETWORK_POOL *pool, FS3CmdBlk cmd){
+    uint64_t trk;
+    uint8_t op;
+
+    if(pool->servers <= 1){
+        return(cmd);
+    }
+    op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
+    switch(op){
+    case FS3_OP_TSEEK:
+    case FS3_OP_TRDSECT:
+    case FS3_OP_TWRSECT:
+    case FS3_OP_RDRANGE:
+    case FS3_OP_WRRANGE:
+        trk = (((uint64_t)1 << 32)-1)&(cmd>>12);
+        cmd = (cmd&~((((uint64_t)1 << 32)-1)<<12))|((trk/pool->servers)<<12);
+        break;
+    }
+    return(cmd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_init_pool
+// Description  : Initialize an unconnected pool of connections to a server,
+//                they connect at mount
+//
+// Inputs       : pool - the pool to initialize
+//                address - the server address (NULL for fs3_network_address)
+//                port - the server port (0 for fs3_network_port)
+// Outputs      : 0 if successful, -1 if failure
+
+int network_init_pool(NETWORK_POOL *pool, const char *address, unsigned short port){
+    NETWORK_CONNECTION *conn;
+    int i;
+
+    memset(pool, 0, sizeof(NETWORK_POOL));
+    pool->port = port;
+    if(address != NULL){
+        pool->address = strdup(address);
+        if(pool->address == NULL){
             return(-1);
-        }  
+        }
+    }
+    for(i=0; i<FS3_MAX_CONNECTIONS; i++){
+        conn = &pool->connections[i];
+        conn->socket_fd = -1;
+        pthread_mutex_init(&conn->requestLock, NULL);
+        pthread_cond_init(&conn->requestCond, NULL);
+        pthread_mutex_init(&conn->sendLock, NULL);
+    }
+    return(0);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_release_pool
+// Description  : Close the connections of a pool (if still connected) and
+//                free what it holds
+//
+// Inputs       : pool - the pool to release
+// Outputs      : none
+
+void network_release_pool(NETWORK_POOL *pool){
+    NETWORK_CONNECTION *conn;
+    int i;
+
+    for(i=0; i<FS3_MAX_CONNECTIONS; i++){
+        conn = &pool->connections[i];
+        network_close(conn);
+        pthread_mutex_destroy(&conn->requestLock);
+        pthread_cond_destroy(&conn->requestCond);
+        pthread_mutex_destroy(&conn->sendLock);
+    }
+    free(pool->address);
+    pool->address = NULL;
+    pool->size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_receive_next
+// Description  : Receive the next reply on the socket for whichever thread
+//                sent it. The request lock is dropped while reading so other
+//                threads can submit meanwhile. A reply not in by its
+//                deadline breaks the connection.
+//
+// Inputs       : conn - the connection (request lock held, a reply pending, no other receiver)
+// Outputs      : 0 if successful, -1 if failure
+
+int network_receive_next(NETWORK_CONNECTION *conn){
+    NETWORK_REQUEST *request;
+    int result;
+
+    conn->receiving = 1;
+    request = &conn->requests[conn->receivedTicket%FS3_MAX_OUTSTANDING];
+    pthread_mutex_unlock(&conn->requestLock);
+    result = network_receive_reply(conn, request);
+    pthread_mutex_lock(&conn->requestLock);
+    conn->receiving = 0;
+    if(result == -1){
+        conn->broken = 1;
+    }
+    else{
+        conn->receivedTicket++;
+    }
+    pthread_cond_broadcast(&conn->requestCond);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_receive_reply
+// Description  : Receive the reply (and sectors for RDSECT/TRDSECT/RDRANGE) of
+//                a command in one vectored read where the socket allows
+//
+// Inputs       : conn - the connection to receive on
+//                request - the command the next reply on the socket answers
+// Outputs      : 0 if successful, -1 if failure
+
+int network_receive_reply(NETWORK_CONNECTION *conn, NETWORK_REQUEST *request){
+    struct iovec iov[2];
+    FS3CmdBlk cmd;
+
+    if(conn->ring != NULL){
+        if(ring_receive(conn->ring, &request->ret, request->buf, request->length, request->deadline) == -1){
+            printf("Error reading ring [%s]\n", strerror(errno) );
+            return(-1);
+        }
+        return(0);
     }
 
-    //Receive cmd
-    if (read(socket_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) { 
+    //Receive cmd, and buffer back if read
+    iov[0].iov_base = &cmd;
+    iov[0].iov_len = sizeof(cmd);
+    iov[1].iov_base = request->buf;
+    iov[1].iov_len = request->length;
+    if (transport_receive(conn->socket_fd, iov, (request->length > 0) ? 2 : 1, request->deadline) == -1) { 
         printf("Error reading network data [%s]\n", strerror(errno) );
         return(-1);
     }  
+    request->ret = ntohll64(cmd);
+    return(0);
+}
 
-    //Set return cmd
-    *ret = ntohll64(cmd);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_send_request
+// Description  : Send a command and the sectors it carries in one vectored
+//                send, so the header never waits on the wire for its payload
+//
+// Inputs       : conn - the connection to send on
+//                request - the command
+// Outputs      : 0 if successful, -1 if failure
+
+int network_send_request(NETWORK_CONNECTION *conn, NETWORK_REQUEST *request){
+    struct iovec iov[2];
+    FS3CmdBlk netCmd;
+
+    //On a ring the sectors are handed over in its slots
+    if(conn->ring != NULL){
+        return(ring_send(conn->ring, request->cmd, request->buf, request->sent, request->length));
+    }
+
+    netCmd = htonll64(request->cmd);
+    iov[0].iov_base = &netCmd;
+    iov[0].iov_len = sizeof(netCmd);
+    iov[1].iov_base = request->buf;
+    iov[1].iov_len = request->sent;
+    return(transport_send(conn->socket_fd, iov, (request->sent > 0) ? 2 : 1, request->deadline));
+}
 
-    //If read get buffer back
-    if(op == FS3_OP_RDSECT){
-        if (read( socket_fd, buf, (size_t)FS3_SECTOR_SIZE*sizeof(char)) != (size_t)FS3_SECTOR_SIZE*sizeof(char)) { 
-            printf( "Error reading network data [%s]\n", strerror(errno) );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_recover
+// Description  : Reestablish a broken connection, trying again after a
+//                growing wait. Once out of tries the connection fails every
+//                outstanding command and any sent after, until remount.
+//
+// Inputs       : pool - the pool of the connection
+//                conn - the broken connection (send and request locks held, no receiver)
+// Outputs      : 0 if successful, -1 if failure
+
+int network_recover(NETWORK_POOL *pool, NETWORK_CONNECTION *conn){
+    uint32_t first;
+    uint32_t last;
+    int result = -1;
+    int attempt;
+
+    //Nothing is sent while the send lock is held, and none receive while this does
+    conn->receiving = 1;
+    first = conn->receivedTicket;
+    last = conn->nextTicket;
+    pthread_mutex_unlock(&conn->requestLock);
+
+    for(attempt=1; attempt<=fs3_network_reconnects; attempt++){
+        logMessage(LOG_WARNING_LEVEL, "Reestablishing connection %d to the server with %u commands outstanding (try %d of %d)",
+            (int)(conn-pool->connections), last-first, attempt, fs3_network_reconnects);
+        if(network_reestablish(pool, conn, first, last) == 0){
+            result = 0;
+            break;
+        }
+        usleep(FS3_RECONNECT_BACKOFF_MS*1000*attempt);
+    }
+
+    pthread_mutex_lock(&conn->requestLock);
+    conn->receiving = 0;
+    if(result == 0){
+        conn->broken = 0;
+    }
+    else{
+        logMessage(LOG_ERROR_LEVEL, "Failed to reestablish connection %d to the server", (int)(conn-pool->connections));
+        conn->failed = 1;
+    }
+    pthread_cond_broadcast(&conn->requestCond);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_reestablish
+// Description  : Reconnect a connection and replay what the server lost with
+//                the old one: the mount if the server no longer has it, the
+//                track the connection was sought to, then every command
+//                whose reply was not received, in order. Sector commands
+//                are idempotent, so resending ones that had completed on
+//                the server is harmless.
+//
+// Inputs       : pool - the pool of the connection
+//                conn - the connection
+//                first - ticket of the oldest command not received
+//                last - ticket after the newest command sent
+// Outputs      : 0 if successful, -1 if failure
+
+int network_reestablish(NETWORK_POOL *pool, NETWORK_CONNECTION *conn, uint32_t first, uint32_t last){
+    NETWORK_REQUEST *request;
+    FS3TrackIndex track;
+    FS3CmdBlk seek;
+    FS3CmdBlk ret;
+    uint64_t deadline;
+    uint32_t ticket;
+
+    if(network_open(pool, conn) == -1){
+        return(-1);
+    }
+    deadline = transport_deadline(fs3_network_timeout);
+
+    //Seeks the track the oldest outstanding command was sent on, a seek the
+    //server refuses shows it lost the mount (it restarted, or this connection
+    //held the mount) so the mount is replayed, granting the extensions in use
+    if(pool->mounted){
+        track = (first != last) ? conn->requests[first%FS3_MAX_OUTSTANDING].track : conn->track;
+        seek = ((FS3CmdBlk)FS3_OP_TSEEK<<60)|((FS3CmdBlk)track<<12);
+        if(network_exchange(conn, seek, &ret, deadline) == -1){
             return(-1);
-        }  
+        }
+        if(((ret>>11)&1) != 0){
+            if((network_exchange(conn, pool->mountCmd, &ret, deadline) == -1) || (((ret>>11)&1) != 0) ||
+                    ((((pool->mountRet&~ret)>>FS3_EXT_GRANT_SHIFT)&FS3_EXT_MASK) != 0)){
+                logMessage(LOG_ERROR_LEVEL, "Server refused the replayed mount");
+                return(-1);
+            }
+            if((network_exchange(conn, seek, &ret, deadline) == -1) || (((ret>>11)&1) != 0)){
+                logMessage(LOG_ERROR_LEVEL, "Server refused the replayed seek to track %d", track);
+                return(-1);
+            }
+        }
     }
 
-    //If unmount disconnect
-    if(op == FS3_OP_UMOUNT){
-        // Close the socket
-        close(socket_fd);
-        socket_fd = -1;
+    //Resends outstanding commands, each given a fresh deadline
+    for(ticket=first; ticket!=last; ticket++){
+        request = &conn->requests[ticket%FS3_MAX_OUTSTANDING];
+        request->deadline = transport_deadline(fs3_network_timeout);
+        if(network_send_request(conn, request) == -1){
+            printf("Error writing network data [%s]\n", strerror(errno) );
+            return(-1);
+        }
     }
+    return(0);
+}
 
-    //Return successful
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_exchange
+// Description  : Send a command carrying no sectors and wait for its reply,
+//                used while no other command is in flight on the connection
+//
+// Inputs       : conn - the connection
+//                cmd - the command block to send
+//                ret - the returned command block
+//                deadline - time to give up by (usec, monotonic)
+// Outputs      : 0 if successful, -1 if failure
+
+int network_exchange(NETWORK_CONNECTION *conn, FS3CmdBlk cmd, FS3CmdBlk *ret, uint64_t deadline){
+    struct iovec iov;
+    FS3CmdBlk netCmd;
+
+    if(conn->ring != NULL){
+        if(ring_send(conn->ring, cmd, NULL, 0, 0) == -1){
+            return(-1);
+        }
+        return(ring_receive(conn->ring, ret, NULL, 0, deadline));
+    }
+
+    netCmd = htonll64(cmd);
+    iov.iov_base = &netCmd;
+    iov.iov_len = sizeof(netCmd);
+    if(transport_send(conn->socket_fd, &iov, 1, deadline) == -1){
+        return(-1);
+    }
+    iov.iov_base = &netCmd;
+    iov.iov_len = sizeof(netCmd);
+    if(transport_receive(conn->socket_fd, &iov, 1, deadline) == -1){
+        return(-1);
+    }
+    *ret = ntohll64(netCmd);
     return(0);
-}
\ No newline at end of file
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_has_room
+// Description  : Check if the transport of a connection can take a command
+//                now. A socket always can, a ring only once enough of its
+//                slots are freed by replies received.
+//
+// Inputs       : conn - the connection
+//                bytes - bytes of sectors sent or received by the command
+// Outputs      : 1 if there is room, 0 if not
+
+int network_has_room(NETWORK_CONNECTION *conn, size_t bytes){
+    if(conn->ring == NULL){
+        return(1);
+    }
+    return(ring_has_room(conn->ring, bytes));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_payload_lengths
+// Description  : Get the bytes of sectors following a command on the wire and
+//                following its reply, a range moves the run its command counts
+//
+// Inputs       : cmd - the command block (host order)
+//                sent - set to bytes of sectors sent after the command
+//                received - set to bytes of sectors received after the reply
+// Outputs      : none
+
+void network_payload_lengths(FS3CmdBlk cmd, size_t *sent, size_t *received){
+    uint8_t op;
+
+    op = ((((uint64_t)1 << 4)-1)&(cmd>>60));
+    *sent = 0;
+    *received = 0;
+    switch(op){
+    case FS3_OP_RDSECT:
+    case FS3_OP_TRDSECT:
+        *received = FS3_SECTOR_SIZE;
+        break;
+
+    case FS3_OP_WRSECT:
+    case FS3_OP_TWRSECT:
+        *sent = FS3_SECTOR_SIZE;
+        break;
+
+    case FS3_OP_RDRANGE:
+        *received = (size_t)(cmd&FS3_RANGE_COUNT_MASK)*FS3_SECTOR_SIZE;
+        break;
+
+    case FS3_OP_WRRANGE:
+        *sent = (size_t)(cmd&FS3_RANGE_COUNT_MASK)*FS3_SECTOR_SIZE;
+        break;
+    }
+}
@@ -11,20 +11,88 @@
 //
 
 // Include Files
+#include <stddef.h>
 
 // Project Include Files
+#include <pthread.h>
 #include <fs3_controller.h>
+#include <fs3_context.h>
+#include <fs3_ring.h>
 
 // Defines
 #define FS3_MAX_BACKLOG 5
 #define FS3_NET_HEADER_SIZE sizeof(FS3CmdBlk)
 #define FS3_DEFAULT_IP "127.0.0.1"
 #define FS3_DEFAULT_PORT 22887
+#define FS3_DEFAULT_WINDOW 32 // Commands kept in flight by default
+#define FS3_MAX_OUTSTANDING 1024 // Commands submitted but not yet completed
+#define FS3_DEFAULT_CONNECTIONS 1 // Connections pooled by default (the stock server serves one client at a time)
+#define FS3_MAX_CONNECTIONS 16 // Most connections pooled, over all servers of a volume
+#define FS3_DEFAULT_TIMEOUT_MS 5000 // Time a reply may take before its connection is reestablished
+#define FS3_DEFAULT_RECONNECTS 3 // Reconnects tried before a broken connection fails its commands
+#define FS3_RECONNECT_BACKOFF_MS 100 // Wait after a failed reconnect, longer after each
+
+#if FS3_RING_ENTRIES < FS3_MAX_OUTSTANDING
+#error "A ring must hold every outstanding command"
+#endif
+
+//Outstanding command, matched to its reply by order of its ticket
+typedef struct
+{
+    uint8_t op;         //Opcode of command
+    FS3CmdBlk cmd;      //Command, kept to resend on a reestablished connection
+    void *buf;          //Sectors sent (WRSECT/TWRSECT/WRRANGE) or to receive into (RDSECT/TRDSECT/RDRANGE)
+    size_t sent;        //Bytes of sectors sent with the command
+    size_t length;      //Bytes of sectors received with the reply
+    FS3TrackIndex track;//Track the connection was sought to when the command was sent
+    uint64_t deadline;  //Time the reply is due by (usec, monotonic)
+    FS3CmdBlk ret;      //Reply, once received
+    int collected;      //If the submitter has taken the reply (1:true)
+} NETWORK_REQUEST;
+
+//Connection to an FS3 server, one per pooled socket
+typedef struct
+{
+    int socket_fd;                                  //Socket connected at mount
+    FS3_RING *ring;                                 //Shared memory ring used instead of the socket (NULL if none)
+    NETWORK_REQUEST requests[FS3_MAX_OUTSTANDING];  //Outstanding commands, indexed by ticket
+    uint32_t nextTicket;                            //Ticket of the next command sent
+    uint32_t receivedTicket;                        //Oldest command whose reply is not yet received
+    uint32_t oldestTicket;                          //Oldest command not yet collected by its submitter
+    FS3TrackIndex track;                            //Track of the last seek sent
+    int receiving;                                  //If a thread is reading a reply off the socket (1:true)
+    int broken;                                     //If the connection failed mid-stream and must be reestablished (1:true)
+    int failed;                                     //If reestablishing failed, commands fail until remount (1:true)
+    pthread_mutex_t requestLock;                    //Guards the ticket state
+    pthread_cond_t requestCond;                     //Signals received replies
+    pthread_mutex_t sendLock;                       //Keeps each command whole on the wire
+} NETWORK_CONNECTION;
+
+//Pool of connections to an FS3 server or a volume striped over several, one per context
+typedef struct
+{
+    char *address;                                      //Address of server (NULL for the servers of fs3_network_servers)
+    unsigned short port;                                //Port of server (0 for the servers of fs3_network_servers)
+    int servers;                                        //Servers the volume is striped over, set at mount
+    int size;                                           //Connections established at mount (0 if unmounted)
+    NETWORK_CONNECTION connections[FS3_MAX_CONNECTIONS];//Pooled connections, connection N to server N%servers
+    int mounted;                                        //If the server was mounted through the pool (1:true)
+    FS3CmdBlk mountCmd;                                 //Mount sent, replayed if the server loses it
+    FS3CmdBlk mountRet;                                 //Reply to the mount, a replay must be granted the same
+} NETWORK_POOL;
 
 
 // Global data
-extern unsigned char *fs3_network_address;     // Address of FS3 server
-extern unsigned short fs3_network_port;        // Port of FS3 server
+extern unsigned char *fs3_network_address;     // Address of FS3 server (of every server of a volume without its own)
+extern unsigned short fs3_network_port;        // Port of FS3 server (of every server of a volume without its own)
+extern char *fs3_network_addresses[FS3_MAX_SERVERS];  // Address of each server a volume is striped over (NULL for fs3_network_address)
+extern unsigned short fs3_network_ports[FS3_MAX_SERVERS]; // Port of each server a volume is striped over (0 for fs3_network_port)
+extern int fs3_network_servers;                // Servers the volume is striped over
+extern int fs3_network_window;                 // Commands kept in flight on each connection
+extern int fs3_network_connections;            // Connections pooled to the server at mount
+extern int fs3_network_timeout;                // Time a reply may take in msec (0 waits forever)
+extern int fs3_network_reconnects;             // Reconnects tried on a broken connection
+extern char *fs3_network_ring;                 // Ring of a server on this host used instead of TCP (NULL if none)
 
 //
 // Functional Prototypes
@@ -32,5 +100,77 @@ extern unsigned short fs3_network_port;        // Port of FS3 server
 int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
 	// This is the client/network system call for communicating with controller
 
+int network_fs3_submit(int connection, FS3CmdBlk cmd, void *buf, uint32_t *ticket);
+	// Send a command on a pooled connection without waiting for its reply, safe from any thread
+
+int network_fs3_complete(int connection, uint32_t ticket, FS3CmdBlk *ret);
+	// Wait for the reply of a command submitted on a pooled connection
+
+int network_fs3_outstanding(void);
+	// Get the number of submitted commands not yet completed
+
+int network_fs3_track_connection(FS3TrackIndex trk);
+	// Get the pooled connection serving a track
+
+int network_fs3_servers(void);
+	// Get the number of servers the mounted volume is striped over
+
+int network_add_servers(const char *list, int ports);
+	// Set the addresses or ports of the servers of a volume from a comma separated list
+
+FS3CmdBlk network_volume_command(NETWORK_POOL *pool, FS3CmdBlk cmd);
+	// Translate the volume track of a command to the track on its server
+
+int network_volume_syscall(NETWORK_POOL *pool, FS3CmdBlk cmd, FS3CmdBlk *ret);
+	// Send a mount or unmount to every server of the volume at once, combining the replies
+
+int network_init_pool(NETWORK_POOL *pool, const char *address, unsigned short port);
+	// Initialize an unconnected pool of connections to a server
+
+void network_release_pool(NETWORK_POOL *pool);
+	// Close the connections of a pool and free what it holds
+
+NETWORK_POOL * fs3_ctx_pool(FS3_CONTEXT *ctx);
+	// Get the server connection pool of a context
+
+int network_connect(NETWORK_POOL *pool, NETWORK_CONNECTION *conn);
+	// Connect a pooled connection to the server, starting a fresh stream of tickets
+
+int network_open(NETWORK_POOL *pool, NETWORK_CONNECTION *conn);
+	// Open the transport of a connection, the server's ring or a socket, closing any it had
+
+void network_close(NETWORK_CONNECTION *conn);
+	// Close the transport of a connection
+
+void network_release_connections(NETWORK_POOL *pool);
+	// Close the connections of a pool established at mount
+
+int network_dial(NETWORK_POOL *pool, int server);
+	// Open a socket to a server of a pool
+
+int network_has_room(NETWORK_CONNECTION *conn, size_t bytes);
+	// Check if the transport can take a command carrying bytes of sectors now
+
+int network_send_request(NETWORK_CONNECTION *conn, NETWORK_REQUEST *request);
+	// Send a command and its sectors in one vectored send
+
+int network_recover(NETWORK_POOL *pool, NETWORK_CONNECTION *conn);
+	// Reestablish a broken connection, replaying what the server lost (send and request locks held)
+
+int network_reestablish(NETWORK_POOL *pool, NETWORK_CONNECTION *conn, uint32_t first, uint32_t last);
+	// Reconnect and resend the mount, track seek and outstanding commands of a connection
+
+int network_exchange(NETWORK_CONNECTION *conn, FS3CmdBlk cmd, FS3CmdBlk *ret, uint64_t deadline);
+	// Send a command carrying no sectors and wait for its reply, nothing else in flight
+
+int network_receive_reply(NETWORK_CONNECTION *conn, NETWORK_REQUEST *request);
+	// Receive the reply (and sectors for RDSECT/TRDSECT/RDRANGE) of a command
+
+void network_payload_lengths(FS3CmdBlk cmd, size_t *sent, size_t *received);
+	// Get the bytes of sectors following a command and following its reply
+
+int network_receive_next(NETWORK_CONNECTION *conn);
+	// Receive the next reply on the socket for whichever thread sent it (request lock held)
+
 
 #endif
@@ -0,0 +1,321 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_queue.c
+//  Description    : This is the implementation of the asynchronous request
+//                   queue of the FS3 filesystem. Worker threads run submitted
+//                   requests through the driver interface, in submission order
+//                   for each file handle and concurrently across handles, so
+//                   one submitting thread keeps many sector operations in
+//                   flight.
+//
+//   Author        : Matthew Kelleher
+//   Last Modified : 12/1/21
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Project Includes
+#include "fs3_queue.h"
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_queue_create
+// Description  : Create a queue whose requests run on the calling thread's
+//                context, and start its workers
+//
+// Inputs       : depth - most requests submitted and not yet reaped (0 for default)
+//                workers - requests executed at once (0 for default)
+// Outputs      : the queue if successful, NULL if failure
+
+FS3_QUEUE * fs3_queue_create(int depth, int workers) {
+	FS3_QUEUE *queue;
+	int i;
+
+	if(depth <= 0){
+		depth = FS3_QUEUE_DEFAULT_DEPTH;
+	}
+	if(workers <= 0){
+		workers = FS3_QUEUE_DEFAULT_WORKERS;
+	}
+	workers = CMPSC311_MINVAL(workers, FS3_QUEUE_MAX_WORKERS);
+
+	//Allocates queue and its entries
+	queue = calloc(1, sizeof(FS3_QUEUE));
+	if(queue == NULL){
+		logMessage(FS3DriverLLevel, "FS3 QUEUE: Failed to allocate queue");
+		return(NULL);
+	}
+	queue->entries = calloc(depth, sizeof(FS3_QUEUE_ENTRY));
+	queue->completions = calloc(depth, sizeof(FS3_COMPLETION));
+	if((queue->entries == NULL) || (queue->completions == NULL)){
+		logMessage(FS3DriverLLevel, "FS3 QUEUE: Failed to allocate queue of depth %d", depth);
+		free(queue->entries);
+		free(queue->completions);
+		free(queue);
+		return(NULL);
+	}
+	queue->ctx = fs3_ctx_current();
+	queue->depth = depth;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->work, NULL);
+	pthread_cond_init(&queue->completed, NULL);
+
+	//Starts workers, running with fewer if some fail to start
+	for(i=0; i<workers; i++){
+		if(pthread_create(&queue->workers[i], NULL, queue_worker, queue) != 0){
+			break;
+		}
+		queue->workerCount++;
+	}
+	if(queue->workerCount == 0){
+		logMessage(FS3DriverLLevel, "FS3 QUEUE: Failed to start queue workers");
+		fs3_queue_destroy(queue);
+		return(NULL);
+	}
+	logMessage(FS3DriverLLevel, "FS3 QUEUE: Created queue of depth %d with %d workers", depth, queue->workerCount);
+	return(queue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_queue_destroy
+// Description  : Wait for submitted requests to run, stop the workers and free
+//                the queue, dropping completions not yet reaped
+//
+// Inputs       : queue - the queue
+// Outputs      : none
+
+void fs3_queue_destroy(FS3_QUEUE *queue) {
+	int i;
+
+	if(queue == NULL){
+		return;
+	}
+
+	//Waits until every submitted request has completed
+	pthread_mutex_lock(&queue->lock);
+	while(queue->inFlight > queue->completionCount){
+		pthread_cond_wait(&queue->completed, &queue->lock);
+	}
+	queue->stopping = 1;
+	pthread_cond_broadcast(&queue->work);
+	pthread_mutex_unlock(&queue->lock);
+
+	for(i=0; i<queue->workerCount; i++){
+		pthread_join(queue->workers[i], NULL);
+	}
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->work);
+	pthread_cond_destroy(&queue->completed);
+	free(queue->entries);
+	free(queue->completions);
+	free(queue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_submit
+// Description  : Submit a batch of requests without waiting for them. A bad
+//                request completes at once with a result of -1.
+//
+// Inputs       : queue - the queue
+//                requests - requests to submit, in order
+//                count - number of requests
+// Outputs      : number of requests queued (fewer than count once the queue
+//                is full), -1 if failure
+
+int fs3_submit(FS3_QUEUE *queue, FS3_SUBMISSION *requests, int count) {
+	FS3_QUEUE_ENTRY *entry;
+	int submitted = 0;
+	int slot = 0;
+
+	if((queue == NULL) || (requests == NULL) || (count < 0)){
+		return(-1);
+	}
+
+	pthread_mutex_lock(&queue->lock);
+	while((submitted < count) && (queue->inFlight < queue->depth)){
+		queue->inFlight++;
+
+		//Checks request is one a worker can run
+		if((requests[submitted].op < FS3_QUEUE_READ) || (requests[submitted].op > FS3_QUEUE_FSYNC) ||
+				(requests[submitted].fd < 0) || (requests[submitted].fd >= FS3_MAX_TOTAL_FILES)){
+			logMessage(FS3DriverLLevel, "FS3 QUEUE: Bad request op %d on fh %d", requests[submitted].op, requests[submitted].fd);
+			queue_complete(queue, requests[submitted].tag, -1);
+			submitted++;
+			continue;
+		}
+
+		//A request not reaped holds at most one entry, so one is free
+		while(queue->entries[slot].state != FS3_QUEUE_FREE){
+			slot++;
+		}
+		entry = &queue->entries[slot];
+		entry->request = requests[submitted];
+		entry->sequence = queue->nextSequence++;
+		entry->state = FS3_QUEUE_PENDING;
+		submitted++;
+	}
+	pthread_cond_broadcast(&queue->work);
+	pthread_mutex_unlock(&queue->lock);
+	return(submitted);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_reap
+// Description  : Take completions in the order requests completed, waiting
+//                until at least wait of them are available (or every request
+//                in flight has completed)
+//
+// Inputs       : queue - the queue
+//                completions - array to copy completions into
+//                max - most completions to take
+//                wait - completions to wait for (0 to poll)
+// Outputs      : number of completions taken, -1 if failure
+
+int fs3_reap(FS3_QUEUE *queue, FS3_COMPLETION *completions, int max, int wait) {
+	int reaped = 0;
+
+	if((queue == NULL) || (completions == NULL) || (max < 0)){
+		return(-1);
+	}
+	wait = CMPSC311_MINVAL(wait, max);
+
+	pthread_mutex_lock(&queue->lock);
+	while((queue->completionCount < wait) && (queue->completionCount < queue->inFlight)){
+		pthread_cond_wait(&queue->completed, &queue->lock);
+	}
+	while((reaped < max) && (queue->completionCount > 0)){
+		completions[reaped++] = queue->completions[queue->completionHead];
+		queue->completionHead = (queue->completionHead+1)%queue->depth;
+		queue->completionCount--;
+		queue->inFlight--;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return(reaped);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_worker
+// Description  : Worker thread, runs the oldest request on a file handle no
+//                other worker is using until the queue is destroyed
+//
+// Inputs       : arg - the queue
+// Outputs      : NULL
+
+void * queue_worker(void *arg) {
+	FS3_QUEUE *queue = (FS3_QUEUE *)arg;
+	FS3_QUEUE_ENTRY *entry;
+	FS3_SUBMISSION request;
+	int32_t result;
+
+	//Requests run on the context the queue was created on
+	fs3_ctx_select(queue->ctx);
+
+	pthread_mutex_lock(&queue->lock);
+	while(1){
+		entry = queue_next_request(queue);
+		if(entry == NULL){
+			if(queue->stopping){
+				break;
+			}
+			pthread_cond_wait(&queue->work, &queue->lock);
+			continue;
+		}
+
+		//Runs request with the queue unlocked, its handle kept from other workers
+		entry->state = FS3_QUEUE_RUNNING;
+		request = entry->request;
+		queue->busy[request.fd] = 1;
+		pthread_mutex_unlock(&queue->lock);
+		result = queue_execute(&request);
+		pthread_mutex_lock(&queue->lock);
+
+		//Frees entry and handle, later requests on the handle can now run
+		entry->state = FS3_QUEUE_FREE;
+		queue->busy[request.fd] = 0;
+		queue_complete(queue, request.tag, result);
+		pthread_cond_broadcast(&queue->work);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_next_request
+// Description  : Finds the oldest pending request on a file handle no worker
+//                is using, so requests on a handle run in submission order
+//
+// Inputs       : queue - the queue (queue lock held)
+// Outputs      : entry of request, NULL if none can run
+
+FS3_QUEUE_ENTRY * queue_next_request(FS3_QUEUE *queue) {
+	FS3_QUEUE_ENTRY *next = NULL;
+	int i;
+
+	for(i=0; i<queue->depth; i++){
+		if((queue->entries[i].state == FS3_QUEUE_PENDING) && !queue->busy[queue->entries[i].request.fd] &&
+				((next == NULL) || (queue->entries[i].sequence < next->sequence))){
+			next = &queue->entries[i];
+		}
+	}
+	return(next);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_complete
+// Description  : Adds a completion to be reaped
+//
+// Inputs       : queue - the queue (queue lock held)
+//                tag - tag of the request
+//                result - result of the request
+// Outputs      : none
+
+void queue_complete(FS3_QUEUE *queue, uint64_t tag, int32_t result) {
+	FS3_COMPLETION *completion;
+
+	//Requests in flight never outnumber the depth, so there is room
+	completion = &queue->completions[(queue->completionHead+queue->completionCount)%queue->depth];
+	completion->tag = tag;
+	completion->result = result;
+	queue->completionCount++;
+	pthread_cond_broadcast(&queue->completed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_execute
+// Description  : Runs a request through the driver interface
+//
+// Inputs       : request - the request
+// Outputs      : result of the request
+
+int32_t queue_execute(FS3_SUBMISSION *request) {
+	switch(request->op){
+	case FS3_QUEUE_READ:
+		return(fs3_read(request->fd, request->buf, request->count));
+
+	case FS3_QUEUE_WRITE:
+		return(fs3_write(request->fd, request->buf, request->count));
+
+	case FS3_QUEUE_SEEK:
+		return(fs3_seek(request->fd, request->loc));
+
+	case FS3_QUEUE_FSYNC:
+		return(fs3_fsync(request->fd));
+
+	default:
+		return(-1);
+	}
+}
@@ -0,0 +1,111 @@
+#ifndef FS3_QUEUE_INCLUDED
+#define FS3_QUEUE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_queue.h
+//  Description    : This is the interface for the asynchronous request queue
+//                   of the FS3 filesystem. Requests against file handles are
+//                   submitted in batches and their completions reaped later.
+//
+//  Author         : Matthew Kelleher
+//  Last Modified  : 12/1/21
+//
+
+// Include files
+#include <stdint.h>
+#include <pthread.h>
+#include <fs3_driver.h>
+
+// Defines
+#define FS3_QUEUE_DEFAULT_DEPTH 256		//Requests submitted and not yet reaped by default
+#define FS3_QUEUE_DEFAULT_WORKERS 8		//Requests executed at once by default
+#define FS3_QUEUE_MAX_WORKERS 64		//Most requests executed at once
+
+//Request opcodes
+#define FS3_QUEUE_READ 1				//Read count bytes at the file position into buf
+#define FS3_QUEUE_WRITE 2				//Write count bytes from buf at the file position
+#define FS3_QUEUE_SEEK 3				//Seek the file to loc
+#define FS3_QUEUE_FSYNC 4				//Wait until writes made so far are on the device
+
+//Entry states
+#define FS3_QUEUE_FREE 0				//Entry holds no request
+#define FS3_QUEUE_PENDING 1				//Request waits for a worker
+#define FS3_QUEUE_RUNNING 2				//Request is being executed
+
+//Structures
+
+//FS3_SUBMISSION structure (a request against a file handle)
+typedef struct
+{
+	uint8_t op;			//Request opcode
+	int16_t fd;			//File handle
+	void *buf;			//Buffer read into or written from
+	int32_t count;		//Number of bytes read or written
+	uint32_t loc;		//Offset seeked to
+	uint64_t tag;		//Caller's tag, returned with the completion
+}FS3_SUBMISSION;
+
+//FS3_COMPLETION structure (result of a request)
+typedef struct
+{
+	uint64_t tag;		//Tag of the request
+	int32_t result;		//Bytes read or written, 0 for seek and fsync, -1 if failure
+}FS3_COMPLETION;
+
+//FS3_QUEUE_ENTRY structure (a submitted request not yet completed)
+typedef struct
+{
+	FS3_SUBMISSION request;	//The request
+	uint64_t sequence;		//Order of submission
+	int state;				//State of entry
+}FS3_QUEUE_ENTRY;
+
+//FS3_QUEUE structure (requests of a context run by a set of worker threads)
+typedef struct
+{
+	FS3_CONTEXT *ctx;							//Context requests are run on
+	int depth;									//Most requests submitted and not yet reaped
+	FS3_QUEUE_ENTRY *entries;					//Submitted requests not yet completed
+	FS3_COMPLETION *completions;				//Completions not yet reaped, oldest at completionHead
+	int completionHead;							//Oldest completion
+	int completionCount;						//Number of completions not yet reaped
+	int inFlight;								//Number of requests submitted and not yet reaped
+	uint64_t nextSequence;						//Sequence of the next request submitted
+	uint8_t busy[FS3_MAX_TOTAL_FILES];			//If a worker runs a request on the file handle (1:true)
+	pthread_mutex_t lock;						//Guards the queue
+	pthread_cond_t work;						//Signals requests a worker can run
+	pthread_cond_t completed;					//Signals completions
+	pthread_t workers[FS3_QUEUE_MAX_WORKERS];	//Worker threads
+	int workerCount;							//Number of worker threads
+	int stopping;								//If workers are told to exit (1:true)
+}FS3_QUEUE;
+
+//
+// Queue functions
+
+FS3_QUEUE * fs3_queue_create(int depth, int workers);
+	// Create a queue on the calling thread's context (0 for default depth/workers)
+
+void fs3_queue_destroy(FS3_QUEUE *queue);
+	// Wait for submitted requests, stop the workers and free the queue
+
+int fs3_submit(FS3_QUEUE *queue, FS3_SUBMISSION *requests, int count);
+	// Submit a batch of requests, returns the number queued (fewer once the queue is full)
+
+int fs3_reap(FS3_QUEUE *queue, FS3_COMPLETION *completions, int max, int wait);
+	// Take up to max completions, waiting until at least wait of them are available
+
+void * queue_worker(void *arg);
+	//Worker thread running requests in submission order for each file handle
+
+FS3_QUEUE_ENTRY * queue_next_request(FS3_QUEUE *queue);
+	//Finds the oldest pending request on a file handle no worker is using (queue lock held)
+
+void queue_complete(FS3_QUEUE *queue, uint64_t tag, int32_t result);
+	//Adds a completion to be reaped (queue lock held)
+
+int32_t queue_execute(FS3_SUBMISSION *request);
+	//Runs a request through the driver interface
+
+#endif
@@ -0,0 +1,356 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_ring.c
+//  Description    : This is the implementation of the shared memory ring
+//                   transport of the FS3 system. Each ring has one producer
+//                   and one consumer, so positions are published with
+//                   release stores and read with acquire loads, and the only
+//                   syscalls a command costs are futex wakeups of a side that
+//                   went to sleep on an empty ring.
+//
+//   Author        : Matthew Kelleher
+//   Last Modified : 12/1/21
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Project Includes
+#include "fs3_ring.h"
+#include "fs3_transport.h"
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_map
+// Description  : Maps a ring segment and finds its rings and slots
+//
+// Inputs       : fd - the shared memory object of the segment
+// Outputs      : the ring if successful, NULL if failure
+
+static FS3_RING * ring_map(int fd) {
+	FS3_RING *ring;
+	char *segment;
+
+	segment = mmap(NULL, FS3_RING_SEGMENT_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(segment == MAP_FAILED){
+		return(NULL);
+	}
+	ring = calloc(1, sizeof(FS3_RING));
+	if(ring == NULL){
+		munmap(segment, FS3_RING_SEGMENT_SIZE);
+		return(NULL);
+	}
+	ring->header = (FS3_RING_HEADER *)segment;
+	ring->sq = (FS3_RING_SQE *)(segment+FS3_RING_HEADER_SIZE);
+	ring->cq = (FS3_RING_CQE *)(ring->sq+FS3_RING_ENTRIES);
+	ring->slots = (char *)(ring->cq+FS3_RING_ENTRIES);
+	return(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_create
+// Description  : Creates the shared segment of a ring served here, replacing
+//                any left behind by a server that did not exit cleanly
+//
+// Inputs       : name - name of the shared memory object (e.g. "/fs3")
+// Outputs      : the ring if successful, NULL if failure
+
+FS3_RING * ring_create(const char *name) {
+	FS3_RING *ring;
+	int error;
+	int fd;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+	if(fd == -1){
+		return(NULL);
+	}
+	if(ftruncate(fd, FS3_RING_SEGMENT_SIZE) == -1){
+		error = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = error;
+		return(NULL);
+	}
+	ring = ring_map(fd);
+	error = errno;
+	close(fd);
+	if(ring == NULL){
+		shm_unlink(name);
+		errno = error;
+		return(NULL);
+	}
+
+	//The segment starts zeroed, so only the layout is filled in
+	ring->header->entries = FS3_RING_ENTRIES;
+	ring->header->slots = FS3_RING_SLOTS;
+	ring->header->version = FS3_RING_VERSION;
+	__atomic_store_n(&ring->header->magic, FS3_RING_MAGIC, __ATOMIC_RELEASE);
+	return(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_attach
+// Description  : Maps the ring of a server on this host and has the server
+//                reset it for this client. Anything a previous client left
+//                in flight is dropped, and so is a mount it held.
+//
+// Inputs       : name - name of the shared memory object of the ring
+//                deadline - time to give up on the server by (usec, monotonic)
+// Outputs      : the ring if successful, NULL if failure
+
+FS3_RING * ring_attach(const char *name, uint64_t deadline) {
+	FS3_RING_HEADER *header;
+	FS3_RING *ring;
+	struct stat info;
+	uint32_t request;
+	uint32_t done;
+	int fd;
+
+	fd = shm_open(name, O_RDWR|O_CLOEXEC, 0);
+	if(fd == -1){
+		return(NULL);
+	}
+	if((fstat(fd, &info) == -1) || ((size_t)info.st_size != FS3_RING_SEGMENT_SIZE)){
+		close(fd);
+		errno = EPROTO;
+		return(NULL);
+	}
+	ring = ring_map(fd);
+	close(fd);
+	if(ring == NULL){
+		return(NULL);
+	}
+	header = ring->header;
+	if((__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FS3_RING_MAGIC) || (header->version != FS3_RING_VERSION) ||
+			(header->entries != FS3_RING_ENTRIES) || (header->slots != FS3_RING_SLOTS)){
+		ring_release(ring, NULL);
+		errno = EPROTO;
+		return(NULL);
+	}
+
+	//Asks the server to reset the rings, then waits for it to
+	request = __atomic_add_fetch(&header->attachRequest, 1, __ATOMIC_SEQ_CST);
+	ring_wake(&header->sqTail);
+	while((done = __atomic_load_n(&header->attachDone, __ATOMIC_ACQUIRE)) != request){
+		if((ring_wait(&header->attachDone, done, deadline) == -1) && (errno == ETIMEDOUT) &&
+				(__atomic_load_n(&header->attachDone, __ATOMIC_ACQUIRE) != request)){
+			ring_release(ring, NULL);
+			errno = ETIMEDOUT;
+			return(NULL);
+		}
+	}
+	ring->sqTail = 0;
+	ring->cqHead = 0;
+	return(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_release
+// Description  : Unmaps a ring, removing its segment if it was created here
+//
+// Inputs       : ring - the ring
+//                name - name of the segment to remove (NULL to leave it)
+// Outputs      : none
+
+void ring_release(FS3_RING *ring, const char *name) {
+	munmap(ring->header, FS3_RING_SEGMENT_SIZE);
+	free(ring);
+	if(name != NULL){
+		shm_unlink(name);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_has_room
+// Description  : Checks if a command carrying bytes of sectors can be
+//                submitted now. A command's slots are contiguous, so slots
+//                left at the end of the pool too few for it are skipped.
+//
+// Inputs       : ring - the ring
+//                bytes - bytes of sectors sent or received by the command
+// Outputs      : 1 if there is room, 0 if not
+
+int ring_has_room(FS3_RING *ring, size_t bytes) {
+	uint64_t count = (bytes+FS3_SECTOR_SIZE-1)/FS3_SECTOR_SIZE;
+	uint64_t start = ring->slotsTaken%FS3_RING_SLOTS;
+	uint64_t skip = (start+count > FS3_RING_SLOTS) ? FS3_RING_SLOTS-start : 0;
+	uint64_t used = ring->slotsTaken-__atomic_load_n(&ring->slotsFreed, __ATOMIC_ACQUIRE);
+
+	if(ring->sqTail-__atomic_load_n(&ring->header->sqHead, __ATOMIC_ACQUIRE) >= FS3_RING_ENTRIES){
+		return(0);
+	}
+	return((used+skip+count <= FS3_RING_SLOTS) ? 1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_send
+// Description  : Submits a command, copying the sectors it sends into its
+//                slots, and wakes the server if it sleeps on an empty ring.
+//                Only one thread may send on a ring at a time.
+//
+// Inputs       : ring - the ring
+//                cmd - the command block (host order)
+//                buf - sectors sent with the command (NULL if none)
+//                sent - bytes sent with the command
+//                received - bytes expected back with the reply
+// Outputs      : 0 if successful, -1 if there is no room for the command
+
+int ring_send(FS3_RING *ring, FS3CmdBlk cmd, void *buf, size_t sent, size_t received) {
+	size_t bytes = (sent > received) ? sent : received;
+	uint32_t count = (uint32_t)((bytes+FS3_SECTOR_SIZE-1)/FS3_SECTOR_SIZE);
+	uint32_t start = (uint32_t)(ring->slotsTaken%FS3_RING_SLOTS);
+	uint32_t skip = (start+count > FS3_RING_SLOTS) ? FS3_RING_SLOTS-start : 0;
+	uint32_t index = ring->sqTail%FS3_RING_ENTRIES;
+	FS3_RING_SQE *sqe = &ring->sq[index];
+
+	if(!ring_has_room(ring, bytes)){
+		errno = ENOBUFS;
+		return(-1);
+	}
+	if(skip != 0){
+		start = 0;
+	}
+
+	//Fills the entry and its slots, then publishes it
+	if(sent > 0){
+		memcpy(ring_slot(ring, start), buf, sent);
+	}
+	sqe->cmd = cmd;
+	sqe->slot = start;
+	sqe->count = count;
+	ring->firstSlot[index] = start;
+	ring->span[index] = skip+count;
+	ring->slotsTaken += skip+count;
+	ring->sqTail++;
+	__atomic_store_n(&ring->header->sqTail, ring->sqTail, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->header->sqSleeping, __ATOMIC_SEQ_CST)){
+		ring_wake(&ring->header->sqTail);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_receive
+// Description  : Takes the next completion, copying the sectors it received
+//                out of its slots and freeing them. An empty ring is polled
+//                a while before sleeping, since a co-located server usually
+//                answers sooner than a futex round trip. Only one thread may
+//                receive on a ring at a time.
+//
+// Inputs       : ring - the ring
+//                ret - set to the reply command block (host order)
+//                buf - buffer for sectors received (NULL if none)
+//                length - bytes received with the reply
+//                deadline - time to give up by (usec, monotonic)
+// Outputs      : 0 if successful, -1 if failure (ETIMEDOUT)
+
+int ring_receive(FS3_RING *ring, FS3CmdBlk *ret, void *buf, size_t length, uint64_t deadline) {
+	FS3_RING_HEADER *header = ring->header;
+	uint32_t index = ring->cqHead%FS3_RING_ENTRIES;
+	int spins = 0;
+
+	while(__atomic_load_n(&header->cqTail, __ATOMIC_ACQUIRE) == ring->cqHead){
+		if(spins < FS3_RING_SPIN){
+			spins++;
+			continue;
+		}
+
+		//Says it sleeps before looking again, so a completion posted in between wakes it
+		__atomic_store_n(&header->cqSleeping, 1, __ATOMIC_SEQ_CST);
+		if((__atomic_load_n(&header->cqTail, __ATOMIC_SEQ_CST) == ring->cqHead) &&
+				(ring_wait(&header->cqTail, ring->cqHead, deadline) == -1) && (errno == ETIMEDOUT) &&
+				(__atomic_load_n(&header->cqTail, __ATOMIC_ACQUIRE) == ring->cqHead)){
+			__atomic_store_n(&header->cqSleeping, 0, __ATOMIC_RELAXED);
+			errno = ETIMEDOUT;
+			return(-1);
+		}
+		__atomic_store_n(&header->cqSleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	//Completions come back in the order submitted, so this one is of the oldest submission
+	*ret = ring->cq[index].ret;
+	if(length > 0){
+		memcpy(buf, ring_slot(ring, ring->firstSlot[index]), length);
+	}
+	ring->cqHead++;
+	__atomic_store_n(&header->cqHead, ring->cqHead, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&ring->slotsFreed, ring->span[index], __ATOMIC_RELEASE);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_slot
+// Description  : Finds a sector buffer slot
+//
+// Inputs       : ring - the ring
+//                slot - index of the slot
+// Outputs      : the slot
+
+char * ring_slot(FS3_RING *ring, uint32_t slot) {
+	return(ring->slots+(size_t)slot*FS3_SECTOR_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_wait
+// Description  : Sleeps on a futex in the shared segment while it holds value
+//
+// Inputs       : word - the shared word
+//                value - value to sleep while the word holds
+//                deadline - time to give up by (usec, monotonic)
+// Outputs      : 0 if woken or the word changed, -1 if failure (ETIMEDOUT)
+
+int ring_wait(uint32_t *word, uint32_t value, uint64_t deadline) {
+	struct timespec timeout;
+	uint64_t now;
+
+	if(deadline == FS3_TRANSPORT_NO_DEADLINE){
+		if((syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0) == -1) && (errno != EAGAIN) && (errno != EINTR)){
+			return(-1);
+		}
+		return(0);
+	}
+	now = transport_now();
+	if(now >= deadline){
+		errno = ETIMEDOUT;
+		return(-1);
+	}
+	timeout.tv_sec = (deadline-now)/1000000;
+	timeout.tv_nsec = ((deadline-now)%1000000)*1000;
+	if((syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0) == -1) && (errno != EAGAIN) && (errno != EINTR)){
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_wake
+// Description  : Wakes every process sleeping on a futex in the shared segment
+//
+// Inputs       : word - the shared word
+// Outputs      : none
+
+void ring_wake(uint32_t *word) {
+	syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
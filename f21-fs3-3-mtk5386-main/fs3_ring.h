@@ -0,0 +1,112 @@
+#ifndef FS3_RING_INCLUDED
+#define FS3_RING_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_ring.h
+//  Description    : This is the interface for the shared memory ring transport
+//                   of the FS3 system. A client on the same host as its server
+//                   places command blocks on a submission ring and takes the
+//                   replies off a completion ring, the sectors they carry
+//                   handed over in buffer slots of the same shared segment.
+//
+//  Author         : Matthew Kelleher
+//  Last Modified  : 12/1/21
+//
+
+// Include files
+#include <stdint.h>
+#include <stddef.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_RING_MAGIC 0x46533352		//Marks a ring segment ("FS3R")
+#define FS3_RING_VERSION 1				//Layout of the ring segment
+#define FS3_RING_ENTRIES 1024			//Commands in flight on a ring
+#define FS3_RING_SLOTS 8192				//Sector buffer slots of a ring
+#define FS3_RING_HEADER_SIZE 4096		//Bytes of the segment before the rings
+#define FS3_RING_ALIGNMENT 64			//Fields written by each side are kept on their own CPU cache line
+#define FS3_RING_SPIN 4096				//Polls of an empty ring before sleeping on its futex
+#define FS3_RING_IDLE_MS 100			//Longest a server sleeps on an idle ring
+#define FS3_RING_SEGMENT_SIZE ((size_t)FS3_RING_HEADER_SIZE+FS3_RING_ENTRIES*(sizeof(FS3_RING_SQE)+sizeof(FS3_RING_CQE))+ \
+	(size_t)FS3_RING_SLOTS*FS3_SECTOR_SIZE)	//Bytes of the ring segment
+
+//Structures
+
+//FS3_RING_SQE structure (a command submitted)
+typedef struct
+{
+	FS3CmdBlk cmd;		//Command block, as on the wire but in host order
+	uint32_t slot;		//First buffer slot of the sectors sent or received
+	uint32_t count;		//Number of buffer slots
+}FS3_RING_SQE;
+
+//FS3_RING_CQE structure (a command completed)
+typedef struct
+{
+	FS3CmdBlk ret;		//Reply command block, host order
+}FS3_RING_CQE;
+
+//FS3_RING_HEADER structure (start of the shared segment, the rings and slots follow)
+typedef struct
+{
+	uint32_t magic;													//FS3_RING_MAGIC
+	uint32_t version;												//FS3_RING_VERSION
+	uint32_t entries;												//Entries of each ring
+	uint32_t slots;													//Sector buffer slots
+	uint32_t sqTail __attribute__((aligned(FS3_RING_ALIGNMENT)));	//Next submission the client fills (futex of the server)
+	uint32_t cqHead;												//Next completion the client takes
+	uint32_t cqSleeping;											//If the client sleeps on cqTail (1:true)
+	uint32_t attachRequest;											//Attaches asked for by clients
+	uint32_t sqHead __attribute__((aligned(FS3_RING_ALIGNMENT)));	//Next submission the server takes
+	uint32_t cqTail;												//Next completion the server fills (futex of the client)
+	uint32_t sqSleeping;											//If the server sleeps on sqTail (1:true)
+	uint32_t attachDone;											//Attaches the server has reset the rings for (futex)
+}FS3_RING_HEADER;
+
+//FS3_RING structure (a mapped ring segment, with the client's own state of it)
+typedef struct FS3_RING
+{
+	FS3_RING_HEADER *header;				//Shared header
+	FS3_RING_SQE *sq;						//Submission ring
+	FS3_RING_CQE *cq;						//Completion ring
+	char *slots;							//Sector buffer slots
+	uint32_t sqTail;						//Next submission filled
+	uint32_t cqHead;						//Next completion taken
+	uint64_t slotsTaken;					//Slots handed out to submissions, in order
+	uint64_t slotsFreed;					//Slots given back by completions, in order
+	uint32_t firstSlot[FS3_RING_ENTRIES];	//First slot of each submission in flight
+	uint32_t span[FS3_RING_ENTRIES];		//Slots each submission holds, with any skipped at the end of the slots
+}FS3_RING;
+
+//
+// Ring functions
+
+FS3_RING * ring_create(const char *name);
+	//Creates and maps the shared segment of a ring served here (server side)
+
+FS3_RING * ring_attach(const char *name, uint64_t deadline);
+	//Maps the ring of a server and has the server reset it for this client
+
+void ring_release(FS3_RING *ring, const char *name);
+	//Unmaps a ring, removing its segment if name is given
+
+int ring_has_room(FS3_RING *ring, size_t bytes);
+	//Checks if a command carrying bytes of sectors can be submitted now
+
+int ring_send(FS3_RING *ring, FS3CmdBlk cmd, void *buf, size_t sent, size_t received);
+	//Submits a command, copying the sectors it sends into its slots
+
+int ring_receive(FS3_RING *ring, FS3CmdBlk *ret, void *buf, size_t length, uint64_t deadline);
+	//Takes the next completion, copying the sectors it received out of its slots
+
+char * ring_slot(FS3_RING *ring, uint32_t slot);
+	//Finds a sector buffer slot
+
+int ring_wait(uint32_t *word, uint32_t value, uint64_t deadline);
+	//Sleeps while a shared word holds value, until woken or the deadline passes
+
+void ring_wake(uint32_t *word);
+	//Wakes every process sleeping on a shared word
+
+#endif
@@ -32,17 +32,23 @@
 // Defines
 #define FS3_WORKLOAD_DIR "workload"
 #define FS3_SIM_MAX_OPEN_FILES 256
-#define FS3_ARGUMENTS "hvc:l:i:p:"
+#define FS3_ARGUMENTS "hvwc:q:n:t:r:l:i:p:"
 #define USAGE \
-	"USAGE: fs3_sim [-h] [-v] [-c <cache size>] [-l <logfile>] <workload-file>\n" \
+	"USAGE: fs3_sim [-h] [-v] [-w] [-c <cache size>] [-q <depth>] [-n <connections>] [-t <msec>] [-r <ring>] [-l <logfile>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
+	"    -w - write-back cache (writes reach the disk on eviction/flush)\n" \
 	"    -c - set the cache size (in number of sectors)\n" \
+	"    -q - commands kept in flight on each connection (queue depth)\n" \
+	"    -n - connections pooled to the server (needs a server serving parallel clients, e.g. fs3_image_server)\n" \
+	"    -t - time a reply may take before the connection is reestablished (0 waits forever)\n" \
+	"    -r - use the shared memory ring of a server on this host instead of TCP (fs3_image_server -r)\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
-    "    -i - IP address of server to connect to.\n" \
-    "    -p - port number of server to connect to.\n" \
+    "    -i - IP address of server to connect to, or a comma separated list of the servers of a volume.\n" \
+    "    -p - port number of server to connect to, or a comma separated list of the servers of a volume\n" \
+    "         (tracks are striped over up to 8 servers, e.g. -p 22887,22888,22889).\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
 	"\n" \
@@ -57,6 +63,7 @@ typedef struct {
 // Global Data
 int verbose;
 uint16_t fs3CacheSize = FS3_DEFAULT_CACHE_SIZE; 
+int fs3CacheWriteBack = 0;
 
 //
 // Functional Prototypes
@@ -98,6 +105,10 @@ int main( int argc, char *argv[] ) {
 			log_initialized = 1;
 			break;
 
+		case 'w': // Write-back cache
+			fs3CacheWriteBack = 1;
+			break;
+
 		case 'c': // Set the cache size
 			if ( sscanf(optarg, "%hu", &fs3CacheSize) != 1) {
 				logMessage(LOG_ERROR_LEVEL, "Failed parsing cache size [%s]", optarg);
@@ -105,7 +116,40 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
-		case 'i': // Get the IP address
+		case 'q': // Set the network queue depth
+			if ( (sscanf(optarg, "%d", &fs3_network_window) != 1) || (fs3_network_window < 1) ) {
+				logMessage(LOG_ERROR_LEVEL, "Bad queue depth [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'n': // Set the number of pooled connections
+			if ( (sscanf(optarg, "%d", &fs3_network_connections) != 1) || (fs3_network_connections < 1) ||
+					(fs3_network_connections > FS3_MAX_CONNECTIONS) ) {
+				logMessage(LOG_ERROR_LEVEL, "Bad connection count [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 't': // Set the reply timeout
+			if ( (sscanf(optarg, "%d", &fs3_network_timeout) != 1) || (fs3_network_timeout < 0) ) {
+				logMessage(LOG_ERROR_LEVEL, "Bad reply timeout [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'r': // Set the shared memory ring
+			fs3_network_ring = optarg;
+			break;
+
+		case 'i': // Get the IP address, or those of the servers of a striped volume
+			if ( strchr(optarg, ',') != NULL ) {
+				if ( network_add_servers(optarg, 0) == -1 ) {
+					logMessage( LOG_ERROR_LEVEL, "Bad IP address list [%s]", optarg );
+					return(-1);
+				}
+				break;
+			}
 			if (inet_addr(optarg) == INADDR_NONE) {
 				logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", argv[optind] );
 				return(-1);
@@ -113,7 +157,14 @@ int main( int argc, char *argv[] ) {
 			fs3_network_address = (unsigned char *)strdup(optarg);
 			break;
 
-		case 'p': // Set the network port number
+		case 'p': // Set the network port number, or those of the servers of a striped volume
+			if ( strchr(optarg, ',') != NULL ) {
+				if ( network_add_servers(optarg, 1) == -1 ) {
+					logMessage( LOG_ERROR_LEVEL, "Bad port number list [%s]", optarg );
+					return(-1);
+				}
+				break;
+			}
 			if ( sscanf(optarg, "%hu", &fs3_network_port) != 1 ) {
 				logMessage( LOG_ERROR_LEVEL, "Bad  port number [%s]", argv[optind] );
 				return(-1);
@@ -184,7 +235,8 @@ int simulate_FS3( char *wload ) {
 	}
 
 	// Startup the interface
-	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(fs3CacheSize) == -1) ){
+	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(fs3CacheSize) == -1) ||
+			(fs3CacheWriteBack && (fs3_enable_cache_write_back(flush_sectors) == -1)) ){
 		logMessage( LOG_ERROR_LEVEL, "FS3 simulator failed initialization.");
 		fclose( fhandle );
 		return( -1 );
@@ -369,7 +421,7 @@ int simulate_FS3( char *wload ) {
 	}
 
 	// Log cache metrics, shut down the interface
-	if ( fs3_log_cache_metrics() == -1 ) {
+	if ( (fs3_log_cache_metrics() == -1) || (fs3_log_driver_metrics() == -1) ) {
 		logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, controller metrics failed");
 		return(-1);
 	}
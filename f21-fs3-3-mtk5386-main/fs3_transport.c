@@ -0,0 +1,245 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_transport.c
+//  Description    : This is the implementation of the socket transport of the
+//                   FS3 client. Commands and their sectors leave in one
+//                   sendmsg so Nagle and delayed ACKs never hold a header
+//                   back from its payload, short reads and writes are
+//                   resumed where they stopped, and no transfer waits past
+//                   the deadline of the command it carries.
+//
+//   Author        : Matthew Kelleher
+//   Last Modified : 12/1/21
+//
+
+// Includes
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Project Includes
+#include "fs3_transport.h"
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transport_connect
+// Description  : Connects a socket to a server, non-blocking and with Nagle
+//                off so pipelined commands go out as soon as they are sent
+//
+// Inputs       : ip - address of the server
+//                port - port of the server
+//                deadline - time to give up connecting by (usec, monotonic)
+// Outputs      : socket if successful, -1 if failure
+
+int transport_connect(const char *ip, unsigned short port, uint64_t deadline) {
+	struct sockaddr_in caddr;
+	socklen_t length = sizeof(int);
+	int error = 0;
+	int on = 1;
+	int fd;
+
+	//Setup adress info
+	memset(&caddr, 0, sizeof(caddr));
+	caddr.sin_family = AF_INET;
+	caddr.sin_port = htons(port);
+	if(inet_aton(ip, &caddr.sin_addr) == 0){
+		errno = EINVAL;
+		return(-1);
+	}
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if(fd == -1){
+		return(-1);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	//Connects in the background, waiting no longer than the deadline
+	if(connect(fd, (const struct sockaddr *)&caddr, sizeof(caddr)) == -1){
+		if((errno != EINPROGRESS) || (transport_wait(fd, POLLOUT, deadline) == -1) ||
+				(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1) || (error != 0)){
+			if(error != 0){
+				errno = error;
+			}
+			error = errno;
+			close(fd);
+			errno = error;
+			return(-1);
+		}
+	}
+	return(fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transport_send
+// Description  : Sends every byte of a list of buffer segments, resuming
+//                after partial sends. A closed peer fails the send rather
+//                than raising SIGPIPE.
+//
+// Inputs       : fd - the socket
+//                iov - buffer segments to send (advanced as they are sent)
+//                iovcnt - number of segments
+//                deadline - time to give up by (usec, monotonic)
+// Outputs      : 0 if successful, -1 if failure
+
+int transport_send(int fd, struct iovec *iov, int iovcnt, uint64_t deadline) {
+	struct msghdr msg;
+	ssize_t result;
+
+	while(iovcnt > 0){
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		result = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if(result == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(((errno == EAGAIN) || (errno == EWOULDBLOCK)) && (transport_wait(fd, POLLOUT, deadline) == 0)){
+				continue;
+			}
+			return(-1);
+		}
+		transport_advance(&iov, &iovcnt, result);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transport_receive
+// Description  : Receives until every buffer segment is full, resuming after
+//                short reads, which are common with many commands in flight
+//
+// Inputs       : fd - the socket
+//                iov - buffer segments to fill (advanced as they fill)
+//                iovcnt - number of segments
+//                deadline - time to give up by (usec, monotonic)
+// Outputs      : 0 if successful, -1 if failure
+
+int transport_receive(int fd, struct iovec *iov, int iovcnt, uint64_t deadline) {
+	ssize_t result;
+
+	while(iovcnt > 0){
+		result = readv(fd, iov, iovcnt);
+		if(result == 0){
+			errno = ECONNRESET;
+			return(-1);
+		}
+		if(result == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(((errno == EAGAIN) || (errno == EWOULDBLOCK)) && (transport_wait(fd, POLLIN, deadline) == 0)){
+				continue;
+			}
+			return(-1);
+		}
+		transport_advance(&iov, &iovcnt, result);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transport_wait
+// Description  : Waits until a socket is ready or the deadline passes
+//
+// Inputs       : fd - the socket
+//                events - poll events to wait for
+//                deadline - time to give up by (usec, monotonic)
+// Outputs      : 0 if ready, -1 if failure or the deadline passed (ETIMEDOUT)
+
+int transport_wait(int fd, short events, uint64_t deadline) {
+	struct pollfd pfd;
+	uint64_t now;
+	int timeout;
+	int result;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while(1){
+		//Waits in whole msec, rounding up so the deadline is not missed by a poll too short
+		timeout = -1;
+		if(deadline != FS3_TRANSPORT_NO_DEADLINE){
+			now = transport_now();
+			if(now >= deadline){
+				errno = ETIMEDOUT;
+				return(-1);
+			}
+			timeout = (int)((deadline-now+999)/1000);
+		}
+		result = poll(&pfd, 1, timeout);
+		if(result > 0){
+			return(0);
+		}
+		if((result == -1) && (errno != EINTR)){
+			return(-1);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transport_advance
+// Description  : Moves past bytes already transferred in a list of buffer
+//                segments, dropping the segments done with
+//
+// Inputs       : iov - buffer segments, set to the first not done with
+//                iovcnt - number of segments, updated
+//                length - bytes transferred
+// Outputs      : none
+
+void transport_advance(struct iovec **iov, int *iovcnt, size_t length) {
+	while((*iovcnt > 0) && (length >= (*iov)->iov_len)){
+		length -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+	if(*iovcnt > 0){
+		(*iov)->iov_base = (char *)(*iov)->iov_base+length;
+		(*iov)->iov_len -= length;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transport_deadline
+// Description  : Gets the deadline of a transfer that may take timeoutMs
+//
+// Inputs       : timeoutMs - msec the transfer may take (not positive for no limit)
+// Outputs      : the deadline (usec, monotonic)
+
+uint64_t transport_deadline(int timeoutMs) {
+	if(timeoutMs <= 0){
+		return(FS3_TRANSPORT_NO_DEADLINE);
+	}
+	return(transport_now()+(uint64_t)timeoutMs*1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transport_now
+// Description  : Gets monotonic time in usec
+//
+// Inputs       : none
+// Outputs      : the time
+
+uint64_t transport_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t)now.tv_sec*1000000+now.tv_nsec/1000);
+}
@@ -0,0 +1,48 @@
+#ifndef FS3_TRANSPORT_INCLUDED
+#define FS3_TRANSPORT_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_transport.h
+//  Description    : This is the interface for the socket transport of the FS3
+//                   client. Sockets are non-blocking with Nagle off, a command
+//                   goes out with its sectors in one vectored send, and every
+//                   send and receive loops over partial transfers until done
+//                   or its deadline passes.
+//
+//  Author         : Matthew Kelleher
+//  Last Modified  : 12/1/21
+//
+
+// Include files
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Defines
+#define FS3_TRANSPORT_NO_DEADLINE UINT64_MAX	//Deadline of a transfer that may wait forever
+
+//
+// Transport functions
+
+int transport_connect(const char *ip, unsigned short port, uint64_t deadline);
+	//Connects a non-blocking socket with Nagle off (returns socket, -1 if failure)
+
+int transport_send(int fd, struct iovec *iov, int iovcnt, uint64_t deadline);
+	//Sends every byte of the buffer segments, in as few syscalls as the socket allows
+
+int transport_receive(int fd, struct iovec *iov, int iovcnt, uint64_t deadline);
+	//Receives until every buffer segment is full
+
+int transport_wait(int fd, short events, uint64_t deadline);
+	//Waits until the socket is ready or the deadline passes
+
+void transport_advance(struct iovec **iov, int *iovcnt, size_t length);
+	//Moves past bytes already transferred in a list of buffer segments
+
+uint64_t transport_deadline(int timeoutMs);
+	//Gets the deadline timeoutMs from now (no deadline if not positive)
+
+uint64_t transport_now(void);
+	//Gets monotonic time in usec
+
+#endif